@@ -0,0 +1,139 @@
+/*
+ * netifd - network interface daemon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Delegates P /48 prefixes to N interfaces with ip6assign 64 and measures
+ * the initial assignment, an assignment refresh with and without changed
+ * interfaces, and disabling and enabling the interface addresses, which
+ * walks the assignments of each interface. Defaults to 500 interfaces and
+ * 20 prefixes; build with DUMMY_MODE to measure only the netifd side.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <libubox/blobmsg.h>
+
+#include "netifd.h"
+#include "device.h"
+#include "interface.h"
+#include "interface-ip.h"
+#include "bench.h"
+
+static struct interface *
+bench_iface_add(int i)
+{
+	static struct blob_buf b;
+	struct blob_attr *config;
+	struct interface *iface;
+	char name[IFNAMSIZ];
+
+	snprintf(name, sizeof(name), "bench%d", i);
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u32(&b, "ip6assign", 64);
+	config = blob_memdup(b.head);
+	if (!config)
+		return NULL;
+
+	iface = interface_alloc(name, config);
+	iface->config = config;
+
+	/*
+	 * Insert into the interface list without the vlist update callback,
+	 * which would set up the protocol and publish the interface on ubus.
+	 */
+	iface->node.avl.key = iface->name;
+	iface->node.version = interfaces.version;
+	avl_insert(&interfaces.avl, &iface->node.avl);
+
+	iface->state = IFS_UP;
+	interface_set_l3_dev(iface, device_get(name, true));
+	interface_ip_set_enabled(&iface->config_ip, true);
+
+	return iface;
+}
+
+static void
+bench_refresh(const char *name, int n, bool changed)
+{
+	struct interface *iface;
+	uint64_t start;
+
+	vlist_for_each_element(&interfaces, iface, node)
+		iface->assignment_changed = changed;
+
+	start = bench_time();
+	interface_refresh_assignments(true);
+	interface_refresh_assignments(false);
+	bench_report(name, n, bench_time() - start);
+}
+
+static void
+bench_set_enabled(struct interface **ifaces, int n, bool enabled)
+{
+	uint64_t start;
+	int i;
+
+	start = bench_time();
+	for (i = 0; i < n; i++)
+		interface_ip_set_enabled(&ifaces[i]->config_ip, enabled);
+	bench_report(enabled ? "enable" : "disable", n, bench_time() - start);
+}
+
+int main(int argc, char **argv)
+{
+	struct interface **ifaces;
+	struct in6_addr addr;
+	uint64_t start;
+	int i, n_iface, n_prefix;
+
+	n_iface = argc > 1 ? atoi(argv[1]) : 500;
+	n_prefix = argc > 2 ? atoi(argv[2]) : 20;
+	if (n_iface <= 0 || n_iface > 65536 || n_prefix <= 0 || n_prefix > 65536)
+		return 1;
+
+	if (bench_init())
+		return 1;
+
+	ifaces = calloc(n_iface, sizeof(*ifaces));
+	if (!ifaces)
+		return 1;
+
+	for (i = 0; i < n_iface; i++) {
+		ifaces[i] = bench_iface_add(i);
+		if (!ifaces[i])
+			return 1;
+	}
+
+	printf("%d interfaces, %d prefixes:\n", n_iface, n_prefix);
+
+	start = bench_time();
+	for (i = 0; i < n_prefix; i++) {
+		inet_pton(AF_INET6, "2001:db8::", &addr);
+		addr.s6_addr[4] = i >> 8;
+		addr.s6_addr[5] = i;
+		interface_ip_add_device_prefix(NULL, &addr, 48, 0, 0, NULL, 0, "bench");
+	}
+	bench_report("assign", n_iface * n_prefix, bench_time() - start);
+
+	bench_refresh("refresh (unchanged)", n_iface * n_prefix, false);
+	bench_refresh("refresh (all changed)", n_iface * n_prefix, true);
+
+	bench_set_enabled(ifaces, n_iface, false);
+	bench_set_enabled(ifaces, n_iface, true);
+
+	free(ifaces);
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * netifd - network interface daemon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Adds and removes N unreachable /32 routes in a private table, one request
+ * at a time and inside a system_batch_begin()/system_batch_commit() pair.
+ * Against the kernel this needs CAP_NET_ADMIN; in DUMMY_MODE it measures
+ * only the netifd side.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "netifd.h"
+#include "interface-ip.h"
+#include "system.h"
+#include "bench.h"
+
+#define BENCH_TABLE	4242
+
+static struct device_route *
+bench_routes_alloc(int n)
+{
+	struct device_route *routes;
+	int i;
+
+	routes = calloc(n, sizeof(*routes));
+	if (!routes)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		struct device_route *r = &routes[i];
+
+		r->flags = DEVADDR_INET4 | DEVROUTE_TABLE;
+		r->table = BENCH_TABLE;
+		r->mask = 32;
+		r->addr.in.s_addr = htonl(0x0a000000 | i);
+	}
+
+	return routes;
+}
+
+static void
+bench_routes_run(struct device_route *routes, int n, bool batch)
+{
+	uint64_t start;
+	int i, failed = 0;
+
+	start = bench_time();
+	if (batch)
+		system_batch_begin();
+
+	for (i = 0; i < n; i++)
+		if (system_add_route(NULL, &routes[i]))
+			failed++;
+
+	if (batch)
+		system_batch_commit();
+
+	bench_report(batch ? "add (batched)" : "add", n, bench_time() - start);
+
+	for (i = 0; i < n; i++) {
+		if (routes[i].failed)
+			failed++;
+		routes[i].failed = false;
+	}
+
+	start = bench_time();
+	if (batch)
+		system_batch_begin();
+
+	for (i = 0; i < n; i++)
+		system_del_route(NULL, &routes[i]);
+
+	if (batch)
+		system_batch_commit();
+
+	bench_report(batch ? "del (batched)" : "del", n, bench_time() - start);
+
+	if (failed)
+		fprintf(stderr, "  %d route additions failed\n", failed);
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_counts[] = { 1000, 10000 };
+	struct device_route *routes;
+	int i, n, count;
+
+	if (bench_init())
+		return 1;
+
+	count = argc > 1 ? argc - 1 : ARRAY_SIZE(default_counts);
+	for (i = 0; i < count; i++) {
+		n = argc > 1 ? atoi(argv[i + 1]) : default_counts[i];
+		if (n <= 0 || n > 0xffffff)
+			continue;
+
+		routes = bench_routes_alloc(n);
+		if (!routes)
+			return 1;
+
+		printf("%d routes:\n", n);
+		bench_routes_run(routes, n, false);
+		bench_routes_run(routes, n, true);
+		free(routes);
+	}
+
+	return 0;
+}
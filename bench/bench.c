@@ -0,0 +1,86 @@
+/*
+ * netifd - network interface daemon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "netifd.h"
+#include "system.h"
+#include "bench.h"
+
+/*
+ * Replacements for the globals and helpers of main.c, so that the benchmarks
+ * can link against the rest of netifd without running any scripts.
+ */
+unsigned int debug_mask = 0;
+const char *main_path = DEFAULT_MAIN_PATH;
+const char *config_path = DEFAULT_CONFIG_PATH;
+const char *resolv_conf = "/dev/null/resolv.conf";
+
+void
+netifd_log_message(int priority, const char *format, ...)
+{
+	va_list vl;
+
+	if (priority > L_WARNING)
+		return;
+
+	va_start(vl, format);
+	vfprintf(stderr, format, vl);
+	va_end(vl);
+}
+
+int
+netifd_start_process(const char **argv, char **env, struct netifd_process *proc)
+{
+	return -1;
+}
+
+void
+netifd_kill_process(struct netifd_process *proc)
+{
+}
+
+void netifd_reload(void)
+{
+}
+
+void netifd_restart(void)
+{
+}
+
+int bench_init(void)
+{
+	if (uloop_init() < 0 || system_init()) {
+		fprintf(stderr, "Failed to initialize the system layer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+uint64_t bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_report(const char *name, int n, uint64_t nsec)
+{
+	double sec = nsec / 1e9;
+
+	printf("  %-24s %8d ops %10.3f ms %12.0f ops/s\n", name, n,
+	       sec * 1e3, sec > 0 ? n / sec : 0);
+}
@@ -0,0 +1,22 @@
+/*
+ * netifd - network interface daemon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef __NETIFD_BENCH_H
+#define __NETIFD_BENCH_H
+
+#include <stdint.h>
+
+int bench_init(void);
+uint64_t bench_time(void);
+void bench_report(const char *name, int n, uint64_t nsec);
+
+#endif
@@ -116,6 +116,7 @@ struct bridge_member {
 	struct bridge_state *bst;
 	struct device_user dev;
 	bool present;
+	bool failed;
 	char name[];
 };
 
@@ -189,6 +190,37 @@ bridge_disable_interface(struct bridge_state *bst)
 	bst->active = false;
 }
 
+/* recompute the GSO/GRO limits the bridge takes over from its members */
+static bool
+bridge_update_gso_limits(struct bridge_state *bst)
+{
+	struct device_settings *s = &bst->dev.settings;
+	unsigned int gso[__DEV_GSO_LIMIT_MAX];
+	unsigned int gso_mask = s->gso_mask;
+	struct bridge_member *bm;
+
+	memcpy(gso, s->gso, sizeof(gso));
+	if (!device_reset_gso_limits(&bst->dev))
+		return false;
+
+	vlist_for_each_element(&bst->members, bm, node)
+		if (bm->present)
+			device_inherit_gso_limits(&bst->dev, bm->dev.dev);
+
+	return s->gso_mask != gso_mask || memcmp(s->gso, gso, sizeof(gso));
+}
+
+static void
+bridge_fail_member(struct bridge_member *bm)
+{
+	struct bridge_state *bst = bm->bst;
+
+	bst->n_failed++;
+	bm->present = false;
+	bst->n_present--;
+	device_release(&bm->dev);
+}
+
 static int
 bridge_enable_member(struct bridge_member *bm)
 {
@@ -212,7 +244,8 @@ bridge_enable_member(struct bridge_member *bm)
 	if (ret < 0)
 		goto error;
 
-	ret = system_bridge_addif(&bst->dev, bm->dev.dev);
+	bm->failed = false;
+	ret = system_bridge_addif(&bst->dev, bm->dev.dev, &bm->failed);
 	if (ret < 0) {
 		D(DEVICE, "Bridge device %s could not be added\n", bm->dev.dev->ifname);
 		goto error;
@@ -224,11 +257,7 @@ bridge_enable_member(struct bridge_member *bm)
 	return 0;
 
 error:
-	bst->n_failed++;
-	bm->present = false;
-	bst->n_present--;
-	device_release(&bm->dev);
-
+	bridge_fail_member(bm);
 	return ret;
 }
 
@@ -249,6 +278,10 @@ bridge_remove_member(struct bridge_member *bm)
 	bm->present = false;
 	bm->bst->n_present--;
 
+	if (bst->dev.active && bridge_update_gso_limits(bst))
+		system_if_apply_settings(&bst->dev, &bst->dev.settings,
+					 DEV_OPT_GSO_LIMITS);
+
 	if (bst->config.bridge_empty)
 		return;
 
@@ -305,13 +338,17 @@ bridge_member_cb(struct device_user *dev, enum device_event ev)
 		if (bst->n_present == 1)
 			device_set_present(&bst->dev, true);
 		if (bst->dev.active && !bridge_enable_member(bm)) {
+			bridge_update_gso_limits(bst);
+
 			/*
-			 * Adding a bridge member can overwrite the bridge mtu
-			 * in the kernel, apply the bridge settings in case the
-			 * bridge mtu is set
+			 * Adding a bridge member makes the kernel recalculate
+			 * the bridge mtu and its GSO size and segment limits
+			 * from all ports, apply the bridge settings again in
+			 * case they are set
 			 */
 			system_if_apply_settings(&bst->dev, &bst->dev.settings,
-						 DEV_OPT_MTU | DEV_OPT_MTU6);
+						 DEV_OPT_MTU | DEV_OPT_MTU6 |
+						 DEV_OPT_GSO_LIMITS);
 		}
 
 		break;
@@ -360,9 +397,20 @@ bridge_set_up(struct bridge_state *bst)
 			return ret;
 	}
 
+	/* the members are enslaved with one batch of requests */
 	bst->n_failed = 0;
+	system_batch_begin();
 	vlist_for_each_element(&bst->members, bm, node)
 		bridge_enable_member(bm);
+	system_batch_commit();
+
+	vlist_for_each_element(&bst->members, bm, node) {
+		if (!bm->present || !bm->failed)
+			continue;
+
+		D(DEVICE, "Bridge device %s could not be added\n", bm->dev.dev->ifname);
+		bridge_fail_member(bm);
+	}
 	bridge_check_retry(bst);
 
 	if (!bst->force_active && !bst->n_present) {
@@ -372,6 +420,8 @@ bridge_set_up(struct bridge_state *bst)
 		return -ENOENT;
 	}
 
+	/* applied with the other settings once the bridge is up */
+	bridge_update_gso_limits(bst);
 	bridge_reset_primary(bst);
 	ret = bst->set_state(&bst->dev, true);
 	if (ret < 0)
@@ -566,6 +616,7 @@ bridge_apply_settings(struct bridge_state *bst, struct blob_attr **tb)
 	struct blob_attr *cur;
 
 	/* defaults */
+	cfg->flags = 0;
 	cfg->stp = false;
 	cfg->forward_delay = 2;
 	cfg->robustness = 2;
@@ -677,7 +728,11 @@ bridge_reload(struct device *dev, struct blob_attr *attr)
 
 		diff = 0;
 		uci_blob_diff(tb_br, otb_br, &bridge_attr_list, &diff);
-		if (diff & ~(1 << BRIDGE_ATTR_IFNAME))
+		if (diff & (1 << BRIDGE_ATTR_BRIDGE_EMPTY))
+		    ret = DEV_CONFIG_RESTART;
+		else if ((diff & ~(1 << BRIDGE_ATTR_IFNAME)) &&
+			 ret != DEV_CONFIG_RESTART && bst->active &&
+			 system_bridge_reload(dev, &bst->config) < 0)
 		    ret = DEV_CONFIG_RESTART;
 
 		bridge_config_init(dev);
@@ -24,6 +24,7 @@
 #include "iprule.h"
 #include "proto.h"
 #include "wireless.h"
+#include "system.h"
 #include "config.h"
 
 bool config_init = false;
@@ -307,6 +308,23 @@ config_init_globals(void)
 
 	if (default_ps)
 		device_set_default_ps(strcmp(default_ps, "1") ? false : true);
+
+	const char *stats_cache = uci_lookup_option_string(
+			uci_ctx, globals, "stats_cache");
+
+	if (stats_cache)
+		system_set_stats_cache(strtoul(stats_cache, NULL, 0));
+
+	const char *stats_interval = uci_lookup_option_string(
+			uci_ctx, globals, "stats_interval");
+
+	if (stats_interval)
+		device_set_stats_interval(strtoul(stats_interval, NULL, 0));
+
+	const char *event_filter = uci_lookup_option_string(
+			uci_ctx, globals, "event_filter");
+
+	device_set_event_filter(event_filter && !strcmp(event_filter, "1"));
 }
 
 static void
@@ -467,6 +485,7 @@ config_init_all(void)
 	config_init = true;
 	device_lock();
 
+	system_if_clear_state_begin();
 	device_reset_config();
 	config_init_devices();
 	config_init_interfaces();
@@ -474,6 +493,7 @@ config_init_all(void)
 	config_init_rules();
 	config_init_globals();
 	config_init_wireless();
+	system_if_clear_state_commit();
 
 	config_init = false;
 	device_unlock();
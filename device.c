@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -33,6 +34,10 @@
 static struct list_head devtypes = LIST_HEAD_INIT(devtypes);
 static struct avl_tree devices;
 static bool default_ps = true;
+static struct uloop_timeout stats_timer;
+static unsigned int stats_interval = 1000;
+static struct uloop_timeout event_filter_timer;
+static bool event_filter;
 
 static const struct blobmsg_policy dev_attrs[__DEV_ATTR_MAX] = {
 	[DEV_ATTR_TYPE] = { .name = "type", .type = BLOBMSG_TYPE_STRING },
@@ -60,6 +65,61 @@ static const struct blobmsg_policy dev_attrs[__DEV_ATTR_MAX] = {
 	[DEV_ATTR_UNICAST_FLOOD] = { .name ="unicast_flood", .type = BLOBMSG_TYPE_BOOL },
 	[DEV_ATTR_SENDREDIRECTS] = { .name = "sendredirects", .type = BLOBMSG_TYPE_BOOL },
 	[DEV_ATTR_NEIGHLOCKTIME] = { .name = "neighlocktime", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_PS_POLICY] = { .name = "ps_policy", .type = BLOBMSG_TYPE_STRING },
+	[DEV_ATTR_PS_CPUS] = { .name = "ps_cpus", .type = BLOBMSG_TYPE_STRING },
+	[DEV_ATTR_PS_EXCLUDE] = { .name = "ps_exclude", .type = BLOBMSG_TYPE_STRING },
+	[DEV_ATTR_RFS_ENTRIES] = { .name = "rfs_entries", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_STATS_HISTORY] = { .name = "stats_history", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_GRO] = { .name = "gro", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_GSO] = { .name = "gso", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_TSO] = { .name = "tso", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_LRO] = { .name = "lro", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_RX_GRO_LIST] = { .name = "rx_gro_list", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_RX_UDP_GRO_FORWARDING] = { .name = "rx_udp_gro_forwarding", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_RXRING] = { .name = "rxring", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_TXRING] = { .name = "txring", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_COMBINED_CHANNELS] = { .name = "combined_channels", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_RX_CHANNELS] = { .name = "rx_channels", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_TX_CHANNELS] = { .name = "tx_channels", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_RX_USECS] = { .name = "rx_usecs", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_TX_USECS] = { .name = "tx_usecs", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_RX_FRAMES] = { .name = "rx_frames", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_TX_FRAMES] = { .name = "tx_frames", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_ADAPTIVE_RX] = { .name = "adaptive_rx", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_ADAPTIVE_TX] = { .name = "adaptive_tx", .type = BLOBMSG_TYPE_BOOL },
+	[DEV_ATTR_QDISC] = { .name = "qdisc", .type = BLOBMSG_TYPE_STRING },
+	[DEV_ATTR_QDISC_CHILD] = { .name = "qdisc_child", .type = BLOBMSG_TYPE_STRING },
+	[DEV_ATTR_QDISC_BANDWIDTH] = { .name = "qdisc_bandwidth", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_QDISC_OVERHEAD] = { .name = "qdisc_overhead", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_QDISC_TARGET] = { .name = "qdisc_target", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_QDISC_LIMIT] = { .name = "qdisc_limit", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_XDP] = { .name = "xdp", .type = BLOBMSG_TYPE_STRING },
+	[DEV_ATTR_XDP_MODE] = { .name = "xdp_mode", .type = BLOBMSG_TYPE_STRING },
+	[DEV_ATTR_GSO_MAX_SIZE] = { .name = "gso_max_size", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_GRO_MAX_SIZE] = { .name = "gro_max_size", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_GSO_IPV4_MAX_SIZE] = { .name = "gso_ipv4_max_size", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_GRO_IPV4_MAX_SIZE] = { .name = "gro_ipv4_max_size", .type = BLOBMSG_TYPE_INT32 },
+	[DEV_ATTR_GSO_MAX_SEGS] = { .name = "gso_max_segs", .type = BLOBMSG_TYPE_INT32 },
+};
+
+static const char * const ps_policy_names[] = {
+	[DEV_PS_POLICY_ALL] = "all",
+	[DEV_PS_POLICY_SPREAD] = "spread",
+	[DEV_PS_POLICY_NUMA] = "numa",
+};
+
+static const char * const qdisc_names[] = {
+	[DEV_QDISC_FQ_CODEL] = "fq_codel",
+	[DEV_QDISC_CAKE] = "cake",
+	[DEV_QDISC_FQ] = "fq",
+	[DEV_QDISC_MQ] = "mq",
+};
+
+static const char * const xdp_mode_names[] = {
+	[DEV_XDP_MODE_AUTO] = "auto",
+	[DEV_XDP_MODE_GENERIC] = "generic",
+	[DEV_XDP_MODE_NATIVE] = "native",
+	[DEV_XDP_MODE_OFFLOAD] = "offload",
 };
 
 const struct uci_blob_param_list device_attr_list = {
@@ -195,6 +255,7 @@ device_merge_settings(struct device *dev, struct device_settings *n)
 {
 	struct device_settings *os = &dev->orig_settings;
 	struct device_settings *s = &dev->settings;
+	int i;
 
 	memset(n, 0, sizeof(*n));
 	n->mtu = s->flags & DEV_OPT_MTU ? s->mtu : os->mtu;
@@ -231,9 +292,179 @@ device_merge_settings(struct device *dev, struct device_settings *n)
 	n->unicast_flood = s->unicast_flood;
 	n->sendredirects = s->flags & DEV_OPT_SENDREDIRECTS ?
 		s->sendredirects : os->sendredirects;
+	n->ps_policy = s->ps_policy;
+	strcpy(n->ps_cpus, s->ps_cpus);
+	strcpy(n->ps_exclude, s->ps_exclude);
+	n->rfs_entries = s->flags & DEV_OPT_RFS ?
+		s->rfs_entries : os->rfs_entries;
+	n->rps_flow_cnt = os->rps_flow_cnt;
+	n->features_mask = s->features_mask | os->features_mask;
+	n->features = (s->features & s->features_mask) |
+		(os->features & os->features_mask & ~s->features_mask);
+	n->ethtool_mask = s->ethtool_mask | os->ethtool_mask;
+	for (i = 0; i < __DEV_ETHTOOL_MAX; i++)
+		n->ethtool[i] = s->ethtool_mask & (1 << i) ?
+			s->ethtool[i] : os->ethtool[i];
+	n->gso_mask = s->gso_mask | os->gso_mask;
+	for (i = 0; i < __DEV_GSO_LIMIT_MAX; i++)
+		n->gso[i] = s->gso_mask & (1 << i) ? s->gso[i] : os->gso[i];
+	n->qdisc = s->qdisc;
+	n->qdisc_child = s->qdisc_child;
+	n->qdisc_bandwidth = s->qdisc_bandwidth;
+	n->qdisc_overhead = s->qdisc_overhead;
+	n->qdisc_target = s->qdisc_target;
+	n->qdisc_limit = s->qdisc_limit;
+	strcpy(n->xdp, s->xdp);
+	n->xdp_mode = s->xdp_mode;
 	n->flags = s->flags | os->flags | os->valid_flags;
 }
 
+static uint64_t device_stats_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void device_stats_sample(struct uloop_timeout *t)
+{
+	struct device_stats_ring *r;
+	struct device *dev;
+	uint64_t now = device_stats_time();
+	bool active = false;
+
+	/* one netlink dump per interval for all sampled devices */
+	system_stats_invalidate();
+
+	avl_for_each_element(&devices, dev, avl) {
+		r = dev->stats;
+		if (!r)
+			continue;
+
+		active = true;
+		if (!dev->present ||
+		    system_if_get_stats(dev, &r->samples[r->head].c))
+			continue;
+
+		r->samples[r->head].time = now;
+		r->head = (r->head + 1) % r->size;
+		if (r->count < r->size)
+			r->count++;
+	}
+
+	if (active)
+		uloop_timeout_set(t, stats_interval);
+}
+
+void
+device_set_stats_interval(unsigned int msec)
+{
+	if (msec < 100)
+		msec = 100;
+
+	stats_interval = msec;
+	if (stats_timer.pending)
+		uloop_timeout_set(&stats_timer, stats_interval);
+}
+
+static void device_event_filter_cb(struct uloop_timeout *t)
+{
+	struct device *dev;
+	int *ifindex, n = 0;
+
+	ifindex = calloc(devices.count + 1, sizeof(*ifindex));
+	if (!ifindex)
+		return;
+
+	/* devices that are not set up yet have no ifindex assigned */
+	avl_for_each_element(&devices, dev, avl) {
+		int idx = dev->ifindex;
+
+		if (!idx && dev->sys_present)
+			idx = system_if_resolve(dev);
+
+		/* the link may be gone already */
+		if (idx)
+			ifindex[n++] = idx;
+	}
+
+	system_set_event_filter(ifindex, n);
+	free(ifindex);
+}
+
+/* coalesce changes to the set of managed devices into one filter update */
+static void device_update_event_filter(void)
+{
+	if (!event_filter)
+		return;
+
+	event_filter_timer.cb = device_event_filter_cb;
+	uloop_timeout_set(&event_filter_timer, 0);
+}
+
+void
+device_set_event_filter(bool enabled)
+{
+	if (enabled == event_filter)
+		return;
+
+	event_filter = enabled;
+	if (enabled) {
+		device_update_event_filter();
+	} else {
+		uloop_timeout_cancel(&event_filter_timer);
+		system_set_event_filter(NULL, 0);
+	}
+}
+
+static void
+device_set_stats_history(struct device *dev, unsigned int size)
+{
+	struct device_stats_ring *r = dev->stats;
+
+	if (size > DEV_STATS_HISTORY_MAX)
+		size = DEV_STATS_HISTORY_MAX;
+	else if (size == 1)
+		size = 2;
+
+	if (r && r->size == size)
+		return;
+
+	free(r);
+	dev->stats = NULL;
+	if (!size)
+		return;
+
+	r = calloc(1, sizeof(*r) + size * sizeof(r->samples[0]));
+	if (!r)
+		return;
+
+	r->size = size;
+	dev->stats = r;
+
+	if (!stats_timer.pending) {
+		stats_timer.cb = device_stats_sample;
+		uloop_timeout_set(&stats_timer, stats_interval);
+	}
+}
+
+static enum device_qdisc
+device_resolve_qdisc(struct blob_attr *cur)
+{
+	int i;
+
+	if (!cur)
+		return DEV_QDISC_NONE;
+
+	for (i = 0; i < ARRAY_SIZE(qdisc_names); i++)
+		if (qdisc_names[i] && !strcmp(blobmsg_data(cur), qdisc_names[i]))
+			return i;
+
+	DPRINTF("Unknown qdisc: %s\n", (char *) blobmsg_data(cur));
+	return DEV_QDISC_NONE;
+}
+
 void
 device_init_settings(struct device *dev, struct blob_attr **tb)
 {
@@ -241,6 +472,7 @@ device_init_settings(struct device *dev, struct blob_attr **tb)
 	struct blob_attr *cur;
 	struct ether_addr *ea;
 	bool disabled = false;
+	int i;
 
 	s->flags = 0;
 	if ((cur = tb[DEV_ATTR_ENABLED]))
@@ -336,6 +568,123 @@ device_init_settings(struct device *dev, struct blob_attr **tb)
 	else
 		s->xps = default_ps;
 
+	if ((cur = tb[DEV_ATTR_PS_POLICY])) {
+		for (i = 0; i < ARRAY_SIZE(ps_policy_names); i++) {
+			if (strcmp(blobmsg_data(cur), ps_policy_names[i]) != 0)
+				continue;
+
+			s->ps_policy = i;
+			s->flags |= DEV_OPT_PS_POLICY;
+			break;
+		}
+
+		if (!(s->flags & DEV_OPT_PS_POLICY))
+			DPRINTF("Failed to resolve ps_policy: %s\n", (char *) blobmsg_data(cur));
+	}
+
+	if ((cur = tb[DEV_ATTR_PS_CPUS])) {
+		if (blobmsg_data_len(cur) <= sizeof(s->ps_cpus)) {
+			strcpy(s->ps_cpus, blobmsg_data(cur));
+			s->flags |= DEV_OPT_PS_CPUS;
+		} else
+			DPRINTF("CPU list too long: %s\n", (char *) blobmsg_data(cur));
+	}
+
+	if ((cur = tb[DEV_ATTR_PS_EXCLUDE])) {
+		if (blobmsg_data_len(cur) <= sizeof(s->ps_exclude)) {
+			strcpy(s->ps_exclude, blobmsg_data(cur));
+			s->flags |= DEV_OPT_PS_EXCLUDE;
+		} else
+			DPRINTF("CPU list too long: %s\n", (char *) blobmsg_data(cur));
+	}
+
+	if ((cur = tb[DEV_ATTR_RFS_ENTRIES])) {
+		s->rfs_entries = blobmsg_get_u32(cur);
+		s->flags |= DEV_OPT_RFS;
+	}
+
+	s->features_mask = 0;
+	s->features = 0;
+	for (i = 0; i < __DEV_FEATURE_MAX; i++) {
+		if (!(cur = tb[DEV_ATTR_GRO + i]))
+			continue;
+
+		s->features_mask |= (1 << i);
+		if (blobmsg_get_bool(cur))
+			s->features |= (1 << i);
+		s->flags |= DEV_OPT_FEATURES;
+	}
+
+	s->ethtool_mask = 0;
+	for (i = 0; i < __DEV_ETHTOOL_MAX; i++) {
+		if (!(cur = tb[DEV_ATTR_RXRING + i]))
+			continue;
+
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_BOOL)
+			s->ethtool[i] = blobmsg_get_bool(cur);
+		else
+			s->ethtool[i] = blobmsg_get_u32(cur);
+		s->ethtool_mask |= (1 << i);
+
+		if (i <= DEV_ETHTOOL_TXRING)
+			s->flags |= DEV_OPT_RING;
+		else if (i <= DEV_ETHTOOL_TX_CHANNELS)
+			s->flags |= DEV_OPT_CHANNELS;
+		else
+			s->flags |= DEV_OPT_COALESCE;
+	}
+
+	s->gso_mask = 0;
+	dev->gso_inherited = false;
+	for (i = 0; i < __DEV_GSO_LIMIT_MAX; i++) {
+		if (!(cur = tb[DEV_ATTR_GSO_MAX_SIZE + i]))
+			continue;
+
+		s->gso[i] = blobmsg_get_u32(cur);
+		s->gso_mask |= (1 << i);
+		s->flags |= DEV_OPT_GSO_LIMITS;
+	}
+
+	s->qdisc = device_resolve_qdisc(tb[DEV_ATTR_QDISC]);
+	s->qdisc_child = DEV_QDISC_NONE;
+	if (s->qdisc == DEV_QDISC_MQ) {
+		s->qdisc_child = device_resolve_qdisc(tb[DEV_ATTR_QDISC_CHILD]);
+		if (s->qdisc_child == DEV_QDISC_MQ) {
+			DPRINTF("mq can not be used as a child qdisc\n");
+			s->qdisc_child = DEV_QDISC_NONE;
+		}
+		if (s->qdisc_child == DEV_QDISC_NONE)
+			s->qdisc_child = DEV_QDISC_FQ_CODEL;
+	}
+
+	s->qdisc_bandwidth = (cur = tb[DEV_ATTR_QDISC_BANDWIDTH]) ? blobmsg_get_u32(cur) : 0;
+	s->qdisc_overhead = (cur = tb[DEV_ATTR_QDISC_OVERHEAD]) ? (int) blobmsg_get_u32(cur) : 0;
+	s->qdisc_target = (cur = tb[DEV_ATTR_QDISC_TARGET]) ? blobmsg_get_u32(cur) : 0;
+	s->qdisc_limit = (cur = tb[DEV_ATTR_QDISC_LIMIT]) ? blobmsg_get_u32(cur) : 0;
+
+	s->xdp[0] = 0;
+	if ((cur = tb[DEV_ATTR_XDP])) {
+		if (blobmsg_data_len(cur) <= sizeof(s->xdp) &&
+		    *(char *) blobmsg_data(cur) == '/')
+			strcpy(s->xdp, blobmsg_data(cur));
+		else
+			DPRINTF("Invalid XDP program path: %s\n", (char *) blobmsg_data(cur));
+	}
+
+	s->xdp_mode = DEV_XDP_MODE_AUTO;
+	if ((cur = tb[DEV_ATTR_XDP_MODE])) {
+		for (i = 0; i < ARRAY_SIZE(xdp_mode_names); i++) {
+			if (strcmp(blobmsg_data(cur), xdp_mode_names[i]) != 0)
+				continue;
+
+			s->xdp_mode = i;
+			break;
+		}
+
+		if (i == ARRAY_SIZE(xdp_mode_names))
+			DPRINTF("Unknown xdp_mode: %s\n", (char *) blobmsg_data(cur));
+	}
+
 	if ((cur = tb[DEV_ATTR_DADTRANSMITS])) {
 		s->dadtransmits = blobmsg_get_u32(cur);
 		s->flags |= DEV_OPT_DADTRANSMITS;
@@ -379,9 +728,60 @@ device_init_settings(struct device *dev, struct blob_attr **tb)
 		s->flags |= DEV_OPT_SENDREDIRECTS;
 	}
 
+	cur = tb[DEV_ATTR_STATS_HISTORY];
+	device_set_stats_history(dev, cur ? blobmsg_get_u32(cur) : 0);
+
 	device_set_disabled(dev, disabled);
 }
 
+/*
+ * A stacked device (VLAN, bridge) that configures no GSO/GRO limits of its
+ * own takes over the smallest limits of its lower devices. They are
+ * recomputed whenever the lower devices change, by resetting them and then
+ * inheriting from every current lower device. Returns false if dev
+ * configures its own limits.
+ */
+bool
+device_reset_gso_limits(struct device *dev)
+{
+	struct device_settings *s = &dev->settings;
+
+	if ((s->flags & DEV_OPT_GSO_LIMITS) && !dev->gso_inherited)
+		return false;
+
+	s->flags &= ~DEV_OPT_GSO_LIMITS;
+	s->gso_mask = 0;
+	dev->gso_inherited = true;
+
+	return true;
+}
+
+void
+device_inherit_gso_limits(struct device *dev, struct device *lower)
+{
+	struct device_settings *s = &dev->settings;
+	struct device_settings *ls;
+	int i;
+
+	if (!dev->gso_inherited || !lower ||
+	    !(lower->settings.flags & DEV_OPT_GSO_LIMITS))
+		return;
+
+	ls = &lower->settings;
+	for (i = 0; i < __DEV_GSO_LIMIT_MAX; i++) {
+		if (!(ls->gso_mask & (1 << i)))
+			continue;
+
+		if ((s->gso_mask & (1 << i)) && s->gso[i] <= ls->gso[i])
+			continue;
+
+		s->gso[i] = ls->gso[i];
+		s->gso_mask |= (1 << i);
+	}
+
+	s->flags |= DEV_OPT_GSO_LIMITS;
+}
+
 static void __init dev_init(void)
 {
 	avl_init(&devices, avl_strcmp, true, NULL);
@@ -510,6 +910,7 @@ int device_init(struct device *dev, struct device_type *type, const char *ifname
 	if (ret < 0)
 		return ret;
 
+	device_update_event_filter();
 	system_if_clear_state(dev);
 	device_check_state(dev);
 	dev->settings.rps = default_ps;
@@ -584,6 +985,8 @@ device_delete(struct device *dev)
 	D(DEVICE, "Delete device '%s' from list\n", dev->ifname);
 	avl_delete(&devices, &dev->avl);
 	dev->avl.key = NULL;
+	system_if_free_state(dev);
+	device_update_event_filter();
 }
 
 static int device_cleanup_cb(void *ctx, struct safe_list *list)
@@ -631,6 +1034,7 @@ void device_set_present(struct device *dev, bool state)
 
 	D(DEVICE, "%s '%s' %s present\n", dev->type->name, dev->ifname, state ? "is now" : "is no longer" );
 	dev->sys_present = state;
+	device_update_event_filter();
 	device_refresh_present(dev);
 }
 
@@ -651,6 +1055,7 @@ void device_set_ifindex(struct device *dev, int ifindex)
 		return;
 
 	dev->ifindex = ifindex;
+	device_update_event_filter();
 	device_broadcast_event(dev, DEV_EVENT_UPDATE_IFINDEX);
 }
 
@@ -669,6 +1074,7 @@ int device_set_ifname(struct device *dev, const char *name)
 	if (dev->avl.key)
 		ret = avl_insert(&devices, &dev->avl);
 
+	device_update_event_filter();
 	if (ret == 0)
 		device_broadcast_event(dev, DEV_EVENT_UPDATE_IFNAME);
 
@@ -733,6 +1139,7 @@ device_free(struct device *dev)
 {
 	__devlock++;
 	free(dev->config);
+	free(dev->stats);
 	device_cleanup(dev);
 	dev->type->free(dev);
 	__devlock--;
@@ -994,6 +1401,7 @@ device_dump_status(struct blob_buf *b, struct device *dev)
 {
 	struct device_settings st;
 	void *c, *s;
+	int i;
 
 	if (!dev) {
 		avl_for_each_element(&devices, dev, avl) {
@@ -1070,6 +1478,58 @@ device_dump_status(struct blob_buf *b, struct device *dev)
 			blobmsg_add_u8(b, "unicast_flood", st.unicast_flood);
 		if (st.flags & DEV_OPT_SENDREDIRECTS)
 			blobmsg_add_u8(b, "sendredirects", st.sendredirects);
+		if (st.flags & DEV_OPT_PS_POLICY)
+			blobmsg_add_string(b, "ps_policy", ps_policy_names[st.ps_policy]);
+		if (st.flags & DEV_OPT_PS_CPUS)
+			blobmsg_add_string(b, "ps_cpus", st.ps_cpus);
+		if (st.flags & DEV_OPT_PS_EXCLUDE)
+			blobmsg_add_string(b, "ps_exclude", st.ps_exclude);
+		if (st.flags & DEV_OPT_RFS)
+			blobmsg_add_u32(b, "rfs_entries", st.rfs_entries);
+		if (st.flags & DEV_OPT_FEATURES) {
+			c = blobmsg_open_table(b, "features");
+			for (i = 0; i < __DEV_FEATURE_MAX; i++)
+				if (st.features_mask & (1 << i))
+					blobmsg_add_u8(b, dev_attrs[DEV_ATTR_GRO + i].name,
+						       !!(st.features & (1 << i)));
+			blobmsg_close_table(b, c);
+		}
+		for (i = 0; i < __DEV_ETHTOOL_MAX; i++) {
+			const struct blobmsg_policy *p = &dev_attrs[DEV_ATTR_RXRING + i];
+
+			if (!(st.ethtool_mask & (1 << i)))
+				continue;
+
+			if (p->type == BLOBMSG_TYPE_BOOL)
+				blobmsg_add_u8(b, p->name, st.ethtool[i]);
+			else
+				blobmsg_add_u32(b, p->name, st.ethtool[i]);
+		}
+		for (i = 0; i < __DEV_GSO_LIMIT_MAX; i++)
+			if (st.gso_mask & (1 << i))
+				blobmsg_add_u32(b, dev_attrs[DEV_ATTR_GSO_MAX_SIZE + i].name,
+						st.gso[i]);
+		if (st.qdisc != DEV_QDISC_NONE) {
+			c = blobmsg_open_table(b, "qdisc");
+			blobmsg_add_string(b, "kind", qdisc_names[st.qdisc]);
+			if (st.qdisc_child != DEV_QDISC_NONE)
+				blobmsg_add_string(b, "child", qdisc_names[st.qdisc_child]);
+			if (st.qdisc_bandwidth)
+				blobmsg_add_u32(b, "bandwidth", st.qdisc_bandwidth);
+			if (st.qdisc_overhead)
+				blobmsg_add_u32(b, "overhead", st.qdisc_overhead);
+			if (st.qdisc_target)
+				blobmsg_add_u32(b, "target", st.qdisc_target);
+			if (st.qdisc_limit)
+				blobmsg_add_u32(b, "limit", st.qdisc_limit);
+			blobmsg_close_table(b, c);
+		}
+		if (st.xdp[0]) {
+			c = blobmsg_open_table(b, "xdp");
+			blobmsg_add_string(b, "program", st.xdp);
+			blobmsg_add_string(b, "mode", xdp_mode_names[st.xdp_mode]);
+			blobmsg_close_table(b, c);
+		}
 	}
 
 	s = blobmsg_open_table(b, "statistics");
@@ -1080,6 +1540,84 @@ device_dump_status(struct blob_buf *b, struct device *dev)
 	blobmsg_close_table(b, s);
 }
 
+static void
+device_dump_rate(struct blob_buf *b, const char *name, uint64_t cur,
+		 uint64_t prev, uint64_t msec)
+{
+	/* counters go back to zero when a device is recreated */
+	blobmsg_add_u64(b, name, cur >= prev ? (cur - prev) * 1000 / msec : 0);
+}
+
+static void
+device_dump_rates_sample(struct blob_buf *b, struct device_stats_ring *r,
+			 unsigned int idx)
+{
+	unsigned int cur = (r->head + r->size - 1 - idx) % r->size;
+	unsigned int prev = (cur + r->size - 1) % r->size;
+	const struct device_counters *c = &r->samples[cur].c;
+	const struct device_counters *p = &r->samples[prev].c;
+	uint64_t msec = r->samples[cur].time - r->samples[prev].time;
+
+	if (!msec)
+		msec = 1;
+
+	device_dump_rate(b, "rx_bytes", c->rx_bytes, p->rx_bytes, msec);
+	device_dump_rate(b, "tx_bytes", c->tx_bytes, p->tx_bytes, msec);
+	device_dump_rate(b, "rx_packets", c->rx_packets, p->rx_packets, msec);
+	device_dump_rate(b, "tx_packets", c->tx_packets, p->tx_packets, msec);
+	device_dump_rate(b, "rx_dropped", c->rx_dropped, p->rx_dropped, msec);
+	device_dump_rate(b, "tx_dropped", c->tx_dropped, p->tx_dropped, msec);
+	device_dump_rate(b, "rx_errors", c->rx_errors, p->rx_errors, msec);
+	device_dump_rate(b, "tx_errors", c->tx_errors, p->tx_errors, msec);
+}
+
+/* rates are per second, history is ordered from newest to oldest */
+void
+device_dump_rates(struct blob_buf *b, struct device *dev)
+{
+	struct device_stats_ring *r;
+	uint64_t now = device_stats_time();
+	unsigned int i, cur;
+	void *c, *h;
+
+	if (!dev) {
+		avl_for_each_element(&devices, dev, avl) {
+			if (!dev->stats)
+				continue;
+			c = blobmsg_open_table(b, dev->ifname);
+			device_dump_rates(b, dev);
+			blobmsg_close_table(b, c);
+		}
+
+		return;
+	}
+
+	r = dev->stats;
+	if (!r)
+		return;
+
+	blobmsg_add_u32(b, "interval", stats_interval);
+	blobmsg_add_u32(b, "samples", r->count);
+
+	if (r->count < 2)
+		return;
+
+	c = blobmsg_open_table(b, "rate");
+	device_dump_rates_sample(b, r, 0);
+	blobmsg_close_table(b, c);
+
+	h = blobmsg_open_array(b, "history");
+	for (i = 0; i < r->count - 1; i++) {
+		cur = (r->head + r->size - 1 - i) % r->size;
+
+		c = blobmsg_open_table(b, NULL);
+		blobmsg_add_u64(b, "age", now - r->samples[cur].time);
+		device_dump_rates_sample(b, r, i);
+		blobmsg_close_table(b, c);
+	}
+	blobmsg_close_array(b, h);
+}
+
 static void __init simple_device_type_init(void)
 {
 	device_type_add(&simple_device_type);
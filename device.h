@@ -52,6 +52,41 @@ enum {
 	DEV_ATTR_NEIGHGCSTALETIME,
 	DEV_ATTR_SENDREDIRECTS,
 	DEV_ATTR_NEIGHLOCKTIME,
+	DEV_ATTR_PS_POLICY,
+	DEV_ATTR_PS_CPUS,
+	DEV_ATTR_PS_EXCLUDE,
+	DEV_ATTR_RFS_ENTRIES,
+	DEV_ATTR_STATS_HISTORY,
+	DEV_ATTR_GRO,
+	DEV_ATTR_GSO,
+	DEV_ATTR_TSO,
+	DEV_ATTR_LRO,
+	DEV_ATTR_RX_GRO_LIST,
+	DEV_ATTR_RX_UDP_GRO_FORWARDING,
+	DEV_ATTR_RXRING,
+	DEV_ATTR_TXRING,
+	DEV_ATTR_COMBINED_CHANNELS,
+	DEV_ATTR_RX_CHANNELS,
+	DEV_ATTR_TX_CHANNELS,
+	DEV_ATTR_RX_USECS,
+	DEV_ATTR_TX_USECS,
+	DEV_ATTR_RX_FRAMES,
+	DEV_ATTR_TX_FRAMES,
+	DEV_ATTR_ADAPTIVE_RX,
+	DEV_ATTR_ADAPTIVE_TX,
+	DEV_ATTR_QDISC,
+	DEV_ATTR_QDISC_CHILD,
+	DEV_ATTR_QDISC_BANDWIDTH,
+	DEV_ATTR_QDISC_OVERHEAD,
+	DEV_ATTR_QDISC_TARGET,
+	DEV_ATTR_QDISC_LIMIT,
+	DEV_ATTR_XDP,
+	DEV_ATTR_XDP_MODE,
+	DEV_ATTR_GSO_MAX_SIZE,
+	DEV_ATTR_GRO_MAX_SIZE,
+	DEV_ATTR_GSO_IPV4_MAX_SIZE,
+	DEV_ATTR_GRO_IPV4_MAX_SIZE,
+	DEV_ATTR_GSO_MAX_SEGS,
 	__DEV_ATTR_MAX,
 };
 
@@ -105,6 +140,76 @@ enum {
 	DEV_OPT_MULTICAST_FAST_LEAVE	= (1 << 20),
 	DEV_OPT_SENDREDIRECTS		= (1 << 21),
 	DEV_OPT_NEIGHLOCKTIME		= (1 << 22),
+	DEV_OPT_PS_POLICY		= (1 << 23),
+	DEV_OPT_PS_CPUS			= (1 << 24),
+	DEV_OPT_PS_EXCLUDE		= (1 << 25),
+	DEV_OPT_RFS			= (1 << 26),
+	DEV_OPT_FEATURES		= (1 << 27),
+	DEV_OPT_RING			= (1 << 28),
+	DEV_OPT_CHANNELS		= (1 << 29),
+	DEV_OPT_COALESCE		= (1 << 30),
+	DEV_OPT_GSO_LIMITS		= (1U << 31),
+};
+
+/* offload features, in the same order as their DEV_ATTR_* entries */
+enum device_feature {
+	DEV_FEATURE_GRO,
+	DEV_FEATURE_GSO,
+	DEV_FEATURE_TSO,
+	DEV_FEATURE_LRO,
+	DEV_FEATURE_RX_GRO_LIST,
+	DEV_FEATURE_RX_UDP_GRO_FORWARDING,
+	__DEV_FEATURE_MAX
+};
+
+/* NIC ring, channel and coalesce parameters, in DEV_ATTR_* order */
+enum device_ethtool_param {
+	DEV_ETHTOOL_RXRING,
+	DEV_ETHTOOL_TXRING,
+	DEV_ETHTOOL_COMBINED_CHANNELS,
+	DEV_ETHTOOL_RX_CHANNELS,
+	DEV_ETHTOOL_TX_CHANNELS,
+	DEV_ETHTOOL_RX_USECS,
+	DEV_ETHTOOL_TX_USECS,
+	DEV_ETHTOOL_RX_FRAMES,
+	DEV_ETHTOOL_TX_FRAMES,
+	DEV_ETHTOOL_ADAPTIVE_RX,
+	DEV_ETHTOOL_ADAPTIVE_TX,
+	__DEV_ETHTOOL_MAX
+};
+
+/* GSO/GRO size limits, in DEV_ATTR_* order */
+enum device_gso_limit {
+	DEV_GSO_MAX_SIZE,
+	DEV_GRO_MAX_SIZE,
+	DEV_GSO_IPV4_MAX_SIZE,
+	DEV_GRO_IPV4_MAX_SIZE,
+	DEV_GSO_MAX_SEGS,
+	__DEV_GSO_LIMIT_MAX
+};
+
+/* root qdisc installed on setup, DEV_QDISC_NONE keeps the kernel default */
+enum device_qdisc {
+	DEV_QDISC_NONE,
+	DEV_QDISC_FQ_CODEL,
+	DEV_QDISC_CAKE,
+	DEV_QDISC_FQ,
+	DEV_QDISC_MQ,
+};
+
+/* where an XDP program is attached, AUTO lets the kernel pick */
+enum device_xdp_mode {
+	DEV_XDP_MODE_AUTO,
+	DEV_XDP_MODE_GENERIC,
+	DEV_XDP_MODE_NATIVE,
+	DEV_XDP_MODE_OFFLOAD,
+};
+
+/* how RPS/XPS CPUs are assigned to the queues of a device */
+enum device_ps_policy {
+	DEV_PS_POLICY_ALL,
+	DEV_PS_POLICY_SPREAD,
+	DEV_PS_POLICY_NUMA,
 };
 
 /* events broadcasted to all users of a device */
@@ -165,6 +270,25 @@ struct device_settings {
 	unsigned int neigh4locktime;
 	bool rps;
 	bool xps;
+	enum device_ps_policy ps_policy;
+	char ps_cpus[64];
+	char ps_exclude[64];
+	unsigned int rfs_entries;
+	unsigned int rps_flow_cnt;
+	unsigned int features_mask;
+	unsigned int features;
+	unsigned int ethtool_mask;
+	unsigned int ethtool[__DEV_ETHTOOL_MAX];
+	unsigned int gso_mask;
+	unsigned int gso[__DEV_GSO_LIMIT_MAX];
+	enum device_qdisc qdisc;
+	enum device_qdisc qdisc_child;
+	unsigned int qdisc_bandwidth;
+	int qdisc_overhead;
+	unsigned int qdisc_target;
+	unsigned int qdisc_limit;
+	char xdp[128];
+	enum device_xdp_mode xdp_mode;
 	unsigned int dadtransmits;
 	bool multicast_to_unicast;
 	unsigned int multicast_router;
@@ -175,6 +299,30 @@ struct device_settings {
 	bool sendredirects;
 };
 
+struct device_counters {
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+};
+
+#define DEV_STATS_HISTORY_MAX	3600
+
+/* counter samples taken every stats_interval, allocated once per device */
+struct device_stats_ring {
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	struct {
+		uint64_t time;
+		struct device_counters c;
+	} samples[];
+};
+
 /*
  * link layer device. typically represents a linux network device.
  * can be used to support VLANs as well
@@ -203,6 +351,8 @@ struct device {
 	bool disabled;
 	bool deferred;
 	bool hidden;
+	/* GSO/GRO limits are taken over from the lower devices */
+	bool gso_inherited;
 
 	bool current_config;
 	bool iface_config;
@@ -222,6 +372,8 @@ struct device {
 
 	struct device_settings orig_settings;
 	struct device_settings settings;
+
+	struct device_stats_ring *stats;
 };
 
 struct device_hotplug_ops {
@@ -242,6 +394,8 @@ struct device_type *device_type_get(const char *tname);
 struct device *device_create(const char *name, struct device_type *type,
 			     struct blob_attr *config);
 void device_init_settings(struct device *dev, struct blob_attr **tb);
+bool device_reset_gso_limits(struct device *dev);
+void device_inherit_gso_limits(struct device *dev, struct device *lower);
 void device_init_pending(void);
 
 enum dev_change_type
@@ -251,6 +405,8 @@ device_apply_config(struct device *dev, struct device_type *type,
 void device_reset_config(void);
 void device_reset_old(void);
 void device_set_default_ps(bool state);
+void device_set_stats_interval(unsigned int msec);
+void device_set_event_filter(bool enabled);
 
 void device_init_virtual(struct device *dev, struct device_type *type, const char *name);
 int device_init(struct device *iface, struct device_type *type, const char *ifname);
@@ -270,6 +426,7 @@ int device_claim(struct device_user *dep);
 void device_release(struct device_user *dep);
 int device_check_state(struct device *dev);
 void device_dump_status(struct blob_buf *b, struct device *dev);
+void device_dump_rates(struct blob_buf *b, struct device *dev);
 
 void device_free(struct device *dev);
 void device_free_unused(struct device *dev);
@@ -67,8 +67,181 @@ const struct uci_blob_param_list route_attr_list = {
 
 struct list_head prefixes = LIST_HEAD_INIT(prefixes);
 static struct device_prefix *ula_prefix = NULL;
-static struct uloop_timeout valid_until_timeout;
 
+/*
+ * Binary min-heap of the deadlines of all proto entries with a lifetime,
+ * with a single timeout armed for the earliest one. Addresses and IPv6
+ * routes are removed by the kernel, which netifd learns from its events;
+ * for those, the heap only catches up on events that were lost.
+ */
+#define KERNEL_EXPIRY_GRACE	10
+
+static struct {
+	struct device_expiry **heap;
+	int n, size;
+	struct uloop_timeout timeout;
+} expiry;
+
+
+static void
+expiry_set(int i, struct device_expiry *e)
+{
+	expiry.heap[i] = e;
+	e->index = i + 1;
+}
+
+static void
+expiry_sift_up(int i)
+{
+	struct device_expiry *e = expiry.heap[i];
+
+	while (i > 0 && expiry.heap[(i - 1) / 2]->deadline > e->deadline) {
+		expiry_set(i, expiry.heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	expiry_set(i, e);
+}
+
+static void
+expiry_sift_down(int i)
+{
+	struct device_expiry *e = expiry.heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < expiry.n) {
+		if (child + 1 < expiry.n &&
+		    expiry.heap[child + 1]->deadline < expiry.heap[child]->deadline)
+			child++;
+
+		if (expiry.heap[child]->deadline >= e->deadline)
+			break;
+
+		expiry_set(i, expiry.heap[child]);
+		i = child;
+	}
+	expiry_set(i, e);
+}
+
+static void interface_ip_expiry_handler(struct uloop_timeout *t);
+
+static void
+interface_ip_expiry_arm(void)
+{
+	int64_t delay;
+
+	if (!expiry.n) {
+		uloop_timeout_cancel(&expiry.timeout);
+		return;
+	}
+
+	/* entries expire once their deadline has passed */
+	delay = (int64_t) (expiry.heap[0]->deadline + 1 - system_get_rtime()) * 1000;
+	if (delay < 0)
+		delay = 0;
+	else if (delay > INT_MAX)
+		delay = INT_MAX;
+
+	expiry.timeout.cb = interface_ip_expiry_handler;
+	uloop_timeout_set(&expiry.timeout, delay);
+}
+
+static void
+interface_ip_expiry_del(struct device_expiry *e)
+{
+	int i = e->index - 1;
+	struct device_expiry *last;
+
+	if (!e->index)
+		return;
+
+	e->index = 0;
+	last = expiry.heap[--expiry.n];
+	if (i < expiry.n) {
+		expiry_set(i, last);
+		expiry_sift_up(i);
+		expiry_sift_down(last->index - 1);
+	}
+
+	if (!i)
+		interface_ip_expiry_arm();
+}
+
+static void
+interface_ip_expiry_add(struct device_expiry *e, struct interface_ip_settings *ip,
+			struct vlist_tree *tree, struct vlist_node *node,
+			time_t deadline)
+{
+	struct device_expiry **heap;
+
+	/* only proto provided entries expire */
+	if (!deadline || ip != &ip->iface->proto_ip)
+		return;
+
+	if (expiry.n == expiry.size) {
+		int size = expiry.size ? 2 * expiry.size : 32;
+
+		heap = realloc(expiry.heap, size * sizeof(*heap));
+		if (!heap)
+			return;
+
+		expiry.heap = heap;
+		expiry.size = size;
+	}
+
+	e->iface = ip->iface;
+	e->tree = tree;
+	e->node = node;
+	e->deadline = deadline;
+	expiry_set(expiry.n++, e);
+	expiry_sift_up(expiry.n - 1);
+
+	if (expiry.heap[0] == e)
+		interface_ip_expiry_arm();
+}
+
+static time_t
+interface_ip_kernel_deadline(time_t valid_until, bool kernel)
+{
+	if (!valid_until || !kernel)
+		return valid_until;
+
+	return valid_until + KERNEL_EXPIRY_GRACE;
+}
+
+static bool
+interface_ip_lifetime_over(time_t valid_until)
+{
+	/* the kernel counts lifetimes from a finer clock */
+	return valid_until && valid_until <= system_get_rtime() + 1;
+}
+
+static void
+interface_ip_expiry_handler(struct uloop_timeout *t)
+{
+	time_t now = system_get_rtime();
+	struct device_expiry *e;
+	bool retry = false;
+
+	while (expiry.n && expiry.heap[0]->deadline < now) {
+		e = expiry.heap[0];
+
+		/* entries of interfaces that are not up yet expire once they are */
+		if (e->iface->state != IFS_UP) {
+			e->deadline = now;
+			expiry_sift_down(0);
+			retry = true;
+			continue;
+		}
+
+		interface_ip_expiry_del(e);
+		vlist_delete(e->tree, e->node);
+	}
+
+	if (retry)
+		uloop_timeout_set(t, 1000);
+	else
+		interface_ip_expiry_arm();
+}
 
 static void
 clear_if_addr(union if_addr *a, int mask)
@@ -158,75 +331,314 @@ static int set_ip_lo_policy(bool add, bool v6, struct interface *iface)
 	return (add) ? system_add_iprule(&rule) : system_del_iprule(&rule);
 }
 
-static bool
-__find_ip_addr_target(struct interface_ip_settings *ip, union if_addr *a, bool v6)
+/*
+ * Path-compressed binary tries over the addresses and routes of all
+ * interfaces, one per family, so that host route targets can be resolved
+ * without walking every interface.
+ */
+struct ip_trie_node {
+	struct ip_trie_node *child[2];
+	struct list_head entries;
+	union if_addr addr;
+	uint8_t len;
+};
+
+enum {
+	IP_TRIE_ADDR4,
+	IP_TRIE_ADDR6,
+	IP_TRIE_ROUTE4,
+	IP_TRIE_ROUTE6,
+	__IP_TRIE_MAX
+};
+
+static struct ip_trie_node *ip_trie[__IP_TRIE_MAX];
+
+static inline int
+if_addr_bit(const union if_addr *a, int bit)
 {
-	struct device_addr *addr;
+	const uint8_t *p = (const uint8_t *) a;
 
-	vlist_for_each_element(&ip->addr, addr, node) {
-		if (!addr->enabled)
-			continue;
+	return (p[bit / 8] >> (7 - bit % 8)) & 1;
+}
 
-		if (v6 != ((addr->flags & DEVADDR_FAMILY) == DEVADDR_INET6))
-			continue;
+static int
+if_addr_common_len(const union if_addr *a1, const union if_addr *a2, int max)
+{
+	const uint8_t *p1 = (const uint8_t *) a1;
+	const uint8_t *p2 = (const uint8_t *) a2;
+	int i;
+
+	for (i = 0; i < max; i += 8) {
+		uint8_t x = p1[i / 8] ^ p2[i / 8];
+
+		if (x) {
+			i += __builtin_clz(x) - 24;
+			break;
+		}
+	}
+
+	return i < max ? i : max;
+}
+
+static struct ip_trie_node *
+ip_trie_node_new(const union if_addr *addr, int len)
+{
+	struct ip_trie_node *n;
 
-		// Handle offlink addresses correctly
-		unsigned int mask = addr->mask;
-		if ((addr->flags & DEVADDR_FAMILY) == DEVADDR_INET6 &&
-				(addr->flags & DEVADDR_OFFLINK))
-			mask = 128;
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return NULL;
+
+	INIT_LIST_HEAD(&n->entries);
+	n->len = len;
+	if (len) {
+		n->addr = *addr;
+		clear_if_addr(&n->addr, len);
+	}
+
+	return n;
+}
+
+static struct ip_trie_node *
+ip_trie_get(struct ip_trie_node **pp, const union if_addr *addr, int len)
+{
+	struct ip_trie_node *n, *new, *glue;
+	int common;
 
-		if (!match_if_addr(&addr->addr, a, mask))
+	while ((n = *pp) != NULL) {
+		common = if_addr_common_len(&n->addr, addr,
+					    n->len < len ? n->len : len);
+		if (common == n->len) {
+			if (n->len == len)
+				return n;
+
+			pp = &n->child[if_addr_bit(addr, n->len)];
 			continue;
+		}
 
-		return true;
+		new = ip_trie_node_new(addr, len);
+		if (!new)
+			return NULL;
+
+		/* the new prefix covers n */
+		if (common == len) {
+			new->child[if_addr_bit(&n->addr, len)] = n;
+			*pp = new;
+			return new;
+		}
+
+		/* the two prefixes diverge, join them below a glue node */
+		glue = ip_trie_node_new(addr, common);
+		if (!glue) {
+			free(new);
+			return NULL;
+		}
+
+		glue->child[if_addr_bit(&n->addr, common)] = n;
+		glue->child[if_addr_bit(addr, common)] = new;
+		*pp = glue;
+		return new;
 	}
 
-	return false;
+	*pp = ip_trie_node_new(addr, len);
+	return *pp;
 }
 
 static void
-__find_ip_route_target(struct interface_ip_settings *ip, union if_addr *a,
-		       bool v6, struct device_route **res)
+ip_trie_prune(struct ip_trie_node **pp, const union if_addr *addr, int len)
 {
-	struct device_route *route;
+	struct ip_trie_node **path[130], *n;
+	int depth = 0;
 
-	vlist_for_each_element(&ip->route, route, node) {
-		if (!route->enabled)
-			continue;
+	while ((n = *pp) != NULL && n->len < len) {
+		path[depth++] = pp;
+		pp = &n->child[if_addr_bit(addr, n->len)];
+	}
 
-		if (v6 != ((route->flags & DEVADDR_FAMILY) == DEVADDR_INET6))
-			continue;
+	if (!n || n->len != len)
+		return;
 
-		if (!match_if_addr(&route->addr, a, route->mask))
-			continue;
+	path[depth++] = pp;
 
-		if (route->flags & DEVROUTE_TABLE)
-			continue;
+	/* collapse empty nodes bottom up as long as they have at most one child */
+	while (depth-- > 0) {
+		pp = path[depth];
+		n = *pp;
+
+		if (!list_empty(&n->entries) || (n->child[0] && n->child[1]))
+			break;
 
-		if (!*res || route->mask < (*res)->mask)
-			*res = route;
+		*pp = n->child[0] ? n->child[0] : n->child[1];
+		free(n);
 	}
 }
 
-static bool
-interface_ip_find_addr_target(struct interface *iface, union if_addr *a, bool v6)
+/* collect the non-empty nodes covering addr, least specific first */
+static int
+ip_trie_path(struct ip_trie_node *n, const union if_addr *addr, int max,
+	     struct ip_trie_node **path)
 {
-	return __find_ip_addr_target(&iface->proto_ip, a, v6) ||
-	       __find_ip_addr_target(&iface->config_ip, a, v6);
+	int depth = 0;
+
+	while (n && if_addr_common_len(&n->addr, addr, n->len) == n->len) {
+		if (!list_empty(&n->entries))
+			path[depth++] = n;
+
+		if (n->len == max)
+			break;
+
+		n = n->child[if_addr_bit(addr, n->len)];
+	}
+
+	return depth;
 }
 
 static void
-interface_ip_find_route_target(struct interface *iface, union if_addr *a,
-			       bool v6, struct device_route **route)
+interface_ip_lpm_add(struct device_lpm *lpm, struct interface *iface, int trie,
+		     const union if_addr *addr, int len)
 {
-	__find_ip_route_target(&iface->proto_ip, a, v6, route);
-	__find_ip_route_target(&iface->config_ip, a, v6, route);
+	struct ip_trie_node *n;
+
+	n = ip_trie_get(&ip_trie[trie], addr, len);
+	if (!n)
+		return;
+
+	lpm->iface = iface;
+	lpm->len = len;
+	list_add_tail(&lpm->list, &n->entries);
+}
+
+static void
+interface_ip_lpm_del(struct device_lpm *lpm, int trie, const union if_addr *addr)
+{
+	if (!lpm->list.next)
+		return;
+
+	list_del(&lpm->list);
+	ip_trie_prune(&ip_trie[trie], addr, lpm->len);
+}
+
+static void
+interface_ip_lpm_add_addr(struct device_addr *addr, struct interface *iface)
+{
+	bool v6 = (addr->flags & DEVADDR_FAMILY) == DEVADDR_INET6;
+	unsigned int mask = addr->mask;
+
+	// Handle offlink addresses correctly
+	if (v6 && (addr->flags & DEVADDR_OFFLINK))
+		mask = 128;
+
+	interface_ip_lpm_add(&addr->lpm, iface, v6 ? IP_TRIE_ADDR6 : IP_TRIE_ADDR4,
+			     &addr->addr, mask);
+}
+
+static void
+interface_ip_lpm_del_addr(struct device_addr *addr)
+{
+	bool v6 = (addr->flags & DEVADDR_FAMILY) == DEVADDR_INET6;
+
+	interface_ip_lpm_del(&addr->lpm, v6 ? IP_TRIE_ADDR6 : IP_TRIE_ADDR4,
+			     &addr->addr);
+}
+
+static void
+interface_ip_lpm_add_route(struct device_route *route, struct interface *iface)
+{
+	bool v6 = (route->flags & DEVADDR_FAMILY) == DEVADDR_INET6;
+
+	interface_ip_lpm_add(&route->lpm, iface, v6 ? IP_TRIE_ROUTE6 : IP_TRIE_ROUTE4,
+			     &route->addr, route->mask);
+}
+
+static void
+interface_ip_lpm_del_route(struct device_route *route)
+{
+	bool v6 = (route->flags & DEVADDR_FAMILY) == DEVADDR_INET6;
+
+	interface_ip_lpm_del(&route->lpm, v6 ? IP_TRIE_ROUTE6 : IP_TRIE_ROUTE4,
+			     &route->addr);
+}
+
+/*
+ * Find the interface owning the most specific enabled address covering a,
+ * restricted to iface if given. Ties go to the interface that sorts first,
+ * like the walk over the interface list did before.
+ */
+static struct interface *
+interface_ip_find_addr_target(struct interface *iface, union if_addr *a, bool v6)
+{
+	struct ip_trie_node *path[129];
+	struct device_addr *addr;
+	struct interface *res;
+	int depth;
+
+	depth = ip_trie_path(ip_trie[v6 ? IP_TRIE_ADDR6 : IP_TRIE_ADDR4], a,
+			     v6 ? 128 : 32, path);
+
+	while (depth-- > 0) {
+		res = NULL;
+		list_for_each_entry(addr, &path[depth]->entries, lpm.list) {
+			if (!addr->enabled)
+				continue;
+
+			if (iface && addr->lpm.iface != iface)
+				continue;
+
+			if (!res || strcmp(addr->lpm.iface->name, res->name) < 0)
+				res = addr->lpm.iface;
+		}
+
+		if (res)
+			return res;
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the enabled route covering a with the shortest prefix, restricted to
+ * iface if given. Unlike the address lookup, the least specific route wins,
+ * as it did with the walk over the route lists. Ties go to the interface
+ * that sorts first.
+ */
+static struct device_route *
+interface_ip_find_route_target(struct interface *iface, union if_addr *a, bool v6)
+{
+	struct ip_trie_node *path[129];
+	struct device_route *route, *res;
+	int i, depth;
+
+	depth = ip_trie_path(ip_trie[v6 ? IP_TRIE_ROUTE6 : IP_TRIE_ROUTE4], a,
+			     v6 ? 128 : 32, path);
+
+	for (i = 0; i < depth; i++) {
+		res = NULL;
+		list_for_each_entry(route, &path[i]->entries, lpm.list) {
+			if (!route->enabled)
+				continue;
+
+			if (route->flags & DEVROUTE_TABLE)
+				continue;
+
+			if (iface && route->lpm.iface != iface)
+				continue;
+
+			if (!res || strcmp(route->lpm.iface->name,
+					   res->lpm.iface->name) < 0)
+				res = route;
+		}
+
+		if (res)
+			return res;
+	}
+
+	return NULL;
 }
 
 struct interface *
 interface_ip_add_target_route(union if_addr *addr, bool v6, struct interface *iface)
 {
+	struct interface *target;
 	struct device_route *route, *r_next = NULL;
 	bool defaultroute_target = false;
 	int addrsize = v6 ? sizeof(addr->in6) : sizeof(addr->in);
@@ -242,26 +654,14 @@ interface_ip_add_target_route(union if_addr *addr, bool v6, struct interface *if
 	else
 		memcpy(&route->addr, addr, addrsize);
 
-	if (iface) {
-		/* look for locally addressable target first */
-		if (interface_ip_find_addr_target(iface, addr, v6))
-			goto done;
-
-		/* do not stop at the first route, let the lookup compare
-		 * masks to find the best match */
-		interface_ip_find_route_target(iface, addr, v6, &r_next);
-	} else {
-		vlist_for_each_element(&interfaces, iface, node) {
-			/* look for locally addressable target first */
-			if (interface_ip_find_addr_target(iface, addr, v6))
-				goto done;
-
-			/* do not stop at the first route, let the lookup compare
-			 * masks to find the best match */
-			interface_ip_find_route_target(iface, addr, v6, &r_next);
-		}
+	/* look for locally addressable target first */
+	target = interface_ip_find_addr_target(iface, addr, v6);
+	if (target) {
+		iface = target;
+		goto done;
 	}
 
+	r_next = interface_ip_find_route_target(iface, addr, v6);
 	if (!r_next) {
 		free(route);
 		return NULL;
@@ -464,6 +864,25 @@ prefix_cmp(const void *k1, const void *k2, void *ptr)
 			offsetof(struct device_prefix, addr));
 }
 
+/* an addition has been acked; a failed one is retried on the next update */
+static void
+interface_addr_done(void *priv, int error)
+{
+	struct device_addr *addr = priv;
+
+	if (error)
+		addr->failed = true;
+}
+
+static void
+interface_route_done(void *priv, int error)
+{
+	struct device_route *route = priv;
+
+	if (error)
+		route->failed = true;
+}
+
 static void
 interface_handle_subnet_route(struct interface *iface, struct device_addr *addr, bool add)
 {
@@ -477,6 +896,7 @@ interface_handle_subnet_route(struct interface *iface, struct device_addr *addr,
 		if (!addr->subnet.iface)
 			return;
 
+		system_request_cancel(&r->req);
 		system_del_route(dev, r);
 		memset(r, 0, sizeof(*r));
 		return;
@@ -497,7 +917,7 @@ interface_handle_subnet_route(struct interface *iface, struct device_addr *addr,
 	r->flags &= ~DEVROUTE_PROTO;
 	interface_set_route_info(iface, r);
 
-	system_add_route(dev, r);
+	system_add_route_async(dev, r, &r->req, interface_route_done);
 }
 
 static void
@@ -585,12 +1005,20 @@ interface_update_proto_addr(struct vlist_tree *tree,
 				system_del_address(dev, a_old);
 			}
 		}
+		interface_ip_expiry_del(&a_old->expiry);
+		interface_ip_lpm_del_addr(a_old);
+		system_request_cancel(&a_old->req);
+		system_request_cancel(&a_old->subnet.req);
 		free(a_old->pclass);
 		free(a_old);
 	}
 
 	if (node_new) {
 		a_new->enabled = true;
+		interface_ip_lpm_add_addr(a_new, iface);
+		interface_ip_expiry_add(&a_new->expiry, ip, tree, node_new,
+					interface_ip_kernel_deadline(a_new->valid_until,
+						!(a_new->flags & DEVADDR_EXTERNAL)));
 
 		if ((a_new->flags & DEVADDR_FAMILY) == DEVADDR_INET6)
 				v6 = true;
@@ -599,8 +1027,8 @@ interface_update_proto_addr(struct vlist_tree *tree,
 
 		if (!keep || replace) {
 			if (!(a_new->flags & DEVADDR_EXTERNAL)) {
-				if (system_add_address(dev, a_new))
-					a_new->failed = true;
+				system_add_address_async(dev, a_new, &a_new->req,
+							 interface_addr_done);
 
 				if (iface->metric || a_new->policy_table)
 					interface_handle_subnet_route(iface, a_new, true);
@@ -653,18 +1081,27 @@ interface_update_proto_route(struct vlist_tree *tree,
 		if (!(route_old->flags & DEVADDR_EXTERNAL) && route_old->enabled && !keep)
 			system_del_route(dev, route_old);
 
+		interface_ip_expiry_del(&route_old->expiry);
+		interface_ip_lpm_del_route(route_old);
+		system_request_cancel(&route_old->req);
 		free(route_old);
 	}
 
 	if (node_new) {
 		bool _enabled = enable_route(ip, route_new);
 
+		interface_ip_expiry_add(&route_new->expiry, ip, tree, node_new,
+					interface_ip_kernel_deadline(route_new->valid_until,
+						!(route_new->flags & DEVADDR_EXTERNAL) &&
+						(route_new->flags & DEVADDR_FAMILY) == DEVADDR_INET6));
+
 		if (!(route_new->flags & DEVADDR_EXTERNAL) && !keep && _enabled)
-			if (system_add_route(dev, route_new))
-				route_new->failed = true;
+			system_add_route_async(dev, route_new, &route_new->req,
+					       interface_route_done);
 
 		route_new->iface = iface;
 		route_new->enabled = _enabled;
+		interface_ip_lpm_add_route(route_new, iface);
 	}
 }
 
@@ -684,14 +1121,14 @@ interface_update_host_route(struct vlist_tree *tree,
 	route_new = container_of(node_new, struct device_route, node);
 
 	if (node_old) {
+		system_request_cancel(&route_old->req);
 		system_del_route(dev, route_old);
 		free(route_old);
 	}
 
-	if (node_new) {
-		if (system_add_route(dev, route_new))
-			route_new->failed = true;
-	}
+	if (node_new)
+		system_add_route_async(dev, route_new, &route_new->req,
+				       interface_route_done);
 }
 
 static void
@@ -826,27 +1263,226 @@ interface_set_prefix_address(struct device_prefix_assignment *assignment,
 	}
 }
 
-static bool interface_prefix_assign(struct list_head *list,
+/*
+ * Free subprefixes of a delegated prefix are kept as buddy blocks of
+ * 2^order /64s, aligned to their size and sorted by order and offset, so
+ * the smallest free block that fits is always found first.
+ */
+struct prefix_block {
+	struct avl_node node;
+	int32_t offset;
+	uint8_t order;
+};
+
+/* offsets are ORed into the second word of the prefix address */
+#define PREFIX_ORDER_MAX	30
+
+static const char prefix_excluded_name[] = "!excluded";
+
+static int prefix_block_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct prefix_block *b1 = k1, *b2 = k2;
+
+	if (b1->order != b2->order)
+		return b1->order - b2->order;
+
+	return b1->offset - b2->offset;
+}
+
+static int prefix_order(const struct device_prefix *prefix)
+{
+	int order = 64 - prefix->length;
+
+	return order > PREFIX_ORDER_MAX ? PREFIX_ORDER_MAX : order;
+}
+
+static int prefix_assignment_order(const struct device_prefix_assignment *assign)
+{
+	return assign->length < 64 ? 64 - assign->length : 0;
+}
+
+static void prefix_block_add(struct device_prefix *prefix, int32_t offset, int order)
+{
+	struct prefix_block *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return;
+
+	b->offset = offset;
+	b->order = order;
+	b->node.key = b;
+	avl_insert(&prefix->blocks, &b->node);
+}
+
+static struct prefix_block *
+prefix_block_find(struct device_prefix *prefix, int32_t offset, int order)
+{
+	struct prefix_block key = { .offset = offset, .order = order }, *b;
+
+	return avl_find_element(&prefix->blocks, &key, b, node);
+}
+
+/* allocate a block at offset, or the first one that fits if offset is -1 */
+static int32_t prefix_block_alloc(struct device_prefix *prefix, int32_t offset, int order)
+{
+	struct prefix_block key = { .order = order }, *b = NULL;
+	int max = prefix_order(prefix);
+	int32_t base;
+	int i;
+
+	if (order > max)
+		return -1;
+
+	if (offset < 0) {
+		b = avl_find_ge_element(&prefix->blocks, &key, b, node);
+		if (b)
+			offset = b->offset;
+	} else if (offset < (1 << max)) {
+		offset &= ~((1 << order) - 1);
+		for (i = order; !b && i <= max; i++)
+			b = prefix_block_find(prefix, offset & ~((1 << i) - 1), i);
+	}
+
+	if (!b)
+		return -1;
+
+	base = b->offset;
+	i = b->order;
+	avl_delete(&prefix->blocks, &b->node);
+	free(b);
+
+	/* split down to the requested size, keeping the other halves free */
+	while (i-- > order) {
+		if (offset & (1 << i)) {
+			prefix_block_add(prefix, base, i);
+			base += 1 << i;
+		} else {
+			prefix_block_add(prefix, base + (1 << i), i);
+		}
+	}
+
+	return offset;
+}
+
+static void prefix_block_free(struct device_prefix *prefix, int32_t offset, int order)
+{
+	int max = prefix_order(prefix);
+	struct prefix_block *b;
+
+	/* merge with the buddy for as long as that is free too */
+	while (order < max &&
+	       (b = prefix_block_find(prefix, offset ^ (1 << order), order))) {
+		avl_delete(&prefix->blocks, &b->node);
+		free(b);
+		offset &= ~(1 << order);
+		order++;
+	}
+
+	prefix_block_add(prefix, offset, order);
+}
+
+static bool interface_prefix_assign(struct device_prefix *prefix,
 		struct device_prefix_assignment *assign)
 {
-	int32_t current = 0, asize = (1 << (64 - assign->length)) - 1;
+	int32_t offset;
+
+	offset = prefix_block_alloc(prefix, assign->assigned,
+				    prefix_assignment_order(assign));
+	if (offset < 0)
+		return false;
+
+	assign->assigned = offset;
+	return true;
+}
+
+static void interface_prefix_release(struct device_prefix *prefix,
+		struct device_prefix_assignment *assign)
+{
+	if (assign->iface)
+		interface_set_prefix_address(assign, prefix, assign->iface, false);
+
+	prefix_block_free(prefix, assign->assigned, prefix_assignment_order(assign));
+	list_del(&assign->iface_head);
+	list_del(&assign->head);
+	free(assign);
+}
+
+static void interface_prefix_init(struct device_prefix *prefix)
+{
 	struct device_prefix_assignment *c;
-	list_for_each_entry(c, list, head) {
-		if (assign->assigned != -1) {
-			if (assign->assigned >= current && assign->assigned + asize < c->assigned) {
-				list_add_tail(&assign->head, &c->head);
-				return true;
-			}
-		} else if (assign->assigned == -1) {
-			current = (current + asize) & (~asize);
-			if (current + asize < c->assigned) {
-				assign->assigned = current;
-				list_add_tail(&assign->head, &c->head);
-				return true;
-			}
-		}
-		current = (c->assigned + (1 << (64 - c->length)));
+
+	INIT_LIST_HEAD(&prefix->assignments);
+	avl_init(&prefix->blocks, prefix_block_cmp, false, NULL);
+	prefix_block_add(prefix, 0, prefix_order(prefix));
+
+	// Excluded prefix
+	if (prefix->excl_length > 0) {
+		c = calloc(1, sizeof(*c) + sizeof(prefix_excluded_name));
+		if (!c)
+			return;
+
+		c->assigned = ntohl(prefix->excl_addr.s6_addr32[1]) &
+				((1 << prefix_order(prefix)) - 1);
+		c->length = prefix->excl_length;
+		c->addr = in6addr_any;
+		c->prefix = prefix;
+		INIT_LIST_HEAD(&c->iface_head);
+		memcpy(c->name, prefix_excluded_name, sizeof(prefix_excluded_name));
+
+		if (interface_prefix_assign(prefix, c))
+			list_add(&c->head, &prefix->assignments);
+		else
+			free(c);
 	}
+}
+
+static void interface_prefix_free(struct device_prefix *prefix)
+{
+	struct device_prefix_assignment *c;
+	struct prefix_block *b, *tmp;
+
+	while (!list_empty(&prefix->assignments)) {
+		c = list_first_entry(&prefix->assignments,
+				struct device_prefix_assignment, head);
+		list_del(&c->iface_head);
+		list_del(&c->head);
+		free(c);
+	}
+
+	avl_remove_all_elements(&prefix->blocks, b, node, tmp)
+		free(b);
+}
+
+static bool interface_prefix_wanted(const struct device_prefix *prefix,
+		const struct interface *iface)
+{
+	struct interface_assignment_class *c;
+
+	if (iface->assignment_length < 48 ||
+			iface->assignment_length > 64)
+		return false;
+
+	// Test whether there is a matching class
+	if (list_empty(&iface->assignment_classes))
+		return true;
+
+	list_for_each_entry(c, &iface->assignment_classes, head)
+		if (!strcmp(c->name, prefix->pclass))
+			return true;
+
+	return false;
+}
+
+static bool interface_prefix_assigned(const struct device_prefix *prefix,
+		const struct interface *iface)
+{
+	struct device_prefix_assignment *c;
+
+	list_for_each_entry(c, &iface->assignments, iface_head)
+		if (c->prefix == prefix)
+			return true;
+
 	return false;
 }
 
@@ -871,47 +1507,22 @@ static int prefix_assignment_cmp(const void *k1, const void *k2, void *ptr)
 
 static void interface_update_prefix_assignments(struct device_prefix *prefix, bool setup)
 {
-	struct device_prefix_assignment *c;
+	struct device_prefix_assignment *c, *tmp;
 	struct interface *iface;
+	LIST_HEAD(added);
 
-	// Delete all assignments
-	while (!list_empty(&prefix->assignments)) {
-		c = list_first_entry(&prefix->assignments,
-				struct device_prefix_assignment, head);
-		if ((iface = vlist_find(&interfaces, c->name, iface, node)))
-			interface_set_prefix_address(c, prefix, iface, false);
-		list_del(&c->head);
-		free(c);
+	// Drop assignments of interfaces that no longer match or have changed
+	list_for_each_entry_safe(c, tmp, &prefix->assignments, head) {
+		if (setup && (!c->iface || (!c->iface->assignment_changed &&
+				interface_prefix_wanted(prefix, c->iface))))
+			continue;
+
+		interface_prefix_release(prefix, c);
 	}
 
 	if (!setup)
 		return;
 
-	// End-of-assignment sentinel
-	c = malloc(sizeof(*c) + 1);
-	if (!c)
-		return;
-
-	c->assigned = 1 << (64 - prefix->length);
-	c->length = 64;
-	c->name[0] = 0;
-	c->addr = in6addr_any;
-	list_add(&c->head, &prefix->assignments);
-
-	// Excluded prefix
-	if (prefix->excl_length > 0) {
-		const char name[] = "!excluded";
-		c = malloc(sizeof(*c) + sizeof(name));
-		if (c) {
-			c->assigned = ntohl(prefix->excl_addr.s6_addr32[1]) &
-					((1 << (64 - prefix->length)) - 1);
-			c->length = prefix->excl_length;
-			c->addr = in6addr_any;
-			memcpy(c->name, name, sizeof(name));
-			list_add(&c->head, &prefix->assignments);
-		}
-	}
-
 	bool assigned_any = false;
 	struct {
 		struct avl_node node;
@@ -921,24 +1532,12 @@ static void interface_update_prefix_assignments(struct device_prefix *prefix, bo
 	avl_init(&assign_later, prefix_assignment_cmp, false, NULL);
 
 	vlist_for_each_element(&interfaces, iface, node) {
-		if (iface->assignment_length < 48 ||
-				iface->assignment_length > 64)
+		if (!interface_prefix_wanted(prefix, iface))
 			continue;
 
-		// Test whether there is a matching class
-		if (!list_empty(&iface->assignment_classes)) {
-			bool found = false;
-
-			struct interface_assignment_class *c;
-			list_for_each_entry(c, &iface->assignment_classes, head) {
-				if (!strcmp(c->name, prefix->pclass)) {
-					found = true;
-					break;
-				}
-			}
-
-			if (!found)
-				continue;
+		if (interface_prefix_assigned(prefix, iface)) {
+			assigned_any = true;
+			continue;
 		}
 
 		size_t namelen = strlen(iface->name) + 1;
@@ -951,10 +1550,12 @@ static void interface_update_prefix_assignments(struct device_prefix *prefix, bo
 		c->weight = iface->assignment_weight;
 		c->addr = in6addr_any;
 		c->enabled = false;
+		c->prefix = prefix;
+		c->iface = iface;
 		memcpy(c->name, iface->name, namelen);
 
 		// First process all custom assignments, put all others in later-list
-		if (c->assigned == -1 || !interface_prefix_assign(&prefix->assignments, c)) {
+		if (c->assigned == -1 || !interface_prefix_assign(prefix, c)) {
 			if (c->assigned != -1) {
 				c->assigned = -1;
 				netifd_log_message(L_WARNING, "Failed to assign requested subprefix "
@@ -962,15 +1563,17 @@ static void interface_update_prefix_assignments(struct device_prefix *prefix, bo
 			}
 
 			entry = calloc(1, sizeof(*entry));
-			if (!entry)
+			if (!entry) {
+				free(c);
 				continue;
+			}
 
 			entry->node.key = c;
 			avl_insert(&assign_later, &entry->node);
-		}
-
-		if (c->assigned != -1)
+		} else {
+			list_add_tail(&c->head, &added);
 			assigned_any = true;
+		}
 	}
 
 	/* Then try to assign all other + failed custom assignments */
@@ -981,22 +1584,28 @@ static void interface_update_prefix_assignments(struct device_prefix *prefix, bo
 		avl_delete(&assign_later, &entry->node);
 
 		do {
-			assigned = interface_prefix_assign(&prefix->assignments, c);
+			assigned = interface_prefix_assign(prefix, c);
 		} while (!assigned && ++c->length <= 64);
 
 		if (!assigned) {
 			netifd_log_message(L_WARNING, "Failed to assign subprefix "
 					"of size %hhu for %s\n", c->length, c->name);
 			free(c);
-		} else
+		} else {
+			list_add_tail(&c->head, &added);
 			assigned_any = true;
+		}
 
 		free(entry);
 	}
 
-	list_for_each_entry(c, &prefix->assignments, head)
-		if ((iface = vlist_find(&interfaces, c->name, iface, node)))
-			interface_set_prefix_address(c, prefix, iface, true);
+	// Only interfaces with a new assignment need their addresses set up
+	list_for_each_entry(c, &added, head) {
+		list_add_tail(&c->iface_head, &c->iface->assignments);
+		interface_set_prefix_address(c, prefix, c->iface, true);
+	}
+
+	list_splice_tail(&added, &prefix->assignments);
 
 	if (!assigned_any)
 		netifd_log_message(L_WARNING, "You have delegated IPv6-prefixes but haven't assigned them "
@@ -1009,8 +1618,13 @@ void interface_refresh_assignments(bool hint)
 	static bool refresh = false;
 	if (!hint && refresh) {
 		struct device_prefix *p;
+		struct interface *iface;
+
 		list_for_each_entry(p, &prefixes, head)
 			interface_update_prefix_assignments(p, true);
+
+		vlist_for_each_element(&interfaces, iface, node)
+			iface->assignment_changed = false;
 	}
 	refresh = hint;
 }
@@ -1037,16 +1651,26 @@ interface_update_prefix(struct vlist_tree *tree,
 	route.addr.in6 = (node_new) ? prefix_new->addr : prefix_old->addr;
 
 
-	struct device_prefix_assignment *c;
-	struct interface *iface;
+	struct device_prefix_assignment *c, *tmp;
 
 	if (node_old && node_new) {
-		// Move assignments and refresh addresses to update valid times
-		list_splice(&prefix_old->assignments, &prefix_new->assignments);
+		// Move assignments to the same subprefixes and refresh addresses to update valid times
+		list_for_each_entry_safe(c, tmp, &prefix_old->assignments, head) {
+			if (!c->iface)
+				continue;
 
-		list_for_each_entry(c, &prefix_new->assignments, head)
-			if ((iface = vlist_find(&interfaces, c->name, iface, node)))
-				interface_set_prefix_address(c, prefix_new, iface, true);
+			if (!interface_prefix_assign(prefix_new, c)) {
+				interface_set_prefix_address(c, prefix_old, c->iface, false);
+				list_del(&c->iface_head);
+				list_del(&c->head);
+				free(c);
+				continue;
+			}
+
+			c->prefix = prefix_new;
+			list_move_tail(&c->head, &prefix_new->assignments);
+			interface_set_prefix_address(c, prefix_new, c->iface, true);
+		}
 
 		if (prefix_new->preferred_until != prefix_old->preferred_until ||
 				prefix_new->valid_until != prefix_old->valid_until)
@@ -1066,9 +1690,15 @@ interface_update_prefix(struct vlist_tree *tree,
 	if (node_old) {
 		if (prefix_old->head.next)
 			list_del(&prefix_old->head);
+		interface_ip_expiry_del(&prefix_old->expiry);
+		interface_prefix_free(prefix_old);
 		free(prefix_old);
 	}
 
+	if (node_new && tree)
+		interface_ip_expiry_add(&prefix_new->expiry, ip, tree, node_new,
+					prefix_new->valid_until);
+
 	if (node_new && (!prefix_new->iface || !prefix_new->iface->proto_ip.no_delegation))
 		list_add(&prefix_new->head, &prefixes);
 
@@ -1091,13 +1721,14 @@ interface_ip_add_device_prefix(struct interface *iface, struct in6_addr *addr,
 	prefix->preferred_until = preferred_until;
 	prefix->valid_until = valid_until;
 	prefix->iface = iface;
-	INIT_LIST_HEAD(&prefix->assignments);
 
 	if (excl_addr) {
 		prefix->excl_addr = *excl_addr;
 		prefix->excl_length = excl_length;
 	}
 
+	interface_prefix_init(prefix);
+
 	strcpy(prefix->pclass, pclass);
 
 	if (iface)
@@ -1350,6 +1981,8 @@ void interface_ip_set_enabled(struct interface_ip_settings *ip, bool enabled)
 	if (!dev)
 		return;
 
+	system_batch_begin();
+
 	vlist_for_each_element(&ip->addr, addr, node) {
 		bool v6 = ((addr->flags & DEVADDR_FAMILY) == DEVADDR_INET6) ? true : false;
 
@@ -1360,7 +1993,8 @@ void interface_ip_set_enabled(struct interface_ip_settings *ip, bool enabled)
 			continue;
 
 		if (enabled) {
-			system_add_address(dev, addr);
+			system_add_address_async(dev, addr, &addr->req,
+						 interface_addr_done);
 
 			addr->policy_table = (v6) ? iface->ip6table : iface->ip4table;
 			if (iface->metric || addr->policy_table)
@@ -1370,6 +2004,7 @@ void interface_ip_set_enabled(struct interface_ip_settings *ip, bool enabled)
 				interface_add_addr_rules(addr, true);
 		} else {
 			interface_handle_subnet_route(iface, addr, false);
+			system_request_cancel(&addr->req);
 			system_del_address(dev, addr);
 
 			if (addr->policy_table)
@@ -1393,19 +2028,20 @@ void interface_ip_set_enabled(struct interface_ip_settings *ip, bool enabled)
 		if (_enabled) {
 			interface_set_route_info(ip->iface, route);
 
-			if (system_add_route(dev, route))
-				route->failed = true;
-		} else
+			system_add_route_async(dev, route, &route->req,
+					       interface_route_done);
+		} else {
+			system_request_cancel(&route->req);
 			system_del_route(dev, route);
+		}
 		route->enabled = _enabled;
 	}
 
-	struct device_prefix *c;
+	system_batch_commit();
+
 	struct device_prefix_assignment *a;
-	list_for_each_entry(c, &prefixes, head)
-		list_for_each_entry(a, &c->assignments, head)
-			if (!strcmp(a->name, ip->iface->name))
-				interface_set_prefix_address(a, c, ip->iface, enabled);
+	list_for_each_entry(a, &iface->assignments, iface_head)
+		interface_set_prefix_address(a, a->prefix, iface, enabled);
 
 	if (ip->iface && ip->iface->policy_rules_set != enabled &&
 	    ip->iface->l3_dev.dev) {
@@ -1435,8 +2071,10 @@ interface_ip_update_complete(struct interface_ip_settings *ip)
 {
 	vlist_simple_flush(&ip->dns_servers);
 	vlist_simple_flush(&ip->dns_search);
+	system_batch_begin();
 	vlist_flush(&ip->route);
 	vlist_flush(&ip->addr);
+	system_batch_commit();
 	vlist_flush(&ip->prefix);
 	interface_write_resolv_conf();
 }
@@ -1444,15 +2082,26 @@ interface_ip_update_complete(struct interface_ip_settings *ip)
 void
 interface_ip_flush(struct interface_ip_settings *ip)
 {
+	system_batch_begin();
 	if (ip == &ip->iface->proto_ip)
 		vlist_flush_all(&ip->iface->host_routes);
 	vlist_simple_flush_all(&ip->dns_servers);
 	vlist_simple_flush_all(&ip->dns_search);
 	vlist_flush_all(&ip->route);
 	vlist_flush_all(&ip->addr);
+	system_batch_commit();
 	vlist_flush_all(&ip->prefix);
 }
 
+void
+interface_ip_flush_assignments(struct interface *iface)
+{
+	struct device_prefix_assignment *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, &iface->assignments, iface_head)
+		interface_prefix_release(c->prefix, c);
+}
+
 static void
 __interface_ip_init(struct interface_ip_settings *ip, struct interface *iface)
 {
@@ -1466,46 +2115,59 @@ __interface_ip_init(struct interface_ip_settings *ip, struct interface *iface)
 }
 
 void
-interface_ip_init(struct interface *iface)
+interface_ip_addr_expired(int ifindex, struct device_addr *addr)
 {
-	__interface_ip_init(&iface->proto_ip, iface);
-	__interface_ip_init(&iface->config_ip, iface);
-	vlist_init(&iface->host_routes, route_cmp, interface_update_host_route);
-}
-
-static void
-interface_ip_valid_until_handler(struct uloop_timeout *t)
-{
-	time_t now = system_get_rtime();
+	int alen = (addr->flags & DEVADDR_FAMILY) == DEVADDR_INET4 ? 4 : 16;
+	struct device_addr *a, *tmp;
 	struct interface *iface;
+
 	vlist_for_each_element(&interfaces, iface, node) {
-		if (iface->state != IFS_UP)
+		if (!iface->l3_dev.dev || iface->l3_dev.dev->ifindex != ifindex)
 			continue;
 
-		struct device_addr *addr, *addrp;
-		struct device_route *route, *routep;
-		struct device_prefix *pref, *prefp;
+		vlist_for_each_element_safe(&iface->proto_ip.addr, a, node, tmp) {
+			if ((a->flags & DEVADDR_FAMILY) != (addr->flags & DEVADDR_FAMILY) ||
+			    a->mask != addr->mask ||
+			    memcmp(&a->addr, &addr->addr, alen) != 0 ||
+			    !interface_ip_lifetime_over(a->valid_until))
+				continue;
+
+			D(INTERFACE, "Address of interface '%s' expired in the kernel\n",
+			  iface->name);
+			vlist_delete(&iface->proto_ip.addr, &a->node);
+		}
+	}
+}
 
-		vlist_for_each_element_safe(&iface->proto_ip.addr, addr, node, addrp)
-			if (addr->valid_until && addr->valid_until < now)
-				vlist_delete(&iface->proto_ip.addr, &addr->node);
+void
+interface_ip_route_expired(int ifindex, struct device_route *route)
+{
+	struct device_route *r, *tmp;
+	struct interface *iface;
 
-		vlist_for_each_element_safe(&iface->proto_ip.route, route, node, routep)
-			if (route->valid_until && route->valid_until < now)
-				vlist_delete(&iface->proto_ip.route, &route->node);
+	vlist_for_each_element(&interfaces, iface, node) {
+		if (!iface->l3_dev.dev || iface->l3_dev.dev->ifindex != ifindex)
+			continue;
 
-		vlist_for_each_element_safe(&iface->proto_ip.prefix, pref, node, prefp)
-			if (pref->valid_until && pref->valid_until < now)
-				vlist_delete(&iface->proto_ip.prefix, &pref->node);
+		vlist_for_each_element_safe(&iface->proto_ip.route, r, node, tmp) {
+			if ((r->flags & DEVADDR_FAMILY) != (route->flags & DEVADDR_FAMILY) ||
+			    r->mask != route->mask ||
+			    !match_if_addr(&r->addr, &route->addr, r->mask) ||
+			    !interface_ip_lifetime_over(r->valid_until))
+				continue;
 
+			D(INTERFACE, "Route of interface '%s' expired in the kernel\n",
+			  iface->name);
+			vlist_delete(&iface->proto_ip.route, &r->node);
+		}
 	}
-
-	uloop_timeout_set(t, 1000);
 }
 
-static void __init
-interface_ip_init_worker(void)
+void
+interface_ip_init(struct interface *iface)
 {
-	valid_until_timeout.cb = interface_ip_valid_until_handler;
-	uloop_timeout_set(&valid_until_timeout, 1000);
+	__interface_ip_init(&iface->proto_ip, iface);
+	__interface_ip_init(&iface->config_ip, iface);
+	vlist_init(&iface->host_routes, route_cmp, interface_update_host_route);
+	INIT_LIST_HEAD(&iface->assignments);
 }
@@ -55,8 +55,27 @@ union if_addr {
 	struct in6_addr in6;
 };
 
+/* lifetime of a proto address, route or prefix, queued in the expiry heap */
+struct device_expiry {
+	struct interface *iface;
+	struct vlist_tree *tree;
+	struct vlist_node *node;
+	time_t deadline;
+	int index; /* position in the heap + 1, 0 if not queued */
+};
+
+/* membership of an address or route in the target lookup trie */
+struct device_lpm {
+	struct list_head list;
+	struct interface *iface;
+	uint8_t len;
+};
+
 struct device_prefix_assignment {
 	struct list_head head;
+	struct list_head iface_head; /* on iface->assignments */
+	struct device_prefix *prefix;
+	struct interface *iface;
 	int32_t assigned;
 	uint8_t length;
 	int weight;
@@ -72,6 +91,8 @@ struct device_prefix {
 	struct interface *iface;
 	time_t valid_until;
 	time_t preferred_until;
+	struct device_expiry expiry;
+	struct avl_tree blocks; /* free subprefixes */
 
 	struct in6_addr excl_addr;
 	uint8_t excl_length;
@@ -89,12 +110,15 @@ struct device_route {
 	bool enabled;
 	bool keep;
 	bool failed;
+	struct system_request *req; /* pending addition */
 
 	union if_addr nexthop;
 	int mtu;
 	unsigned int type;
 	unsigned int proto;
 	time_t valid_until;
+	struct device_expiry expiry;
+	struct device_lpm lpm;
 
 	/* must be last */
 	enum device_addr_flags flags;
@@ -110,6 +134,7 @@ struct device_addr {
 	struct vlist_node node;
 	bool enabled;
 	bool failed;
+	struct system_request *req; /* pending addition */
 	unsigned int policy_table;
 
 	struct device_route subnet;
@@ -118,9 +143,12 @@ struct device_addr {
 	uint32_t broadcast;
 	uint32_t point_to_point;
 
-	/* ipv6 only */
 	time_t valid_until;
 	time_t preferred_until;
+	struct device_expiry expiry;
+	struct device_lpm lpm;
+
+	/* ipv6 only */
 	char *pclass;
 
 	/* must be last */
@@ -163,6 +191,7 @@ void interface_ip_add_route(struct interface *iface, struct blob_attr *attr, boo
 void interface_ip_update_start(struct interface_ip_settings *ip);
 void interface_ip_update_complete(struct interface_ip_settings *ip);
 void interface_ip_flush(struct interface_ip_settings *ip);
+void interface_ip_flush_assignments(struct interface *iface);
 void interface_ip_set_enabled(struct interface_ip_settings *ip, bool enabled);
 void interface_ip_update_metric(struct interface_ip_settings *ip, int metric);
 
@@ -172,6 +201,8 @@ struct device_prefix* interface_ip_add_device_prefix(struct interface *iface,
 		struct in6_addr *addr, uint8_t length, time_t valid_until, time_t preferred_until,
 		struct in6_addr *excl_addr, uint8_t excl_length, const char *pclass);
 void interface_ip_set_ula_prefix(const char *prefix);
+void interface_ip_addr_expired(int ifindex, struct device_addr *addr);
+void interface_ip_route_expired(int ifindex, struct device_route *route);
 void interface_refresh_assignments(bool hint);
 
 #endif
@@ -538,6 +538,7 @@ interface_merge_assignment_data(struct interface *old, struct interface *new)
 		old->assignment_iface_id_selection = new->assignment_iface_id_selection;
 		old->assignment_fixed_iface_id = new->assignment_fixed_iface_id;
 		old->assignment_weight = new->assignment_weight;
+		old->assignment_changed = true;
 		interface_refresh_assignments(true);
 	}
 }
@@ -643,6 +644,7 @@ interface_cleanup(struct interface *iface)
 		interface_remove_user(dep);
 
 	interface_clear_assignment_classes(iface);
+	interface_ip_flush_assignments(iface);
 	interface_ip_flush(&iface->config_ip);
 	interface_cleanup_state(iface);
 }
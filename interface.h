@@ -156,6 +156,8 @@ struct interface {
 	int32_t assignment_hint;
 	struct list_head assignment_classes;
 	int assignment_weight;
+	bool assignment_changed;
+	struct list_head assignments;
 
 	/* errors/warnings while trying to bring up the interface */
 	struct list_head errors;
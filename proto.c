@@ -179,6 +179,7 @@ parse_address_item(struct blob_attr *attr, bool v6, bool ext)
 	struct device_addr *addr;
 	struct blob_attr *tb[__ADDR_MAX];
 	struct blob_attr *cur;
+	time_t now = system_get_rtime();
 
 	if (blobmsg_type(attr) != BLOBMSG_TYPE_TABLE)
 		return NULL;
@@ -218,31 +219,30 @@ parse_address_item(struct blob_attr *attr, bool v6, bool ext)
 		    !inet_pton(AF_INET, blobmsg_data(cur), &addr->point_to_point))
 			goto error;
 	} else {
-		time_t now = system_get_rtime();
-		if ((cur = tb[ADDR_PREFERRED])) {
-			int64_t preferred = blobmsg_get_u32(cur);
-			int64_t preferred_until = preferred + (int64_t)now;
-			if (preferred_until <= LONG_MAX && preferred != 0xffffffffLL)
-				addr->preferred_until = preferred_until;
-		}
+		if ((cur = tb[ADDR_CLASS]))
+			addr->pclass = strdup(blobmsg_get_string(cur));
+	}
 
-		if ((cur = tb[ADDR_VALID])) {
-			int64_t valid = blobmsg_get_u32(cur);
-			int64_t valid_until = valid + (int64_t)now;
-			if (valid_until <= LONG_MAX && valid != 0xffffffffLL)
-				addr->valid_until = valid_until;
+	if ((cur = tb[ADDR_PREFERRED])) {
+		int64_t preferred = blobmsg_get_u32(cur);
+		int64_t preferred_until = preferred + (int64_t)now;
+		if (preferred_until <= LONG_MAX && preferred != 0xffffffffLL)
+			addr->preferred_until = preferred_until;
+	}
 
-		}
+	if ((cur = tb[ADDR_VALID])) {
+		int64_t valid = blobmsg_get_u32(cur);
+		int64_t valid_until = valid + (int64_t)now;
+		if (valid_until <= LONG_MAX && valid != 0xffffffffLL)
+			addr->valid_until = valid_until;
 
-		if (addr->valid_until) {
-			if (!addr->preferred_until)
-				addr->preferred_until = addr->valid_until;
-			else if (addr->preferred_until > addr->valid_until)
-				goto error;
-		}
+	}
 
-		if ((cur = tb[ADDR_CLASS]))
-			addr->pclass = strdup(blobmsg_get_string(cur));
+	if (addr->valid_until) {
+		if (!addr->preferred_until)
+			addr->preferred_until = addr->valid_until;
+		else if (addr->preferred_until > addr->valid_until)
+			goto error;
 	}
 
 	return addr;
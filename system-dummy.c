@@ -42,7 +42,13 @@ int system_bridge_delbr(struct device *bridge)
 	return 0;
 }
 
-int system_bridge_addif(struct device *bridge, struct device *dev)
+int system_bridge_reload(struct device *bridge, struct bridge_config *cfg)
+{
+	D(SYSTEM, "ip link set %s type bridge\n", bridge->ifname);
+	return 0;
+}
+
+int system_bridge_addif(struct device *bridge, struct device *dev, bool *failed)
 {
 	D(SYSTEM, "brctl addif %s %s\n", bridge->ifname, dev->ifname);
 	return 0;
@@ -91,6 +97,18 @@ void system_if_clear_state(struct device *dev)
 {
 }
 
+void system_if_clear_state_begin(void)
+{
+}
+
+void system_if_clear_state_commit(void)
+{
+}
+
+void system_if_free_state(struct device *dev)
+{
+}
+
 int system_if_check(struct device *dev)
 {
 	dev->ifindex = 0;
@@ -124,6 +142,27 @@ system_if_dump_stats(struct device *dev, struct blob_buf *b)
 	return 0;
 }
 
+void
+system_set_stats_cache(unsigned int msec)
+{
+}
+
+void
+system_stats_invalidate(void)
+{
+}
+
+int
+system_if_get_stats(struct device *dev, struct device_counters *c)
+{
+	return -1;
+}
+
+void
+system_set_event_filter(const int *ifindex, int n)
+{
+}
+
 void
 system_if_apply_settings(struct device *dev, struct device_settings *s, unsigned int apply_mask)
 {
@@ -146,11 +185,40 @@ int system_add_address(struct device *dev, struct device_addr *addr)
 	return system_address_msg(dev, addr, "add");
 }
 
+int system_add_address_async(struct device *dev, struct device_addr *addr,
+			     struct system_request **req, system_request_cb cb)
+{
+	int ret = system_address_msg(dev, addr, "add");
+
+	*req = NULL;
+	cb(addr, ret);
+
+	return ret;
+}
+
 int system_del_address(struct device *dev, struct device_addr *addr)
 {
 	return system_address_msg(dev, addr, "del");
 }
 
+void system_dump_status(struct blob_buf *b)
+{
+}
+
+void system_batch_begin(void)
+{
+}
+
+int system_batch_commit(void)
+{
+	return 0;
+}
+
+void system_request_cancel(struct system_request **req)
+{
+	*req = NULL;
+}
+
 static int system_route_msg(struct device *dev, struct device_route *route, const char *type)
 {
 	char addr[64], gw[64] = " gw ", devstr[64] = "";
@@ -186,6 +254,17 @@ int system_add_route(struct device *dev, struct device_route *route)
 	return system_route_msg(dev, route, "add");
 }
 
+int system_add_route_async(struct device *dev, struct device_route *route,
+			   struct system_request **req, system_request_cb cb)
+{
+	int ret = system_route_msg(dev, route, "add");
+
+	*req = NULL;
+	cb(route, ret);
+
+	return ret;
+}
+
 int system_del_route(struct device *dev, struct device_route *route)
 {
 	return system_route_msg(dev, route, "del");
@@ -32,6 +32,7 @@
 #include <linux/rtnetlink.h>
 #include <linux/sockios.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/if_addr.h>
 #include <linux/if_link.h>
 #include <linux/if_vlan.h>
@@ -41,6 +42,9 @@
 #include <linux/ethtool.h>
 #include <linux/fib_rules.h>
 #include <linux/veth.h>
+#include <linux/pkt_sched.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
 #include <linux/version.h>
 
 #ifndef RTN_FAILED_POLICY
@@ -55,6 +59,15 @@
 #define IFA_FLAGS (IFA_MULTICAST + 1)
 #endif
 
+#ifndef IFLA_GSO_IPV4_MAX_SIZE
+#define IFLA_GSO_IPV4_MAX_SIZE 63
+#endif
+
+#ifndef IFLA_GRO_IPV4_MAX_SIZE
+#define IFLA_GRO_IPV4_MAX_SIZE 64
+#endif
+
+#include <stddef.h>
 #include <string.h>
 #include <fcntl.h>
 #include <glob.h>
@@ -65,6 +78,8 @@
 #include <netlink/attr.h>
 #include <netlink/socket.h>
 #include <libubox/uloop.h>
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
 
 #include "netifd.h"
 #include "device.h"
@@ -78,11 +93,23 @@ struct event_socket {
 
 static int sock_ioctl = -1;
 static struct nl_sock *sock_rtnl = NULL;
+static struct event_socket rtnl_async;
 
 static int cb_rtnl_event(struct nl_msg *msg, void *arg);
+static struct event_socket rtnl_event;
+static void system_devconf_invalidate(int ifindex);
 static void handle_hotplug_event(struct uloop_fd *u, unsigned int events);
+static void handler_rtnl_async(struct uloop_fd *u, unsigned int events);
+static int cb_rtnl_async_seq(struct nl_msg *msg, void *arg);
+static int cb_rtnl_async_ack(struct nl_msg *msg, void *arg);
+static int cb_rtnl_async_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg);
+static bool system_link_cache_init(void);
+static void system_if_link_info_invalidate(const char *ifname);
+static void system_rtnl_event_dump(void);
+static int cb_rtnl_event_done(struct nl_msg *msg, void *arg);
 
 static char dev_buf[256];
+static struct avl_tree system_dev_tree;
 
 static void
 handler_nl_event(struct uloop_fd *u, unsigned int events)
@@ -107,6 +134,11 @@ handler_nl_event(struct uloop_fd *u, unsigned int events)
 			goto abort;
 
 		// Request full dump since some info got dropped
+		if (ev == &rtnl_event) {
+			system_rtnl_event_dump();
+			break;
+		}
+
 		struct rtgenmsg msg = { .rtgen_family = AF_UNSPEC };
 		nl_send_simple(ev->sock, RTM_GETLINK, NLM_F_DUMP, &msg, sizeof(msg));
 		break;
@@ -229,14 +261,102 @@ system_tos_aton(const char *src, unsigned *dst)
 	return true;
 }
 
+/*
+ * Addresses and IPv6 routes with a lifetime are removed by the kernel, which
+ * reports it with RTM_DELADDR/RTM_DELROUTE. A dedicated socket listens for
+ * those, with a socket filter dropping all other address and route events.
+ */
+static void system_expiry_parse_addr(struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	struct nlattr *nla[__IFA_MAX], *cur;
+	struct device_addr addr;
+	int alen = ifa->ifa_family == AF_INET ? 4 : 16;
+
+	if (nlmsg_parse(nh, sizeof(*ifa), nla, __IFA_MAX - 1, NULL) < 0)
+		return;
+
+	cur = nla[IFA_LOCAL] ? nla[IFA_LOCAL] : nla[IFA_ADDRESS];
+	if (!cur || nla_len(cur) < alen)
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.flags = alen == 4 ? DEVADDR_INET4 : DEVADDR_INET6;
+	addr.mask = ifa->ifa_prefixlen;
+	memcpy(&addr.addr, nla_data(cur), alen);
+
+	interface_ip_addr_expired(ifa->ifa_index, &addr);
+}
+
+static void system_expiry_parse_route(struct nlmsghdr *nh)
+{
+	struct rtmsg *rtm = NLMSG_DATA(nh);
+	struct nlattr *nla[__RTA_MAX];
+	struct device_route route;
+
+	if (rtm->rtm_family != AF_INET6 ||
+	    nlmsg_parse(nh, sizeof(*rtm), nla, __RTA_MAX - 1, NULL) < 0 ||
+	    !nla[RTA_OIF])
+		return;
+
+	memset(&route, 0, sizeof(route));
+	route.flags = DEVADDR_INET6;
+	route.mask = rtm->rtm_dst_len;
+	if (nla[RTA_DST] && nla_len(nla[RTA_DST]) >= 16)
+		memcpy(&route.addr, nla_data(nla[RTA_DST]), 16);
+
+	interface_ip_route_expired(nla_get_u32(nla[RTA_OIF]), &route);
+}
+
+static int cb_rtnl_expiry(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nh = nlmsg_hdr(msg);
+
+	if (nh->nlmsg_type == RTM_DELADDR)
+		system_expiry_parse_addr(nh);
+	else if (nh->nlmsg_type == RTM_DELROUTE)
+		system_expiry_parse_route(nh);
+
+	return NL_OK;
+}
+
+static bool system_expiry_init(struct event_socket *ev)
+{
+	struct sock_filter insns[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(struct nlmsghdr, nlmsg_type)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELADDR), 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELROUTE), 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len = ARRAY_SIZE(insns),
+		.filter = insns,
+	};
+
+	if (!create_event_socket(ev, NETLINK_ROUTE, cb_rtnl_expiry))
+		return false;
+
+	if (setsockopt(nl_socket_get_fd(ev->sock), SOL_SOCKET, SO_ATTACH_FILTER,
+		       &prog, sizeof(prog)) < 0)
+		D(SYSTEM, "Failed to attach expiry event filter: %s\n", strerror(errno));
+
+	nl_socket_add_memberships(ev->sock, RTNLGRP_IPV4_IFADDR,
+				  RTNLGRP_IPV6_IFADDR, RTNLGRP_IPV6_ROUTE, 0);
+
+	return true;
+}
+
 int system_init(void)
 {
-	static struct event_socket rtnl_event;
 	static struct event_socket hotplug_event;
+	static struct event_socket expiry_event;
 
 	sock_ioctl = socket(AF_LOCAL, SOCK_DGRAM, 0);
 	system_fd_set_cloexec(sock_ioctl);
 
+	avl_init(&system_dev_tree, avl_strcmp, false, NULL);
+
 	// Prepare socket for routing / address control
 	sock_rtnl = create_socket(NETLINK_ROUTE, 0);
 	if (!sock_rtnl)
@@ -245,293 +365,581 @@ int system_init(void)
 	if (!create_event_socket(&rtnl_event, NETLINK_ROUTE, cb_rtnl_event))
 		return -1;
 
+	// Socket for requests whose completion is handled from the event loop
+	if (!create_raw_event_socket(&rtnl_async, NETLINK_ROUTE, 0,
+					handler_rtnl_async, 0))
+		return -1;
+
+	nl_socket_set_nonblocking(rtnl_async.sock);
+	nl_socket_modify_cb(rtnl_async.sock, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
+			    cb_rtnl_async_seq, NULL);
+	nl_socket_modify_cb(rtnl_async.sock, NL_CB_ACK, NL_CB_CUSTOM,
+			    cb_rtnl_async_ack, NULL);
+	nl_socket_modify_err_cb(rtnl_async.sock, NL_CB_CUSTOM,
+				cb_rtnl_async_error, NULL);
+
 	if (!create_raw_event_socket(&hotplug_event, NETLINK_KOBJECT_UEVENT, 1,
 					handle_hotplug_event, 0))
 		return -1;
 
 	// Receive network link events form kernel
 	nl_socket_add_membership(rtnl_event.sock, RTNLGRP_LINK);
+	nl_socket_modify_cb(rtnl_event.sock, NL_CB_FINISH, NL_CB_CUSTOM,
+			    cb_rtnl_event_done, NULL);
+
+	// Receive address and route removals done by the kernel
+	if (!system_expiry_init(&expiry_event))
+		return -1;
+
+	if (!system_link_cache_init())
+		D(SYSTEM, "Failed to initialize link cache\n");
 
 	return 0;
 }
 
-static void system_set_sysctl(const char *path, const char *val)
+static int system_set_sysctl(const char *path, const char *val)
 {
+	ssize_t len;
 	int fd;
 
 	fd = open(path, O_WRONLY);
 	if (fd < 0)
-		return;
+		return -1;
 
-	if (write(fd, val, strlen(val))) {}
+	len = write(fd, val, strlen(val));
 	close(fd);
-}
 
-static void system_set_dev_sysctl(const char *path, const char *device, const char *val)
-{
-	snprintf(dev_buf, sizeof(dev_buf), path, device);
-	system_set_sysctl(dev_buf, val);
+	return len == strlen(val) ? 0 : -1;
 }
 
-static void system_set_disable_ipv6(struct device *dev, const char *val)
+static int system_get_sysctl(const char *path, char *buf, const size_t buf_sz)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv6/conf/%s/disable_ipv6", dev->ifname, val);
-}
+	int fd = -1, ret = -1;
 
-static void system_set_rpfilter(struct device *dev, const char *val)
-{
-	system_set_dev_sysctl("/proc/sys/net/ipv4/conf/%s/rp_filter", dev->ifname, val);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		goto out;
+
+	ssize_t len = read(fd, buf, buf_sz - 1);
+	if (len < 0)
+		goto out;
+
+	ret = buf[len] = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
 }
 
-static void system_set_acceptlocal(struct device *dev, const char *val)
+enum {
+	DEV_SYSCTL_DISABLE_IPV6,
+	DEV_SYSCTL_RPFILTER,
+	DEV_SYSCTL_ACCEPTLOCAL,
+	DEV_SYSCTL_IGMPVERSION,
+	DEV_SYSCTL_MLDVERSION,
+	DEV_SYSCTL_NEIGH4REACHABLETIME,
+	DEV_SYSCTL_NEIGH6REACHABLETIME,
+	DEV_SYSCTL_NEIGH4GCSTALETIME,
+	DEV_SYSCTL_NEIGH6GCSTALETIME,
+	DEV_SYSCTL_NEIGH4LOCKTIME,
+	DEV_SYSCTL_DADTRANSMITS,
+	DEV_SYSCTL_SENDREDIRECTS,
+	__DEV_SYSCTL_MAX
+};
+
+static const char * const dev_sysctl_path[__DEV_SYSCTL_MAX] = {
+	[DEV_SYSCTL_DISABLE_IPV6] = "/proc/sys/net/ipv6/conf/%s/disable_ipv6",
+	[DEV_SYSCTL_RPFILTER] = "/proc/sys/net/ipv4/conf/%s/rp_filter",
+	[DEV_SYSCTL_ACCEPTLOCAL] = "/proc/sys/net/ipv4/conf/%s/accept_local",
+	[DEV_SYSCTL_IGMPVERSION] = "/proc/sys/net/ipv4/conf/%s/force_igmp_version",
+	[DEV_SYSCTL_MLDVERSION] = "/proc/sys/net/ipv6/conf/%s/force_mld_version",
+	[DEV_SYSCTL_NEIGH4REACHABLETIME] = "/proc/sys/net/ipv4/neigh/%s/base_reachable_time_ms",
+	[DEV_SYSCTL_NEIGH6REACHABLETIME] = "/proc/sys/net/ipv6/neigh/%s/base_reachable_time_ms",
+	[DEV_SYSCTL_NEIGH4GCSTALETIME] = "/proc/sys/net/ipv4/neigh/%s/gc_stale_time",
+	[DEV_SYSCTL_NEIGH6GCSTALETIME] = "/proc/sys/net/ipv6/neigh/%s/gc_stale_time",
+	[DEV_SYSCTL_NEIGH4LOCKTIME] = "/proc/sys/net/ipv4/neigh/%s/locktime",
+	[DEV_SYSCTL_DADTRANSMITS] = "/proc/sys/net/ipv6/conf/%s/dad_transmits",
+	[DEV_SYSCTL_SENDREDIRECTS] = "/proc/sys/net/ipv4/conf/%s/send_redirects",
+};
+
+/*
+ * Per-device state kept by the system layer. It holds the last value written
+ * to or read from each per-device sysctl: writing a value that is already
+ * known to be set is suppressed, so reloads that re-apply identical settings
+ * do not touch procfs at all. Entries are freed when the device is deleted
+ * from netifd or removed from the kernel.
+ */
+struct system_dev_state {
+	struct avl_node node;
+	char ifname[IFNAMSIZ];
+	int ifindex;
+	unsigned int issued;
+	unsigned int suppressed;
+	uint32_t valid;
+	char val[__DEV_SYSCTL_MAX][12];
+
+	/* RPS/XPS masks chosen for each queue, for status output */
+	struct blob_attr *ps_layout;
+
+	/* ethtool link settings, dropped on every link event */
+	struct blob_attr *link_info;
+
+	/* share of the global RFS socket flow table requested by this device */
+	bool rfs_active;
+	unsigned int rfs_entries;
+
+	/* root qdisc installed by netifd, removed again on teardown */
+	bool qdisc;
+
+	/* XDP program attached by netifd and the mode it was attached in */
+	bool xdp;
+	uint32_t xdp_flags;
+	uint32_t xdp_prog_id;
+};
+
+static struct system_dev_state *system_dev_state_get(struct device *dev)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv4/conf/%s/accept_local", dev->ifname, val);
+	struct system_dev_state *c;
+
+	if (strlen(dev->ifname) >= IFNAMSIZ)
+		return NULL;
+
+	c = avl_find_element(&system_dev_tree, dev->ifname, c, node);
+	if (!c) {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			return NULL;
+
+		strcpy(c->ifname, dev->ifname);
+		c->node.key = c->ifname;
+		avl_insert(&system_dev_tree, &c->node);
+	}
+
+	/* a recreated device starts out with kernel defaults */
+	if (c->ifindex != dev->ifindex) {
+		c->ifindex = dev->ifindex;
+		c->valid = 0;
+	}
+
+	return c;
 }
 
-static void system_set_igmpversion(struct device *dev, const char *val)
+static void system_rfs_release(struct system_dev_state *state);
+
+static void system_dev_state_free(const char *ifname, int ifindex)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv4/conf/%s/force_igmp_version", dev->ifname, val);
+	struct system_dev_state *c;
+
+	c = avl_find_element(&system_dev_tree, ifname, c, node);
+	if (!c)
+		return;
+
+	/* stale removal of a device that has been recreated already */
+	if (ifindex && c->ifindex && c->ifindex != ifindex)
+		return;
+
+	system_rfs_release(c);
+	avl_delete(&system_dev_tree, &c->node);
+	free(c->ps_layout);
+	free(c->link_info);
+	free(c);
 }
 
-static void system_set_mldversion(struct device *dev, const char *val)
+void system_if_free_state(struct device *dev)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv6/conf/%s/force_mld_version", dev->ifname, val);
+	system_devconf_invalidate(dev->ifindex);
+	system_dev_state_free(dev->ifname, 0);
 }
 
-static void system_set_neigh4reachabletime(struct device *dev, const char *val)
+static void system_dev_sysctl_store(struct device *dev, int id, const char *val)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv4/neigh/%s/base_reachable_time_ms", dev->ifname, val);
+	struct system_dev_state *c = system_dev_state_get(dev);
+	size_t len = strcspn(val, "\n");
+
+	if (!c)
+		return;
+
+	if (len >= sizeof(c->val[id])) {
+		c->valid &= ~(1 << id);
+		return;
+	}
+
+	memcpy(c->val[id], val, len);
+	c->val[id][len] = 0;
+	c->valid |= (1 << id);
 }
 
-static void system_set_neigh6reachabletime(struct device *dev, const char *val)
+static void system_set_dev_sysctl(struct device *dev, int id, const char *val)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv6/neigh/%s/base_reachable_time_ms", dev->ifname, val);
+	struct system_dev_state *c = system_dev_state_get(dev);
+	char path[256];
+
+	if (c && (c->valid & (1 << id)) && !strcmp(c->val[id], val)) {
+		c->suppressed++;
+		return;
+	}
+
+	if (c)
+		c->issued++;
+
+	system_devconf_invalidate(dev->ifindex);
+
+	snprintf(path, sizeof(path), dev_sysctl_path[id], dev->ifname);
+	if (system_set_sysctl(path, val) < 0) {
+		if (c)
+			c->valid &= ~(1 << id);
+		return;
+	}
+
+	system_dev_sysctl_store(dev, id, val);
 }
 
-static void system_set_neigh4gcstaletime(struct device *dev, const char *val)
+static int system_get_dev_sysctl(struct device *dev, int id, char *buf, const size_t buf_sz)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv4/neigh/%s/gc_stale_time", dev->ifname, val);
+	char path[256];
+
+	snprintf(path, sizeof(path), dev_sysctl_path[id], dev->ifname);
+	if (system_get_sysctl(path, buf, buf_sz))
+		return -1;
+
+	system_dev_sysctl_store(dev, id, buf);
+	return 0;
 }
 
-static void system_set_neigh6gcstaletime(struct device *dev, const char *val)
+static void system_set_disable_ipv6(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv6/neigh/%s/gc_stale_time", dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_DISABLE_IPV6, val);
 }
 
-static void system_set_neigh4locktime(struct device *dev, const char *val)
+static void system_set_rpfilter(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv4/neigh/%s/locktime", dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_RPFILTER, val);
 }
 
-static void system_set_dadtransmits(struct device *dev, const char *val)
+static void system_set_acceptlocal(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv6/conf/%s/dad_transmits", dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_ACCEPTLOCAL, val);
 }
 
-static void system_bridge_set_multicast_to_unicast(struct device *dev, const char *val)
+static void system_set_igmpversion(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/class/net/%s/brport/multicast_to_unicast", dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_IGMPVERSION, val);
 }
 
-static void system_bridge_set_multicast_fast_leave(struct device *dev, const char *val)
+static void system_set_mldversion(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/class/net/%s/brport/multicast_fast_leave", dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_MLDVERSION, val);
 }
 
-static void system_bridge_set_hairpin_mode(struct device *dev, const char *val)
+static void system_set_neigh4reachabletime(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/class/net/%s/brport/hairpin_mode", dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_NEIGH4REACHABLETIME, val);
 }
 
-static void system_bridge_set_multicast_router(struct device *dev, const char *val, bool bridge)
+static void system_set_neigh6reachabletime(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl(bridge ? "/sys/class/net/%s/bridge/multicast_router" :
-				       "/sys/class/net/%s/brport/multicast_router",
-			      dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_NEIGH6REACHABLETIME, val);
 }
 
-static void system_bridge_set_robustness(struct device *dev, const char *val)
+static void system_set_neigh4gcstaletime(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_startup_query_count",
-			      dev->ifname, val);
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_last_member_count",
-			      dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_NEIGH4GCSTALETIME, val);
 }
 
-static void system_bridge_set_query_interval(struct device *dev, const char *val)
+static void system_set_neigh6gcstaletime(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_query_interval",
-			      dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_NEIGH6GCSTALETIME, val);
 }
 
-static void system_bridge_set_query_response_interval(struct device *dev, const char *val)
+static void system_set_neigh4locktime(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_query_response_interval",
-			      dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_NEIGH4LOCKTIME, val);
 }
 
-static void system_bridge_set_last_member_interval(struct device *dev, const char *val)
+static void system_set_dadtransmits(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_last_member_interval",
-			      dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_DADTRANSMITS, val);
 }
 
-static void system_bridge_set_membership_interval(struct device *dev, const char *val)
+static void system_set_sendredirects(struct device *dev, const char *val)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_membership_interval",
-			      dev->ifname, val);
+	system_set_dev_sysctl(dev, DEV_SYSCTL_SENDREDIRECTS, val);
 }
 
-static void system_bridge_set_other_querier_timeout(struct device *dev, const char *val)
+static int system_get_neigh4reachabletime(struct device *dev, char *buf, const size_t buf_sz)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_querier_interval",
-			      dev->ifname, val);
+	return system_get_dev_sysctl(dev, DEV_SYSCTL_NEIGH4REACHABLETIME, buf, buf_sz);
 }
 
-static void system_bridge_set_startup_query_interval(struct device *dev, const char *val)
+static int system_get_neigh6reachabletime(struct device *dev, char *buf, const size_t buf_sz)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_startup_query_interval",
-			      dev->ifname, val);
+	return system_get_dev_sysctl(dev, DEV_SYSCTL_NEIGH6REACHABLETIME, buf, buf_sz);
 }
 
-static void system_bridge_set_learning(struct device *dev, const char *val)
+static int system_get_neigh4gcstaletime(struct device *dev, char *buf, const size_t buf_sz)
 {
-	system_set_dev_sysctl("/sys/class/net/%s/brport/learning", dev->ifname, val);
+	return system_get_dev_sysctl(dev, DEV_SYSCTL_NEIGH4GCSTALETIME, buf, buf_sz);
 }
 
-static void system_bridge_set_unicast_flood(struct device *dev, const char *val)
+static int system_get_neigh6gcstaletime(struct device *dev, char *buf, const size_t buf_sz)
 {
-	system_set_dev_sysctl("/sys/class/net/%s/brport/unicast_flood", dev->ifname, val);
+	return system_get_dev_sysctl(dev, DEV_SYSCTL_NEIGH6GCSTALETIME, buf, buf_sz);
 }
 
-static void system_set_sendredirects(struct device *dev, const char *val)
+static int system_get_neigh4locktime(struct device *dev, char *buf, const size_t buf_sz)
 {
-	system_set_dev_sysctl("/proc/sys/net/ipv4/conf/%s/send_redirects", dev->ifname, val);
+	return system_get_dev_sysctl(dev, DEV_SYSCTL_NEIGH4LOCKTIME, buf, buf_sz);
 }
 
-static int system_get_sysctl(const char *path, char *buf, const size_t buf_sz)
+struct system_link_info {
+	const char *ifname;
+	int ifindex;
+	unsigned int flags;
+	unsigned int mtu;
+	int master;
+	int link;
+	const char *kind;
+	uint8_t operstate;
+	bool carrier;
+};
+
+static struct {
+	uint64_t received;
+	uint64_t relevant;
+	uint64_t link;
+} rtnl_events;
+
+/*
+ * Classic BPF filter on the link event sockets, passing only messages for
+ * managed ifindexes and links that have just been registered (the kernel
+ * reports those with ifi_change set to ~0U). Everything else is dropped in
+ * the kernel before netifd is woken up. The link cache listener uses the
+ * same filter, so its entries for other links are verified on lookup, see
+ * system_link_find().
+ * Dropped messages never reach netifd and cannot be counted here; the status
+ * reports the link messages that were delivered and those that turned out to
+ * be relevant.
+ */
+#define RTNL_FILTER_MAX_IFINDEX	1024
+
+static struct {
+	bool active;
+	bool dump;
+	int n_ifindex;
+	struct sock_fprog prog;
+	uint64_t updates;
+	uint64_t refreshes;
+} rtnl_filter;
+
+static void system_link_cache_set_filter(struct sock_fprog *prog,
+					 const int *ifindex, int n);
+
+void system_set_event_filter(const int *ifindex, int n)
 {
-	int fd = -1, ret = -1;
+	struct sock_filter *insns, *p;
+	struct sock_fprog prog;
+	int fd, i;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0)
-		goto out;
+	if (!rtnl_event.sock)
+		return;
 
-	ssize_t len = read(fd, buf, buf_sz - 1);
-	if (len < 0)
-		goto out;
+	fd = nl_socket_get_fd(rtnl_event.sock);
+	if (!ifindex || n > RTNL_FILTER_MAX_IFINDEX) {
+		if (rtnl_filter.active) {
+			if (!rtnl_filter.dump)
+				setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+			system_link_cache_set_filter(NULL, NULL, 0);
+		}
 
-	ret = buf[len] = 0;
+		free(rtnl_filter.prog.filter);
+		rtnl_filter.prog.filter = NULL;
+		rtnl_filter.active = false;
+		rtnl_filter.n_ifindex = 0;
+		return;
+	}
 
-out:
-	if (fd >= 0)
-		close(fd);
+	insns = calloc(2 * n + 12, sizeof(*insns));
+	if (!insns)
+		return;
 
-	return ret;
-}
+	/* loads convert from network byte order, netlink uses host order */
+	p = insns;
+	*p++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+			offsetof(struct nlmsghdr, nlmsg_type));
+	*p++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			htons(RTM_NEWLINK), 2, 0);
+	*p++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			htons(RTM_DELLINK), 4, 0);
+	*p++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	*p++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			NLMSG_HDRLEN + offsetof(struct ifinfomsg, ifi_change));
+	*p++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			0xffffffff, 0, 1);
+	*p++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	*p++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+			NLMSG_HDRLEN + offsetof(struct ifinfomsg, ifi_family));
+	*p++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			AF_BRIDGE, 0, 1);
+	*p++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+
+	*p++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			NLMSG_HDRLEN + offsetof(struct ifinfomsg, ifi_index));
+	for (i = 0; i < n; i++) {
+		*p++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+				htonl(ifindex[i]), 0, 1);
+		*p++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	}
+	*p++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+
+	prog.len = p - insns;
+	prog.filter = insns;
+
+	/*
+	 * attaching again replaces the previous filter atomically; during a
+	 * dump, the filter is only attached once the dump is complete
+	 */
+	if (!rtnl_filter.dump &&
+	    setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		D(SYSTEM, "Failed to attach link event filter: %s\n", strerror(errno));
+		free(insns);
+		return;
+	}
 
-static int
-system_get_dev_sysctl(const char *path, const char *device, char *buf, const size_t buf_sz)
-{
-	snprintf(dev_buf, sizeof(dev_buf), path, device);
-	return system_get_sysctl(dev_buf, buf, buf_sz);
+	system_link_cache_set_filter(&prog, ifindex, n);
+	free(rtnl_filter.prog.filter);
+	rtnl_filter.prog = prog;
+	rtnl_filter.active = true;
+	rtnl_filter.n_ifindex = n;
+	rtnl_filter.updates++;
 }
 
-static int system_get_disable_ipv6(struct device *dev, char *buf, const size_t buf_sz)
+/*
+ * The filter only looks at the first message of each skb, and link dump
+ * replies have ifi_change cleared, so it would drop most of a dump. Detach
+ * it while the event socket resynchronizes with a full dump.
+ */
+static void system_rtnl_event_dump(void)
 {
-	return system_get_dev_sysctl("/proc/sys/net/ipv6/conf/%s/disable_ipv6",
-			dev->ifname, buf, buf_sz);
-}
+	struct rtgenmsg msg = { .rtgen_family = AF_UNSPEC };
 
-static int system_get_rpfilter(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv4/conf/%s/rp_filter",
-			dev->ifname, buf, buf_sz);
-}
+	if (rtnl_filter.active && !rtnl_filter.dump)
+		setsockopt(nl_socket_get_fd(rtnl_event.sock), SOL_SOCKET,
+			   SO_DETACH_FILTER, NULL, 0);
 
-static int system_get_acceptlocal(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv4/conf/%s/accept_local",
-			dev->ifname, buf, buf_sz);
+	rtnl_filter.dump = true;
+	nl_send_simple(rtnl_event.sock, RTM_GETLINK, NLM_F_DUMP, &msg, sizeof(msg));
 }
 
-static int system_get_igmpversion(struct device *dev, char *buf, const size_t buf_sz)
+static int cb_rtnl_event_done(struct nl_msg *msg, void *arg)
 {
-	return system_get_dev_sysctl("/proc/sys/net/ipv4/conf/%s/force_igmp_version",
-			dev->ifname, buf, buf_sz);
-}
+	int fd = nl_socket_get_fd(rtnl_event.sock);
 
-static int system_get_mldversion(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv6/conf/%s/force_mld_version",
-			dev->ifname, buf, buf_sz);
-}
+	if (!rtnl_filter.dump)
+		return NL_STOP;
 
-static int system_get_neigh4reachabletime(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv4/neigh/%s/base_reachable_time_ms",
-			dev->ifname, buf, buf_sz);
-}
+	rtnl_filter.dump = false;
+	if (rtnl_filter.active &&
+	    setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &rtnl_filter.prog,
+		       sizeof(rtnl_filter.prog)) < 0) {
+		D(SYSTEM, "Failed to attach link event filter: %s\n", strerror(errno));
+		system_set_event_filter(NULL, 0);
+	}
 
-static int system_get_neigh6reachabletime(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv6/neigh/%s/base_reachable_time_ms",
-			dev->ifname, buf, buf_sz);
+	return NL_STOP;
 }
 
-static int system_get_neigh4gcstaletime(struct device *dev, char *buf, const size_t buf_sz)
+static bool
+system_link_parse(struct nlmsghdr *nh, struct system_link_info *li)
 {
-	return system_get_dev_sysctl("/proc/sys/net/ipv4/neigh/%s/gc_stale_time",
-			dev->ifname, buf, buf_sz);
-}
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct nlattr *nla[__IFLA_MAX];
 
-static int system_get_neigh6gcstaletime(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv6/neigh/%s/gc_stale_time",
-			dev->ifname, buf, buf_sz);
-}
+	if (nlmsg_parse(nh, sizeof(*ifi), nla, __IFLA_MAX - 1, NULL) ||
+	    !nla[IFLA_IFNAME])
+		return false;
 
-static int system_get_neigh4locktime(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv4/neigh/%s/locktime",
-			dev->ifname, buf, buf_sz);
-}
+	memset(li, 0, sizeof(*li));
+	li->ifname = nla_get_string(nla[IFLA_IFNAME]);
+	li->ifindex = ifi->ifi_index;
+	li->flags = ifi->ifi_flags;
 
-static int system_get_dadtransmits(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv6/conf/%s/dad_transmits",
-			dev->ifname, buf, buf_sz);
-}
+	/* same semantics as /sys/class/net/<dev>/carrier */
+	li->carrier = !!(ifi->ifi_flags & IFF_LOWER_UP);
 
-static int system_get_sendredirects(struct device *dev, char *buf, const size_t buf_sz)
-{
-	return system_get_dev_sysctl("/proc/sys/net/ipv4/conf/%s/send_redirects",
-			dev->ifname, buf, buf_sz);
+	if (nla[IFLA_MTU])
+		li->mtu = nla_get_u32(nla[IFLA_MTU]);
+
+	if (nla[IFLA_MASTER])
+		li->master = nla_get_u32(nla[IFLA_MASTER]);
+
+	if (nla[IFLA_LINK])
+		li->link = nla_get_u32(nla[IFLA_LINK]);
+
+	if (nla[IFLA_OPERSTATE])
+		li->operstate = nla_get_u8(nla[IFLA_OPERSTATE]);
+
+	if (nla[IFLA_LINKINFO]) {
+		struct nlattr *linkinfo[__IFLA_INFO_MAX];
+
+		if (!nla_parse_nested(linkinfo, IFLA_INFO_MAX, nla[IFLA_LINKINFO], NULL) &&
+		    linkinfo[IFLA_INFO_KIND])
+			li->kind = nla_get_string(linkinfo[IFLA_INFO_KIND]);
+	}
+
+	return true;
 }
 
 // Evaluate netlink messages
 static int cb_rtnl_event(struct nl_msg *msg, void *arg)
 {
 	struct nlmsghdr *nh = nlmsg_hdr(msg);
-	struct nlattr *nla[__IFLA_MAX];
-	int link_state = 0;
-	char buf[10];
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct system_link_info li;
+	struct device *dev;
 
-	if (nh->nlmsg_type != RTM_NEWLINK)
+	rtnl_events.received++;
+
+	if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
 		goto out;
 
-	nlmsg_parse(nh, sizeof(struct ifinfomsg), nla, __IFLA_MAX - 1, NULL);
-	if (!nla[IFLA_IFNAME])
+	rtnl_events.link++;
+
+	/* bridge port notifications do not describe the link itself */
+	if (ifi->ifi_family == AF_BRIDGE)
+		goto out;
+
+	if (!system_link_parse(nh, &li))
 		goto out;
 
-	struct device *dev = device_find(nla_data(nla[IFLA_IFNAME]));
+	system_if_link_info_invalidate(li.ifname);
+	system_devconf_invalidate(li.ifindex);
+
+	if (nh->nlmsg_type == RTM_DELLINK)
+		system_dev_state_free(li.ifname, li.ifindex);
+
+	dev = device_find(li.ifname);
 	if (!dev)
 		goto out;
 
-	if (!system_get_dev_sysctl("/sys/class/net/%s/carrier", dev->ifname, buf, sizeof(buf)))
-		link_state = strtoul(buf, NULL, 0);
+	rtnl_events.relevant++;
+
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		/* stale event for a device that has been recreated already */
+		if (dev->ifindex && dev->ifindex != li.ifindex)
+			goto out;
+
+		device_set_link(dev, false);
+		if (dev->type == &simple_device_type)
+			device_set_present(dev, false);
 
-	device_set_link(dev, link_state ? true : false);
+		goto out;
+	}
+
+	device_set_link(dev, li.carrier);
 
 out:
 	return 0;
@@ -606,816 +1014,3192 @@ handle_hotplug_event(struct uloop_fd *u, unsigned int events)
 	}
 }
 
-static int system_rtnl_call(struct nl_msg *msg)
+/*
+ * Requests on the asynchronous control socket are queued locally and handed
+ * to the kernel from the event loop, packed into as few datagrams as
+ * possible. The kernel applies rtnetlink requests while handling sendmsg(),
+ * so their acks are already queued once the datagram is sent; they are
+ * collected when the socket becomes readable, and each one completes its
+ * request through the callback it was queued with.
+ * At most RTNL_ASYNC_MAX requests are kept in flight; further ones are sent
+ * as acks come back. Before any synchronous request, the whole queue is
+ * handed to the kernel first, which keeps the order of all requests intact.
+ */
+#define RTNL_ASYNC_MAX		64
+#define RTNL_ASYNC_BUFSIZE	(RTNL_ASYNC_MAX * 256)
+
+struct system_request {
+	struct list_head list;
+	struct nl_msg *msg; /* only set while queued locally */
+	uint32_t seq;
+	uint64_t start;
+
+	system_request_cb cb;
+	void *priv;
+	struct system_request **handle;
+};
+
+static LIST_HEAD(rtnl_requests);
+static LIST_HEAD(rtnl_queue);
+
+static struct {
+	unsigned int in_flight;
+	unsigned int queued;
+	unsigned int max_in_flight;
+	uint64_t requests;
+	uint64_t failed;
+	uint64_t latency_last;
+	uint64_t latency_max;
+	uint64_t latency_total;
+} rtnl_stats;
+
+static uint64_t system_rtnl_time(void)
 {
-	int ret;
+	struct timespec ts;
 
-	ret = nl_send_auto_complete(sock_rtnl, msg);
-	nlmsg_free(msg);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	if (ret < 0)
-		return ret;
+static void system_rtnl_account(uint64_t start, int error)
+{
+	uint64_t latency = system_rtnl_time() - start;
 
-	return nl_wait_for_ack(sock_rtnl);
+	rtnl_stats.requests++;
+	if (error)
+		rtnl_stats.failed++;
+
+	rtnl_stats.latency_last = latency;
+	rtnl_stats.latency_total += latency;
+	if (latency > rtnl_stats.latency_max)
+		rtnl_stats.latency_max = latency;
 }
 
-int system_bridge_delbr(struct device *bridge)
+static void system_rtnl_async_done(struct system_request *req, int error)
 {
-	return ioctl(sock_ioctl, SIOCBRDELBR, bridge->ifname);
+	system_rtnl_account(req->start, error);
+
+	if (error)
+		D(SYSTEM, "Netlink request %u failed: %s\n", req->seq, strerror(-error));
+
+	if (req->handle)
+		*req->handle = NULL;
+
+	if (req->cb)
+		req->cb(req->priv, error);
+
+	free(req);
 }
 
-static int system_bridge_if(const char *bridge, struct device *dev, int cmd, void *data)
+static void system_rtnl_async_complete(struct system_request *req, int error)
 {
-	struct ifreq ifr;
+	list_del(&req->list);
+	rtnl_stats.in_flight--;
+	system_rtnl_async_done(req, error);
+}
 
-	memset(&ifr, 0, sizeof(ifr));
-	if (dev)
-		ifr.ifr_ifindex = dev->ifindex;
-	else
-		ifr.ifr_data = data;
-	strncpy(ifr.ifr_name, bridge, sizeof(ifr.ifr_name));
-	return ioctl(sock_ioctl, cmd, &ifr);
-}
-
-static bool system_is_bridge(const char *name, char *buf, int buflen)
+static void system_rtnl_async_complete_seq(uint32_t seq, int error)
 {
-	struct stat st;
+	struct system_request *req;
 
-	snprintf(buf, buflen, "/sys/devices/virtual/net/%s/bridge", name);
-	if (stat(buf, &st) < 0)
-		return false;
+	list_for_each_entry(req, &rtnl_requests, list) {
+		if (req->seq != seq)
+			continue;
 
-	return true;
+		system_rtnl_async_complete(req, error);
+		return;
+	}
 }
 
-static char *system_get_bridge(const char *name, char *buf, int buflen)
+static int cb_rtnl_async_seq(struct nl_msg *msg, void *arg)
 {
-	char *path;
-	ssize_t len = -1;
-	glob_t gl;
+	return NL_OK;
+}
 
-	snprintf(buf, buflen, "/sys/devices/virtual/net/*/brif/%s/bridge", name);
-	if (glob(buf, GLOB_NOSORT, NULL, &gl) < 0)
-		return NULL;
+static int cb_rtnl_async_ack(struct nl_msg *msg, void *arg)
+{
+	system_rtnl_async_complete_seq(nlmsg_hdr(msg)->nlmsg_seq, 0);
+	return NL_OK;
+}
 
-	if (gl.gl_pathc > 0)
-		len = readlink(gl.gl_pathv[0], buf, buflen);
+static int cb_rtnl_async_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+	system_rtnl_async_complete_seq(err->msg.nlmsg_seq, err->error);
+	return NL_SKIP;
+}
 
-	globfree(&gl);
+/* collect the acks that are already queued on the socket, never blocks */
+static void system_rtnl_async_poll(void)
+{
+	struct system_request *req, *tmp;
+	int ret;
 
-	if (len < 0)
-		return NULL;
+	for (;;) {
+		ret = nl_recvmsgs_default(rtnl_async.sock);
+		if (ret == -NLE_AGAIN)
+			break;
 
-	buf[len] = 0;
-	path = strrchr(buf, '/');
-	if (!path)
-		return NULL;
+		if (ret >= 0)
+			continue;
 
-	return path + 1;
+		/* acks may have been dropped, do not wait for them */
+		list_for_each_entry_safe(req, tmp, &rtnl_requests, list)
+			system_rtnl_async_complete(req, -ENOBUFS);
+
+		if (ret != -NLE_NOMEM)
+			break;
+	}
 }
 
-static void
-system_bridge_set_wireless(struct device *bridge, struct device *dev)
+static void system_rtnl_async_send(struct list_head *list, void *buf, size_t len)
 {
-	bool mcast_to_ucast = dev->wireless_ap;
-	bool hairpin = true;
+	struct system_request *req, *tmp;
+	int ret;
 
-	if (bridge->settings.flags & DEV_OPT_MULTICAST_TO_UNICAST &&
-	    !bridge->settings.multicast_to_unicast)
-		mcast_to_ucast = false;
+	ret = nl_sendto(rtnl_async.sock, buf, len);
+	if (ret < 0)
+		ret = -errno;
 
-	if (!mcast_to_ucast || dev->wireless_isolate)
-		hairpin = false;
+	list_for_each_entry_safe(req, tmp, list, list) {
+		list_del(&req->list);
+
+		if (ret < 0) {
+			system_rtnl_async_done(req, ret);
+			continue;
+		}
 
-	system_bridge_set_multicast_to_unicast(dev, mcast_to_ucast ? "1" : "0");
-	system_bridge_set_hairpin_mode(dev, hairpin ? "1" : "0");
+		list_add_tail(&req->list, &rtnl_requests);
+		if (++rtnl_stats.in_flight > rtnl_stats.max_in_flight)
+			rtnl_stats.max_in_flight = rtnl_stats.in_flight;
+	}
 }
 
-int system_bridge_addif(struct device *bridge, struct device *dev)
+/*
+ * Send queued requests until RTNL_ASYNC_MAX are in flight, or all of them if
+ * force is set. In that case, the acks of each datagram are collected right
+ * after sending it, so they cannot overrun the receive queue.
+ */
+static void system_rtnl_async_kick(bool force)
 {
-	char buf[64];
-	char *oldbr;
-	int ret = 0;
+	static char buf[RTNL_ASYNC_BUFSIZE];
+	LIST_HEAD(list);
+	struct system_request *req;
+	struct nlmsghdr *hdr;
+	size_t len = 0;
+	int n = 0;
+
+	if (force)
+		system_rtnl_async_poll();
+
+	while (!list_empty(&rtnl_queue)) {
+		if (!force && rtnl_stats.in_flight + n >= RTNL_ASYNC_MAX)
+			break;
 
-	oldbr = system_get_bridge(dev->ifname, dev_buf, sizeof(dev_buf));
-	if (!oldbr || strcmp(oldbr, bridge->ifname) != 0)
-		ret = system_bridge_if(bridge->ifname, dev, SIOCBRADDIF, NULL);
+		req = list_first_entry(&rtnl_queue, struct system_request, list);
+		hdr = nlmsg_hdr(req->msg);
 
-	if (dev->wireless)
-		system_bridge_set_wireless(bridge, dev);
+		if (n == RTNL_ASYNC_MAX ||
+		    len + NLMSG_ALIGN(hdr->nlmsg_len) > sizeof(buf)) {
+			system_rtnl_async_send(&list, buf, len);
+			len = 0;
+			n = 0;
 
-	if (dev->settings.flags & DEV_OPT_MULTICAST_ROUTER) {
-		snprintf(buf, sizeof(buf), "%i", dev->settings.multicast_router);
-		system_bridge_set_multicast_router(dev, buf, false);
-	}
+			if (force)
+				system_rtnl_async_poll();
+			continue;
+		}
 
-	if (dev->settings.flags & DEV_OPT_MULTICAST_FAST_LEAVE &&
-	    dev->settings.multicast_fast_leave)
-		system_bridge_set_multicast_fast_leave(dev, "1");
+		list_move_tail(&req->list, &list);
+		rtnl_stats.queued--;
+		n++;
 
-	if (dev->settings.flags & DEV_OPT_LEARNING &&
-	    !dev->settings.learning)
-		system_bridge_set_learning(dev, "0");
+		hdr->nlmsg_seq = NL_AUTO_SEQ;
+		hdr->nlmsg_pid = NL_AUTO_PORT;
+		hdr->nlmsg_flags |= NLM_F_ACK;
+		nl_complete_msg(rtnl_async.sock, req->msg);
+		req->seq = hdr->nlmsg_seq;
 
-	if (dev->settings.flags & DEV_OPT_UNICAST_FLOOD &&
-	    !dev->settings.unicast_flood)
-		system_bridge_set_unicast_flood(dev, "0");
+		memcpy(buf + len, hdr, hdr->nlmsg_len);
+		len += NLMSG_ALIGN(hdr->nlmsg_len);
 
-	return ret;
+		nlmsg_free(req->msg);
+		req->msg = NULL;
+	}
+
+	if (len)
+		system_rtnl_async_send(&list, buf, len);
+
+	if (force)
+		system_rtnl_async_poll();
 }
 
-int system_bridge_delif(struct device *bridge, struct device *dev)
+static void
+handler_rtnl_async(struct uloop_fd *u, unsigned int events)
 {
-	return system_bridge_if(bridge->ifname, dev, SIOCBRDELIF, NULL);
+	system_rtnl_async_poll();
+	system_rtnl_async_kick(false);
 }
 
-int system_if_resolve(struct device *dev)
+/* hand all locally queued requests to the kernel before continuing */
+static void system_rtnl_async_flush(void)
 {
-	struct ifreq ifr;
-	strncpy(ifr.ifr_name, dev->ifname, sizeof(ifr.ifr_name));
-	if (!ioctl(sock_ioctl, SIOCGIFINDEX, &ifr))
-		return ifr.ifr_ifindex;
-	else
-		return 0;
+	if (!list_empty(&rtnl_queue))
+		system_rtnl_async_kick(true);
 }
 
-static int system_if_flags(const char *ifname, unsigned add, unsigned rem)
+void system_dump_status(struct blob_buf *b)
 {
-	struct ifreq ifr;
+	void *c;
 
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
-	ioctl(sock_ioctl, SIOCGIFFLAGS, &ifr);
-	ifr.ifr_flags |= add;
-	ifr.ifr_flags &= ~rem;
-	return ioctl(sock_ioctl, SIOCSIFFLAGS, &ifr);
+	c = blobmsg_open_table(b, "rtnl");
+	blobmsg_add_u32(b, "in_flight", rtnl_stats.in_flight);
+	blobmsg_add_u32(b, "max_in_flight", rtnl_stats.max_in_flight);
+	blobmsg_add_u32(b, "queued", rtnl_stats.queued);
+	blobmsg_add_u64(b, "requests", rtnl_stats.requests);
+	blobmsg_add_u64(b, "failed", rtnl_stats.failed);
+	blobmsg_add_u64(b, "latency_last", rtnl_stats.latency_last);
+	blobmsg_add_u64(b, "latency_max", rtnl_stats.latency_max);
+	blobmsg_add_u64(b, "latency_avg", rtnl_stats.requests ?
+			rtnl_stats.latency_total / rtnl_stats.requests : 0);
+	blobmsg_close_table(b, c);
+
+	c = blobmsg_open_table(b, "events");
+	blobmsg_add_u64(b, "received", rtnl_events.received);
+	blobmsg_add_u64(b, "link_delivered", rtnl_events.link);
+	blobmsg_add_u64(b, "relevant", rtnl_events.relevant);
+	if (rtnl_filter.active)
+		blobmsg_add_u32(b, "filter_ifindexes", rtnl_filter.n_ifindex);
+	blobmsg_add_u64(b, "filter_updates", rtnl_filter.updates);
+	blobmsg_add_u64(b, "filter_refreshes", rtnl_filter.refreshes);
+	blobmsg_close_table(b, c);
 }
 
-struct clear_data {
+/*
+ * Address and route requests issued while a batch is open are queued and
+ * sent to the kernel in a single datagram; the acks are matched to their
+ * requests by sequence number once the whole datagram has been processed.
+ * Each ack occupies a full skb in the socket receive queue, so keep the
+ * number of requests per datagram small enough not to overrun it.
+ */
+#define RTNL_BATCH_MAX		64
+#define RTNL_BATCH_BUFSIZE	(RTNL_BATCH_MAX * 256)
+
+struct rtnl_batch_req {
 	struct nl_msg *msg;
-	struct device *dev;
-	int type;
-	int size;
-	int af;
+	bool *failed;
+	int error;
 };
 
+static struct {
+	int depth;
+	int n_req;
+	int pending;
+	size_t len;
+	uint32_t seq;
+	struct rtnl_batch_req req[RTNL_BATCH_MAX];
+} rtnl_batch;
 
-static bool check_ifaddr(struct nlmsghdr *hdr, int ifindex)
+static struct rtnl_batch_req *
+system_rtnl_batch_req(uint32_t seq)
 {
-	struct ifaddrmsg *ifa = NLMSG_DATA(hdr);
+	uint32_t idx = seq - rtnl_batch.seq;
 
-	return ifa->ifa_index == ifindex;
+	if (idx >= (uint32_t) rtnl_batch.n_req)
+		return NULL;
+
+	return &rtnl_batch.req[idx];
 }
 
-static bool check_route(struct nlmsghdr *hdr, int ifindex)
+static int cb_rtnl_batch_seq(struct nl_msg *msg, void *arg)
 {
-	struct rtmsg *r = NLMSG_DATA(hdr);
-	struct nlattr *tb[__RTA_MAX];
+	return NL_OK;
+}
 
-	if (r->rtm_protocol == RTPROT_KERNEL &&
-	    r->rtm_family == AF_INET6)
-		return false;
+static int cb_rtnl_batch_ack(struct nl_msg *msg, void *arg)
+{
+	struct rtnl_batch_req *req;
 
-	nlmsg_parse(hdr, sizeof(struct rtmsg), tb, __RTA_MAX - 1, NULL);
-	if (!tb[RTA_OIF])
-		return false;
+	req = system_rtnl_batch_req(nlmsg_hdr(msg)->nlmsg_seq);
+	if (req && req->error > 0) {
+		req->error = 0;
+		rtnl_batch.pending--;
+	}
 
-	return *(int *)RTA_DATA(tb[RTA_OIF]) == ifindex;
+	return NL_OK;
 }
 
-static bool check_rule(struct nlmsghdr *hdr, int ifindex)
+static int cb_rtnl_batch_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
 {
-	return true;
+	struct rtnl_batch_req *req;
+
+	req = system_rtnl_batch_req(err->msg.nlmsg_seq);
+	if (req && req->error > 0) {
+		req->error = err->error;
+		rtnl_batch.pending--;
+	}
+
+	return NL_SKIP;
 }
 
-static int cb_clear_event(struct nl_msg *msg, void *arg)
+static void system_link_cache_dirty(void);
+
+static int system_rtnl_link_index(struct nlmsghdr *nh)
 {
-	struct clear_data *clr = arg;
-	struct nlmsghdr *hdr = nlmsg_hdr(msg);
-	bool (*cb)(struct nlmsghdr *, int ifindex);
-	int type;
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct nlattr *tb[IFLA_MAX + 1];
 
-	switch(clr->type) {
-	case RTM_GETADDR:
-		type = RTM_DELADDR;
-		if (hdr->nlmsg_type != RTM_NEWADDR)
-			return NL_SKIP;
+	if (ifi->ifi_index)
+		return ifi->ifi_index;
 
-		cb = check_ifaddr;
-		break;
-	case RTM_GETROUTE:
-		type = RTM_DELROUTE;
-		if (hdr->nlmsg_type != RTM_NEWROUTE)
-			return NL_SKIP;
+	if (nlmsg_parse(nh, sizeof(*ifi), tb, IFLA_MAX, NULL) < 0 ||
+	    !tb[IFLA_IFNAME])
+		return 0;
 
-		cb = check_route;
-		break;
-	case RTM_GETRULE:
-		type = RTM_DELRULE;
-		if (hdr->nlmsg_type != RTM_NEWRULE)
-			return NL_SKIP;
+	return if_nametoindex(nla_get_string(tb[IFLA_IFNAME]));
+}
 
-		cb = check_rule;
-		break;
-	default:
-		return NL_SKIP;
+static int system_rtnl_batch_flush(void)
+{
+	static char buf[RTNL_BATCH_BUFSIZE];
+	struct nl_cb *cb;
+	uint64_t start;
+	size_t len = 0;
+	int i, ret = 0;
+
+	if (!rtnl_batch.n_req)
+		return 0;
+
+	system_rtnl_async_flush();
+
+	for (i = 0; i < rtnl_batch.n_req; i++) {
+		struct rtnl_batch_req *req = &rtnl_batch.req[i];
+		struct nlmsghdr *hdr = nlmsg_hdr(req->msg);
+
+		nl_complete_msg(sock_rtnl, req->msg);
+		if (!i)
+			rtnl_batch.seq = hdr->nlmsg_seq;
+
+		memcpy(buf + len, hdr, hdr->nlmsg_len);
+		len += NLMSG_ALIGN(hdr->nlmsg_len);
+		req->error = 1;
 	}
 
-	if (!cb(hdr, clr->dev ? clr->dev->ifindex : 0))
-		return NL_SKIP;
+	rtnl_batch.pending = rtnl_batch.n_req;
+	start = system_rtnl_time();
 
-	if (type == RTM_DELRULE)
-		D(SYSTEM, "Remove a rule\n");
-	else
-		D(SYSTEM, "Remove %s from device %s\n",
-		  type == RTM_DELADDR ? "an address" : "a route",
-		  clr->dev->ifname);
-	memcpy(nlmsg_hdr(clr->msg), hdr, hdr->nlmsg_len);
-	hdr = nlmsg_hdr(clr->msg);
-	hdr->nlmsg_type = type;
-	hdr->nlmsg_flags = NLM_F_REQUEST;
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (cb && nl_sendto(sock_rtnl, buf, len) >= 0) {
+		nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, cb_rtnl_batch_seq, NULL);
+		nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, cb_rtnl_batch_ack, NULL);
+		nl_cb_err(cb, NL_CB_CUSTOM, cb_rtnl_batch_error, NULL);
 
-	nl_socket_disable_auto_ack(sock_rtnl);
-	nl_send_auto_complete(sock_rtnl, clr->msg);
-	nl_socket_enable_auto_ack(sock_rtnl);
+		while (rtnl_batch.pending > 0)
+			if (nl_recvmsgs(sock_rtnl, cb) < 0)
+				break;
+	}
 
-	return NL_SKIP;
+	for (i = 0; i < rtnl_batch.n_req; i++) {
+		struct rtnl_batch_req *req = &rtnl_batch.req[i];
+		struct nlmsghdr *hdr = nlmsg_hdr(req->msg);
+
+		if (hdr->nlmsg_type == RTM_SETLINK) {
+			system_link_cache_dirty();
+			system_devconf_invalidate(system_rtnl_link_index(hdr));
+		}
+
+		system_rtnl_account(start, req->error);
+		if (req->error) {
+			if (req->failed)
+				*req->failed = true;
+
+			ret = -1;
+		}
+
+		nlmsg_free(req->msg);
+	}
+
+	if (cb)
+		nl_cb_put(cb);
+
+	rtnl_batch.n_req = 0;
+	rtnl_batch.pending = 0;
+	rtnl_batch.len = 0;
+
+	return ret;
 }
 
-static int
-cb_finish_event(struct nl_msg *msg, void *arg)
+static int system_rtnl_call(struct nl_msg *msg);
+
+static int system_rtnl_batch_add(struct nl_msg *msg, bool *failed)
 {
-	int *pending = arg;
-	*pending = 0;
-	return NL_STOP;
+	struct rtnl_batch_req *req;
+	size_t len = NLMSG_ALIGN(nlmsg_hdr(msg)->nlmsg_len);
+
+	if (len > RTNL_BATCH_BUFSIZE)
+		return system_rtnl_call(msg);
+
+	if (rtnl_batch.n_req == RTNL_BATCH_MAX ||
+	    rtnl_batch.len + len > RTNL_BATCH_BUFSIZE)
+		system_rtnl_batch_flush();
+
+	req = &rtnl_batch.req[rtnl_batch.n_req++];
+	req->msg = msg;
+	req->failed = failed;
+	rtnl_batch.len += len;
+
+	return 0;
 }
 
-static int
-error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+void system_batch_begin(void)
 {
-	int *pending = arg;
-	*pending = err->error;
-	return NL_STOP;
+	rtnl_batch.depth++;
 }
 
-static void
-system_if_clear_entries(struct device *dev, int type, int af)
+int system_batch_commit(void)
 {
-	struct clear_data clr;
-	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
-	struct rtmsg rtm = {
-		.rtm_family = af,
-		.rtm_flags = RTM_F_CLONED,
-	};
-	int flags = NLM_F_DUMP;
-	int pending = 1;
-
-	clr.af = af;
-	clr.dev = dev;
-	clr.type = type;
-	switch (type) {
-	case RTM_GETADDR:
-	case RTM_GETRULE:
-		clr.size = sizeof(struct rtgenmsg);
-		break;
-	case RTM_GETROUTE:
-		clr.size = sizeof(struct rtmsg);
-		break;
-	default:
-		return;
-	}
-
-	if (!cb)
-		return;
-
-	clr.msg = nlmsg_alloc_simple(type, flags);
-	if (!clr.msg)
-		goto out;
+	int ret;
 
-	nlmsg_append(clr.msg, &rtm, clr.size, 0);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_clear_event, &clr);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_finish_event, &pending);
-	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &pending);
+	if (rtnl_batch.depth > 0 && --rtnl_batch.depth > 0)
+		return 0;
 
-	nl_send_auto_complete(sock_rtnl, clr.msg);
-	while (pending > 0)
-		nl_recvmsgs(sock_rtnl, cb);
+	ret = system_rtnl_batch_flush();
+	system_rtnl_async_kick(false);
 
-	nlmsg_free(clr.msg);
-out:
-	nl_cb_put(cb);
+	return ret;
 }
 
 /*
- * Clear bridge (membership) state and bring down device
+ * Queue a request whose ack is handled from the event loop. If handle is
+ * set, it points to the request until it completes. Takes ownership of msg.
  */
-void system_if_clear_state(struct device *dev)
+static int system_rtnl_call_async(struct nl_msg *msg, system_request_cb cb,
+				  void *priv, struct system_request **handle)
 {
-	static char buf[256];
-	char *bridge;
+	struct system_request *req;
+	int ret;
 
-	device_set_ifindex(dev, system_if_resolve(dev));
-	if (dev->external || !dev->ifindex)
-		return;
+	/* requests added to the open batch so far go first */
+	system_rtnl_batch_flush();
 
-	system_if_flags(dev->ifname, 0, IFF_UP);
+	if (NLMSG_ALIGN(nlmsg_hdr(msg)->nlmsg_len) > RTNL_ASYNC_BUFSIZE) {
+		ret = system_rtnl_call(msg);
+		if (cb)
+			cb(priv, ret);
 
-	if (system_is_bridge(dev->ifname, buf, sizeof(buf))) {
-		D(SYSTEM, "Delete existing bridge named '%s'\n", dev->ifname);
-		system_bridge_delbr(dev);
-		return;
+		return ret;
 	}
 
-	bridge = system_get_bridge(dev->ifname, buf, sizeof(buf));
-	if (bridge) {
-		D(SYSTEM, "Remove device '%s' from bridge '%s'\n", dev->ifname, bridge);
-		system_bridge_if(bridge, dev, SIOCBRDELIF, NULL);
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		nlmsg_free(msg);
+		return -ENOMEM;
 	}
 
-	system_if_clear_entries(dev, RTM_GETROUTE, AF_INET);
-	system_if_clear_entries(dev, RTM_GETADDR, AF_INET);
-	system_if_clear_entries(dev, RTM_GETROUTE, AF_INET6);
-	system_if_clear_entries(dev, RTM_GETADDR, AF_INET6);
-	system_set_disable_ipv6(dev, "0");
+	req->msg = msg;
+	req->start = system_rtnl_time();
+	req->cb = cb;
+	req->priv = priv;
+
+	if (handle) {
+		system_request_cancel(handle);
+		req->handle = handle;
+		*handle = req;
+	}
+
+	list_add_tail(&req->list, &rtnl_queue);
+	rtnl_stats.queued++;
+
+	if (!rtnl_batch.depth)
+		system_rtnl_async_kick(false);
+
+	return 0;
 }
 
-static inline unsigned long
-sec_to_jiffies(int val)
+void system_request_cancel(struct system_request **req)
 {
-	return (unsigned long) val * 100;
+	if (!*req)
+		return;
+
+	(*req)->cb = NULL;
+	(*req)->handle = NULL;
+	*req = NULL;
 }
 
-static void system_bridge_conf_multicast_deps(struct device *bridge,
-					      struct bridge_config *cfg,
-					      char *buf,
-					      int buf_len)
+static int system_rtnl_call(struct nl_msg *msg)
 {
-	int val;
+	uint64_t start = system_rtnl_time();
+	struct nlmsghdr *nh = nlmsg_hdr(msg);
+	int type = nh->nlmsg_type;
+	int ifindex = 0;
+	int ret;
 
-	if (cfg->flags & BRIDGE_OPT_ROBUSTNESS ||
-	    cfg->flags & BRIDGE_OPT_QUERY_INTERVAL ||
-	    cfg->flags & BRIDGE_OPT_QUERY_RESPONSE_INTERVAL) {
-		val = cfg->robustness * cfg->query_interval +
-			cfg->query_response_interval;
+	system_rtnl_batch_flush();
+	system_rtnl_async_flush();
 
-		snprintf(buf, buf_len, "%i", val);
-		system_bridge_set_membership_interval(bridge, buf);
+	if (type == RTM_NEWLINK || type == RTM_DELLINK || type == RTM_SETLINK)
+		ifindex = system_rtnl_link_index(nh);
+
+	ret = nl_send_auto_complete(sock_rtnl, msg);
+	nlmsg_free(msg);
 
-		val = cfg->robustness * cfg->query_interval +
-			cfg->query_response_interval / 2;
+	if (ret >= 0)
+		ret = nl_wait_for_ack(sock_rtnl);
 
-		snprintf(buf, buf_len, "%i", val);
-		system_bridge_set_other_querier_timeout(bridge, buf);
+	if (type == RTM_NEWLINK || type == RTM_DELLINK || type == RTM_SETLINK) {
+		system_link_cache_dirty();
+		system_devconf_invalidate(ifindex);
 	}
 
-	if (cfg->flags & BRIDGE_OPT_QUERY_INTERVAL) {
-		val = cfg->query_interval / 4;
+	system_rtnl_account(start, ret);
+	return ret;
+}
 
-		snprintf(buf, buf_len, "%i", val);
-		system_bridge_set_startup_query_interval(bridge, buf);
-	}
+/*
+ * Cache of all kernel links, filled by one RTM_GETLINK dump and kept current
+ * from the event loop by a dedicated RTNLGRP_LINK listener, so lookups are
+ * answered without a syscall. Notifications for changes made by netifd itself
+ * are queued on that socket before the triggering syscall returns; those
+ * requests mark the cache dirty and the next lookup drains the socket first.
+ * A name that is not found is looked up again after draining, in case the
+ * link was just created by some other process. While the event filter is
+ * attached, only the entries of managed links are kept current this way.
+ */
+struct system_link {
+	struct avl_node name_node;
+	struct avl_node index_node;
+	int ifindex;
+	unsigned int flags;
+	int master;
+	int link;
+	bool bridge;
+	char ifname[IFNAMSIZ];
+};
+
+static struct {
+	struct event_socket ev;
+	struct avl_tree by_name;
+	struct avl_tree by_index;
+	bool valid;
+	bool dirty;
+
+	/* sorted ifindexes passed by the event filter, if attached */
+	bool filtered;
+	int *managed;
+	int n_managed;
+} link_cache;
+
+static int
+avl_ifindex_cmp(const void *k1, const void *k2, void *ptr)
+{
+	int i1 = *(const int *) k1, i2 = *(const int *) k2;
+
+	return (i1 > i2) - (i1 < i2);
+}
+
+static int
+cmp_ifindex(const void *k1, const void *k2)
+{
+	return avl_ifindex_cmp(k1, k2, NULL);
 }
 
-static void system_bridge_conf_multicast(struct device *bridge,
-					 struct bridge_config *cfg,
-					 char *buf,
-					 int buf_len)
+static void system_link_cache_del(struct system_link *link)
 {
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_snooping",
-		bridge->ifname, cfg->igmp_snoop ? "1" : "0");
+	avl_delete(&link_cache.by_name, &link->name_node);
+	avl_delete(&link_cache.by_index, &link->index_node);
+	free(link);
+}
 
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/multicast_querier",
-		bridge->ifname, cfg->multicast_querier ? "1" : "0");
+static void system_link_cache_update(struct system_link_info *li)
+{
+	struct system_link *link;
 
-	snprintf(buf, buf_len, "%i", cfg->hash_max);
-	system_set_dev_sysctl("/sys/devices/virtual/net/%s/bridge/hash_max",
-		bridge->ifname, buf);
+	if (strlen(li->ifname) >= IFNAMSIZ)
+		return;
 
-	if (bridge->settings.flags & DEV_OPT_MULTICAST_ROUTER) {
-		snprintf(buf, buf_len, "%i", bridge->settings.multicast_router);
-		system_bridge_set_multicast_router(bridge, buf, true);
+	link = avl_find_element(&link_cache.by_index, &li->ifindex, link, index_node);
+	if (link && strcmp(link->ifname, li->ifname) != 0) {
+		/* renamed */
+		avl_delete(&link_cache.by_name, &link->name_node);
+		strcpy(link->ifname, li->ifname);
+		avl_insert(&link_cache.by_name, &link->name_node);
 	}
 
-	if (cfg->flags & BRIDGE_OPT_ROBUSTNESS) {
-		snprintf(buf, buf_len, "%i", cfg->robustness);
-		system_bridge_set_robustness(bridge, buf);
+	if (!link) {
+		/* a stale entry for the same name may still exist */
+		link = avl_find_element(&link_cache.by_name, li->ifname, link, name_node);
+		if (link)
+			system_link_cache_del(link);
+
+		link = calloc(1, sizeof(*link));
+		if (!link)
+			return;
+
+		link->ifindex = li->ifindex;
+		strcpy(link->ifname, li->ifname);
+		link->name_node.key = link->ifname;
+		link->index_node.key = &link->ifindex;
+		avl_insert(&link_cache.by_name, &link->name_node);
+		avl_insert(&link_cache.by_index, &link->index_node);
 	}
 
-	if (cfg->flags & BRIDGE_OPT_QUERY_INTERVAL) {
-		snprintf(buf, buf_len, "%i", cfg->query_interval);
-		system_bridge_set_query_interval(bridge, buf);
-	}
+	link->flags = li->flags;
+	link->master = li->master;
+	link->link = li->link;
+	link->bridge = li->kind && !strcmp(li->kind, "bridge");
+}
 
-	if (cfg->flags & BRIDGE_OPT_QUERY_RESPONSE_INTERVAL) {
-		snprintf(buf, buf_len, "%i", cfg->query_response_interval);
-		system_bridge_set_query_response_interval(bridge, buf);
-	}
+static int cb_link_cache(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nh = nlmsg_hdr(msg);
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct system_link_info li;
+	struct system_link *link;
+
+	if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
+		return NL_SKIP;
+
+	if (ifi->ifi_family == AF_BRIDGE || !system_link_parse(nh, &li))
+		return NL_SKIP;
 
-	if (cfg->flags & BRIDGE_OPT_LAST_MEMBER_INTERVAL) {
-		snprintf(buf, buf_len, "%i", cfg->last_member_interval);
-		system_bridge_set_last_member_interval(bridge, buf);
+	if (nh->nlmsg_type == RTM_NEWLINK) {
+		system_link_cache_update(&li);
+		return NL_OK;
 	}
 
-	system_bridge_conf_multicast_deps(bridge, cfg, buf, buf_len);
+	link = avl_find_element(&link_cache.by_index, &li.ifindex, link, index_node);
+	if (link)
+		system_link_cache_del(link);
+
+	return NL_OK;
 }
 
-int system_bridge_addbr(struct device *bridge, struct bridge_config *cfg)
+static bool system_link_cache_fill(void)
 {
-	char buf[64];
-	unsigned long args[4] = {};
+	struct rtgenmsg msg = { .rtgen_family = AF_UNSPEC };
+	struct system_link *link, *tmp;
+	struct nl_cb *cb;
 
-	if (ioctl(sock_ioctl, SIOCBRADDBR, bridge->ifname) < 0)
-		return -1;
+	/* pending events predate the dump and must not override it */
+	while (nl_recvmsgs_default(link_cache.ev.sock) >= 0);
 
-	args[0] = BRCTL_SET_BRIDGE_STP_STATE;
-	args[1] = !!cfg->stp;
-	system_bridge_if(bridge->ifname, NULL, SIOCDEVPRIVATE, &args);
+	avl_for_each_element_safe(&link_cache.by_index, link, index_node, tmp)
+		system_link_cache_del(link);
 
-	args[0] = BRCTL_SET_BRIDGE_FORWARD_DELAY;
-	args[1] = sec_to_jiffies(cfg->forward_delay);
-	system_bridge_if(bridge->ifname, NULL, SIOCDEVPRIVATE, &args);
+	link_cache.valid = false;
 
-	system_bridge_conf_multicast(bridge, cfg, buf, sizeof(buf));
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cb)
+		return false;
 
-	args[0] = BRCTL_SET_BRIDGE_PRIORITY;
-	args[1] = cfg->priority;
-	system_bridge_if(bridge->ifname, NULL, SIOCDEVPRIVATE, &args);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_link_cache, NULL);
 
-	if (cfg->flags & BRIDGE_OPT_AGEING_TIME) {
-		args[0] = BRCTL_SET_AGEING_TIME;
-		args[1] = sec_to_jiffies(cfg->ageing_time);
-		system_bridge_if(bridge->ifname, NULL, SIOCDEVPRIVATE, &args);
-	}
+	system_rtnl_batch_flush();
+	if (nl_send_simple(sock_rtnl, RTM_GETLINK, NLM_F_DUMP, &msg, sizeof(msg)) >= 0)
+		link_cache.valid = (nl_recvmsgs(sock_rtnl, cb) >= 0);
 
-	if (cfg->flags & BRIDGE_OPT_HELLO_TIME) {
-		args[0] = BRCTL_SET_BRIDGE_HELLO_TIME;
-		args[1] = sec_to_jiffies(cfg->hello_time);
-		system_bridge_if(bridge->ifname, NULL, SIOCDEVPRIVATE, &args);
-	}
+	nl_cb_put(cb);
 
-	if (cfg->flags & BRIDGE_OPT_MAX_AGE) {
-		args[0] = BRCTL_SET_BRIDGE_MAX_AGE;
-		args[1] = sec_to_jiffies(cfg->max_age);
-		system_bridge_if(bridge->ifname, NULL, SIOCDEVPRIVATE, &args);
-	}
+	D(SYSTEM, "Link cache %s with %d links\n",
+	  link_cache.valid ? "filled" : "incomplete", link_cache.by_index.count);
 
-	return 0;
+	return link_cache.valid;
 }
 
-int system_macvlan_add(struct device *macvlan, struct device *dev, struct macvlan_config *cfg)
+static bool system_link_cache_sync(void)
 {
-	struct nl_msg *msg;
-	struct nlattr *linkinfo, *data;
-	struct ifinfomsg iim = { .ifi_family = AF_UNSPEC, };
-	int i, rv;
-	static const struct {
-		const char *name;
-		enum macvlan_mode val;
-	} modes[] = {
-		{ "private", MACVLAN_MODE_PRIVATE },
-		{ "vepa", MACVLAN_MODE_VEPA },
-		{ "bridge", MACVLAN_MODE_BRIDGE },
-		{ "passthru", MACVLAN_MODE_PASSTHRU },
-	};
+	int ret;
 
-	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL);
+	if (!link_cache.ev.sock)
+		return false;
 
-	if (!msg)
-		return -1;
+	link_cache.dirty = false;
+	do {
+		ret = nl_recvmsgs_default(link_cache.ev.sock);
+	} while (ret >= 0);
 
-	nlmsg_append(msg, &iim, sizeof(iim), 0);
+	/* events were lost, start over from a fresh dump */
+	if (ret != -NLE_AGAIN || !link_cache.valid)
+		return system_link_cache_fill();
 
-	if (cfg->flags & MACVLAN_OPT_MACADDR)
-		nla_put(msg, IFLA_ADDRESS, sizeof(cfg->macaddr), cfg->macaddr);
-	nla_put_string(msg, IFLA_IFNAME, macvlan->ifname);
-	nla_put_u32(msg, IFLA_LINK, dev->ifindex);
+	return true;
+}
 
-	if (!(linkinfo = nla_nest_start(msg, IFLA_LINKINFO)))
-		goto nla_put_failure;
+static bool system_link_cache_ready(void)
+{
+	if (!link_cache.ev.sock)
+		return false;
 
-	nla_put_string(msg, IFLA_INFO_KIND, "macvlan");
+	if (link_cache.dirty || !link_cache.valid)
+		return system_link_cache_sync();
 
-	if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
-		goto nla_put_failure;
+	return true;
+}
 
-	if (cfg->mode) {
-		for (i = 0; i < ARRAY_SIZE(modes); i++) {
-			if (strcmp(cfg->mode, modes[i].name) != 0)
-				continue;
+static void system_link_cache_dirty(void)
+{
+	link_cache.dirty = true;
+}
 
-			nla_put_u32(msg, IFLA_MACVLAN_MODE, modes[i].val);
-			break;
-		}
-	}
+static void
+handler_link_cache(struct uloop_fd *u, unsigned int events)
+{
+	u->error = false;
+	system_link_cache_sync();
+}
 
-	nla_nest_end(msg, data);
-	nla_nest_end(msg, linkinfo);
+static bool system_link_cache_init(void)
+{
+	struct event_socket *ev = &link_cache.ev;
 
-	rv = system_rtnl_call(msg);
-	if (rv)
-		D(SYSTEM, "Error adding macvlan '%s' over '%s': %d\n", macvlan->ifname, dev->ifname, rv);
+	avl_init(&link_cache.by_name, avl_strcmp, false, NULL);
+	avl_init(&link_cache.by_index, avl_ifindex_cmp, false, NULL);
 
-	return rv;
+	if (!create_raw_event_socket(ev, NETLINK_ROUTE, 0, handler_link_cache,
+				     ULOOP_ERROR_CB)) {
+		ev->sock = NULL;
+		return false;
+	}
 
-nla_put_failure:
-	nlmsg_free(msg);
-	return -ENOMEM;
+	nl_socket_add_membership(ev->sock, RTNLGRP_LINK);
+	nl_socket_disable_seq_check(ev->sock);
+	nl_socket_modify_cb(ev->sock, NL_CB_VALID, NL_CB_CUSTOM, cb_link_cache, NULL);
+	nl_socket_set_nonblocking(ev->sock);
+
+	ev->bufsize = 65535;
+	nl_socket_set_buffer_size(ev->sock, ev->bufsize, 0);
+
+	return system_link_cache_fill();
 }
 
-static int system_link_del(const char *ifname)
+static bool system_link_managed(int ifindex)
 {
-	struct nl_msg *msg;
-	struct ifinfomsg iim = {
-		.ifi_family = AF_UNSPEC,
-		.ifi_index = 0,
-	};
+	if (!link_cache.filtered)
+		return true;
 
-	msg = nlmsg_alloc_simple(RTM_DELLINK, NLM_F_REQUEST);
+	return bsearch(&ifindex, link_cache.managed, link_cache.n_managed,
+		       sizeof(*link_cache.managed), cmp_ifindex) != NULL;
+}
 
-	if (!msg)
-		return -1;
+static int cb_link_query_ack(struct nl_msg *msg, void *arg)
+{
+	int *pending = arg;
 
-	nlmsg_append(msg, &iim, sizeof(iim), 0);
-	nla_put_string(msg, IFLA_IFNAME, ifname);
-	return system_rtnl_call(msg);
+	*pending = 0;
+	return NL_STOP;
 }
 
-int system_macvlan_del(struct device *macvlan)
+static int cb_link_query_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
 {
-	return system_link_del(macvlan->ifname);
+	int *pending = arg;
+
+	*pending = err->error;
+	return NL_STOP;
 }
 
-int system_veth_add(struct device *veth, struct veth_config *cfg)
+/*
+ * Refresh a single entry with RTM_GETLINK. The entry is dropped first and
+ * only added back from the reply, so a link that is gone disappears.
+ */
+static void system_link_query(int ifindex, const char *ifname)
 {
+	struct ifinfomsg ifi = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = ifindex,
+	};
+	struct system_link *link;
 	struct nl_msg *msg;
-	struct ifinfomsg empty_iim = {};
-	struct nlattr *linkinfo, *data, *veth_info;
-	int rv;
-
-	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL);
+	struct nl_cb *cb;
+	int pending = 1;
 
-	if (!msg)
-		return -1;
+	if (ifname)
+		link = avl_find_element(&link_cache.by_name, ifname, link, name_node);
+	else
+		link = avl_find_element(&link_cache.by_index, &ifindex, link, index_node);
+	if (link)
+		system_link_cache_del(link);
 
-	nlmsg_append(msg, &empty_iim, sizeof(empty_iim), 0);
+	rtnl_filter.refreshes++;
 
-	if (cfg->flags & VETH_OPT_MACADDR)
-		nla_put(msg, IFLA_ADDRESS, sizeof(cfg->macaddr), cfg->macaddr);
-	nla_put_string(msg, IFLA_IFNAME, veth->ifname);
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cb)
+		return;
 
-	if (!(linkinfo = nla_nest_start(msg, IFLA_LINKINFO)))
-		goto nla_put_failure;
+	msg = nlmsg_alloc_simple(RTM_GETLINK, 0);
+	if (!msg)
+		goto out;
 
-	nla_put_string(msg, IFLA_INFO_KIND, "veth");
+	if (nlmsg_append(msg, &ifi, sizeof(ifi), 0) ||
+	    (ifname && nla_put_string(msg, IFLA_IFNAME, ifname)))
+		goto free;
 
-	if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
-		goto nla_put_failure;
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_link_cache, NULL);
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, cb_link_query_ack, &pending);
+	nl_cb_err(cb, NL_CB_CUSTOM, cb_link_query_error, &pending);
 
-	if (!(veth_info = nla_nest_start(msg, VETH_INFO_PEER)))
-		goto nla_put_failure;
+	system_rtnl_batch_flush();
+	if (nl_send_auto_complete(sock_rtnl, msg) >= 0)
+		while (pending > 0 && nl_recvmsgs(sock_rtnl, cb) >= 0);
 
-	nlmsg_append(msg, &empty_iim, sizeof(empty_iim), 0);
+free:
+	nlmsg_free(msg);
+out:
+	nl_cb_put(cb);
+}
 
-	if (cfg->flags & VETH_OPT_PEER_NAME)
-		nla_put_string(msg, IFLA_IFNAME, cfg->peer_name);
-	if (cfg->flags & VETH_OPT_PEER_MACADDR)
-		nla_put(msg, IFLA_ADDRESS, sizeof(cfg->peer_macaddr), cfg->peer_macaddr);
+/*
+ * While the event filter is active, only entries of managed links are kept
+ * current by events; any other entry and any miss is checked with the kernel.
+ */
+static struct system_link *system_link_find(const char *ifname)
+{
+	struct system_link *link;
 
-	nla_nest_end(msg, veth_info);
-	nla_nest_end(msg, data);
-	nla_nest_end(msg, linkinfo);
+	link = avl_find_element(&link_cache.by_name, ifname, link, name_node);
+	if (!link && system_link_cache_sync())
+		link = avl_find_element(&link_cache.by_name, ifname, link, name_node);
 
-	rv = system_rtnl_call(msg);
-	if (rv) {
-		if (cfg->flags & VETH_OPT_PEER_NAME)
-			D(SYSTEM, "Error adding veth '%s' with peer '%s': %d\n", veth->ifname, cfg->peer_name, rv);
-		else
-			D(SYSTEM, "Error adding veth '%s': %d\n", veth->ifname, rv);
-	}
+	if (link && system_link_managed(link->ifindex))
+		return link;
 
-	return rv;
+	if (!link_cache.filtered)
+		return NULL;
 
-nla_put_failure:
-	nlmsg_free(msg);
-	return -ENOMEM;
+	system_link_query(0, ifname);
+	return avl_find_element(&link_cache.by_name, ifname, link, name_node);
 }
 
-int system_veth_del(struct device *veth)
+static struct system_link *system_link_find_index(int ifindex)
 {
-	return system_link_del(veth->ifname);
+	struct system_link *link;
+
+	link = avl_find_element(&link_cache.by_index, &ifindex, link, index_node);
+	if (link && system_link_managed(ifindex))
+		return link;
+
+	if (!link_cache.filtered)
+		return NULL;
+
+	system_link_query(ifindex, NULL);
+	return avl_find_element(&link_cache.by_index, &ifindex, link, index_node);
 }
 
-static int system_vlan(struct device *dev, int id)
+/*
+ * Attach the event filter to the link cache listener as well, or detach it
+ * with prog NULL. Events of links that were not managed before may have been
+ * dropped, so their entries are forgotten and queried again when needed.
+ */
+static void system_link_cache_set_filter(struct sock_fprog *prog,
+					 const int *ifindex, int n)
 {
-	struct vlan_ioctl_args ifr = {
-		.cmd = SET_VLAN_NAME_TYPE_CMD,
-		.u.name_type = VLAN_NAME_TYPE_RAW_PLUS_VID_NO_PAD,
-	};
+	struct system_link *link;
+	int *list = NULL;
+	int fd, i;
 
-	ioctl(sock_ioctl, SIOCSIFVLAN, &ifr);
+	if (!link_cache.ev.sock)
+		return;
 
-	if (id < 0) {
-		ifr.cmd = DEL_VLAN_CMD;
-		ifr.u.VID = 0;
-	} else {
-		ifr.cmd = ADD_VLAN_CMD;
-		ifr.u.VID = id;
+	fd = nl_socket_get_fd(link_cache.ev.sock);
+	if (prog && n > 0) {
+		list = malloc(n * sizeof(*list));
+		if (list) {
+			memcpy(list, ifindex, n * sizeof(*list));
+			qsort(list, n, sizeof(*list), cmp_ifindex);
+		}
 	}
-	strncpy(ifr.device1, dev->ifname, sizeof(ifr.device1));
-	return ioctl(sock_ioctl, SIOCSIFVLAN, &ifr);
-}
 
-int system_vlan_add(struct device *dev, int id)
-{
-	return system_vlan(dev, id);
-}
+	if (!prog || (n > 0 && !list) ||
+	    setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, prog, sizeof(*prog)) < 0) {
+		if (prog)
+			D(SYSTEM, "Failed to attach link cache filter\n");
 
-int system_vlan_del(struct device *dev)
-{
-	return system_vlan(dev, -1);
-}
+		setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+		free(list);
 
-int system_vlandev_add(struct device *vlandev, struct device *dev, struct vlandev_config *cfg)
-{
-	struct nl_msg *msg;
-	struct nlattr *linkinfo, *data;
-	struct ifinfomsg iim = { .ifi_family = AF_UNSPEC };
-	int rv;
+		/* entries of unmanaged links may be stale, start over */
+		if (link_cache.filtered)
+			link_cache.valid = false;
 
-	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL);
+		link_cache.filtered = false;
+		list = NULL;
+		n = 0;
+		goto out;
+	}
+
+	for (i = 0; link_cache.filtered && i < n; i++) {
+		if (system_link_managed(list[i]))
+			continue;
+
+		link = avl_find_element(&link_cache.by_index, &list[i], link, index_node);
+		if (link)
+			system_link_cache_del(link);
+	}
+
+	link_cache.filtered = true;
+
+out:
+	free(link_cache.managed);
+	link_cache.managed = list;
+	link_cache.n_managed = n;
+}
+
+int system_bridge_delbr(struct device *bridge)
+{
+	system_link_cache_dirty();
+	return ioctl(sock_ioctl, SIOCBRDELBR, bridge->ifname);
+}
+
+static int system_bridge_if(const char *bridge, struct device *dev, int cmd, void *data)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (dev)
+		ifr.ifr_ifindex = dev->ifindex;
+	else
+		ifr.ifr_data = data;
+	strncpy(ifr.ifr_name, bridge, sizeof(ifr.ifr_name));
+	system_link_cache_dirty();
+	system_devconf_invalidate(if_nametoindex(bridge));
+	return ioctl(sock_ioctl, cmd, &ifr);
+}
+
+static bool system_is_bridge(const char *name, char *buf, int buflen)
+{
+	struct system_link *link;
+	struct stat st;
+
+	if (system_link_cache_ready()) {
+		link = system_link_find(name);
+		return link && link->bridge;
+	}
+
+	snprintf(buf, buflen, "/sys/devices/virtual/net/%s/bridge", name);
+	if (stat(buf, &st) < 0)
+		return false;
+
+	return true;
+}
+
+static char *system_get_bridge(const char *name, char *buf, int buflen)
+{
+	struct system_link *link;
+	char *path;
+	ssize_t len = -1;
+	glob_t gl;
+
+	if (system_link_cache_ready()) {
+		link = system_link_find(name);
+		if (!link || !link->master)
+			return NULL;
+
+		link = system_link_find_index(link->master);
+		if (!link || !link->bridge)
+			return NULL;
+
+		snprintf(buf, buflen, "%s", link->ifname);
+		return buf;
+	}
+
+	snprintf(buf, buflen, "/sys/devices/virtual/net/*/brif/%s/bridge", name);
+	if (glob(buf, GLOB_NOSORT, NULL, &gl) < 0)
+		return NULL;
+
+	if (gl.gl_pathc > 0)
+		len = readlink(gl.gl_pathv[0], buf, buflen);
+
+	globfree(&gl);
 
+	if (len < 0)
+		return NULL;
+
+	buf[len] = 0;
+	path = strrchr(buf, '/');
+	if (!path)
+		return NULL;
+
+	return path + 1;
+}
+
+static void
+system_bridge_set_wireless(struct device *bridge, struct device *dev,
+			   struct nl_msg *msg)
+{
+	bool mcast_to_ucast = dev->wireless_ap;
+	bool hairpin = true;
+
+	if (bridge->settings.flags & DEV_OPT_MULTICAST_TO_UNICAST &&
+	    !bridge->settings.multicast_to_unicast)
+		mcast_to_ucast = false;
+
+	if (!mcast_to_ucast || dev->wireless_isolate)
+		hairpin = false;
+
+	nla_put_u8(msg, IFLA_BRPORT_MCAST_TO_UCAST, mcast_to_ucast);
+	nla_put_u8(msg, IFLA_BRPORT_MODE, hairpin);
+}
+
+/*
+ * If a batch is open and failed is passed, the request is queued and failed
+ * is set on commit if the kernel rejects it.
+ */
+static int system_bridge_set_master(struct device *dev, int master, bool *failed)
+{
+	struct ifinfomsg ifi = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = dev->ifindex,
+	};
+	struct nl_msg *msg;
+
+	msg = nlmsg_alloc_simple(RTM_SETLINK, NLM_F_REQUEST);
 	if (!msg)
 		return -1;
 
-	nlmsg_append(msg, &iim, sizeof(iim), 0);
-	nla_put_string(msg, IFLA_IFNAME, vlandev->ifname);
-	nla_put_u32(msg, IFLA_LINK, dev->ifindex);
+	nlmsg_append(msg, &ifi, sizeof(ifi), 0);
+	nla_put_u32(msg, IFLA_MASTER, master);
 
-	if (!(linkinfo = nla_nest_start(msg, IFLA_LINKINFO)))
-		goto nla_put_failure;
+	if (rtnl_batch.depth && failed)
+		return system_rtnl_batch_add(msg, failed);
 
-	nla_put_string(msg, IFLA_INFO_KIND, "vlan");
+	return system_rtnl_call(msg);
+}
 
-	if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
+/*
+ * Apply all bridge port options with one AF_BRIDGE RTM_SETLINK. The request
+ * is queued if a batch is open, e.g. while bridge_set_up() enables members,
+ * right after the one that enslaves the port.
+ */
+static int system_bridge_set_port(struct device *bridge, struct device *dev)
+{
+	struct ifinfomsg ifi = {
+		.ifi_family = AF_BRIDGE,
+		.ifi_index = dev->ifindex,
+	};
+	struct nlattr *protinfo;
+	struct nl_msg *msg;
+
+	msg = nlmsg_alloc_simple(RTM_SETLINK, NLM_F_REQUEST);
+	if (!msg)
+		return -1;
+
+	nlmsg_append(msg, &ifi, sizeof(ifi), 0);
+
+	if (!(protinfo = nla_nest_start(msg, IFLA_PROTINFO | NLA_F_NESTED)))
 		goto nla_put_failure;
 
-	nla_put_u16(msg, IFLA_VLAN_ID, cfg->vid);
+	if (dev->wireless)
+		system_bridge_set_wireless(bridge, dev, msg);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
-	nla_put_u16(msg, IFLA_VLAN_PROTOCOL, htons(cfg->proto));
-#else
-	if(cfg->proto == VLAN_PROTO_8021AD)
-		netifd_log_message(L_WARNING, "%s Your kernel is older than linux 3.10.0, 802.1ad is not supported defaulting to 802.1q", vlandev->type->name);
-#endif
+	if (dev->settings.flags & DEV_OPT_MULTICAST_ROUTER)
+		nla_put_u8(msg, IFLA_BRPORT_MULTICAST_ROUTER,
+			   dev->settings.multicast_router);
 
-	nla_nest_end(msg, data);
-	nla_nest_end(msg, linkinfo);
+	if (dev->settings.flags & DEV_OPT_MULTICAST_FAST_LEAVE &&
+	    dev->settings.multicast_fast_leave)
+		nla_put_u8(msg, IFLA_BRPORT_FAST_LEAVE, 1);
 
-	rv = system_rtnl_call(msg);
-	if (rv)
-		D(SYSTEM, "Error adding vlandev '%s' over '%s': %d\n", vlandev->ifname, dev->ifname, rv);
+	if (dev->settings.flags & DEV_OPT_LEARNING &&
+	    !dev->settings.learning)
+		nla_put_u8(msg, IFLA_BRPORT_LEARNING, 0);
 
-	return rv;
+	if (dev->settings.flags & DEV_OPT_UNICAST_FLOOD &&
+	    !dev->settings.unicast_flood)
+		nla_put_u8(msg, IFLA_BRPORT_UNICAST_FLOOD, 0);
+
+	nla_nest_end(msg, protinfo);
+
+	/* nothing to change */
+	if (!nla_len(protinfo)) {
+		nlmsg_free(msg);
+		return 0;
+	}
+
+	if (rtnl_batch.depth)
+		return system_rtnl_batch_add(msg, NULL);
+
+	return system_rtnl_call(msg);
 
 nla_put_failure:
 	nlmsg_free(msg);
 	return -ENOMEM;
 }
 
-int system_vlandev_del(struct device *vlandev)
+int system_bridge_addif(struct device *bridge, struct device *dev, bool *failed)
 {
-	return system_link_del(vlandev->ifname);
+	char *oldbr;
+	int master, ret = 0;
+
+	/* the bridge ifindex is only updated after its members are added */
+	master = system_if_resolve(bridge);
+	if (!master)
+		return -1;
+
+	oldbr = system_get_bridge(dev->ifname, dev_buf, sizeof(dev_buf));
+	if (!oldbr || strcmp(oldbr, bridge->ifname) != 0)
+		ret = system_bridge_set_master(dev, master, failed);
+
+	/* the kernel may have adjusted the bridge mtu and mac address */
+	system_devconf_invalidate(master);
+
+	if (ret < 0)
+		return ret;
+
+	system_bridge_set_port(bridge, dev);
+
+	return 0;
 }
 
-void
-system_if_get_settings(struct device *dev, struct device_settings *s)
+int system_bridge_delif(struct device *bridge, struct device *dev)
+{
+	return system_bridge_set_master(dev, 0, NULL);
+}
+
+int system_if_resolve(struct device *dev)
 {
+	struct system_link *link;
 	struct ifreq ifr;
-	char buf[10];
 
-	memset(&ifr, 0, sizeof(ifr));
+	if (system_link_cache_ready()) {
+		link = system_link_find(dev->ifname);
+		return link ? link->ifindex : 0;
+	}
+
 	strncpy(ifr.ifr_name, dev->ifname, sizeof(ifr.ifr_name));
+	if (!ioctl(sock_ioctl, SIOCGIFINDEX, &ifr))
+		return ifr.ifr_ifindex;
+	else
+		return 0;
+}
 
-	if (ioctl(sock_ioctl, SIOCGIFMTU, &ifr) == 0) {
-		s->mtu = ifr.ifr_mtu;
-		s->flags |= DEV_OPT_MTU;
-	}
+static int system_if_flags(const char *ifname, unsigned add, unsigned rem)
+{
+	struct ifreq ifr;
 
-	s->mtu6 = system_update_ipv6_mtu(dev, 0);
-	if (s->mtu6 > 0)
-		s->flags |= DEV_OPT_MTU6;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	ioctl(sock_ioctl, SIOCGIFFLAGS, &ifr);
+	ifr.ifr_flags |= add;
+	ifr.ifr_flags &= ~rem;
+	system_link_cache_dirty();
+	system_devconf_invalidate(if_nametoindex(ifname));
+	return ioctl(sock_ioctl, SIOCSIFFLAGS, &ifr);
+}
 
-	if (ioctl(sock_ioctl, SIOCGIFTXQLEN, &ifr) == 0) {
-		s->txqueuelen = ifr.ifr_qlen;
-		s->flags |= DEV_OPT_TXQUEUELEN;
-	}
+struct clear_data {
+	struct nl_msg *msg;
+	struct device *dev;
+	int type;
+	int size;
+	int af;
 
-	if (ioctl(sock_ioctl, SIOCGIFHWADDR, &ifr) == 0) {
-		memcpy(s->macaddr, &ifr.ifr_hwaddr.sa_data, sizeof(s->macaddr));
-		s->flags |= DEV_OPT_MACADDR;
-	}
+	/* bulk mode: sorted ifindex list, matching deletes are collected */
+	int *ifindex;
+	int n_ifindex;
+	struct nl_msg **del;
+	int n_del;
+};
 
-	if (!system_get_disable_ipv6(dev, buf, sizeof(buf))) {
-		s->ipv6 = !strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_IPV6;
-	}
+/*
+ * Devices cleared while a bulk clear phase is open only get their link
+ * state reset right away; their addresses and routes are removed later
+ * with one dump per table for all of them.
+ */
+static struct {
+	int depth;
+	int *ifindex;
+	int n_ifindex;
+} clear_bulk;
 
-	if (ioctl(sock_ioctl, SIOCGIFFLAGS, &ifr) == 0) {
-		s->promisc = ifr.ifr_flags & IFF_PROMISC;
-		s->flags |= DEV_OPT_PROMISC;
+static bool check_ifindex(struct clear_data *clr, int ifindex)
+{
+	if (clr->ifindex)
+		return bsearch(&ifindex, clr->ifindex, clr->n_ifindex,
+			       sizeof(*clr->ifindex), cmp_ifindex) != NULL;
 
-		s->multicast = ifr.ifr_flags & IFF_MULTICAST;
-		s->flags |= DEV_OPT_MULTICAST;
-	}
+	return ifindex == (clr->dev ? clr->dev->ifindex : 0);
+}
 
-	if (!system_get_rpfilter(dev, buf, sizeof(buf))) {
-		s->rpfilter = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_RPFILTER;
-	}
+static bool check_ifaddr(struct clear_data *clr, struct nlmsghdr *hdr)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(hdr);
 
-	if (!system_get_acceptlocal(dev, buf, sizeof(buf))) {
-		s->acceptlocal = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_ACCEPTLOCAL;
-	}
+	return check_ifindex(clr, ifa->ifa_index);
+}
 
-	if (!system_get_igmpversion(dev, buf, sizeof(buf))) {
-		s->igmpversion = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_IGMPVERSION;
-	}
+static bool check_route(struct clear_data *clr, struct nlmsghdr *hdr)
+{
+	struct rtmsg *r = NLMSG_DATA(hdr);
+	struct nlattr *tb[__RTA_MAX];
+
+	if (r->rtm_protocol == RTPROT_KERNEL &&
+	    r->rtm_family == AF_INET6)
+		return false;
+
+	nlmsg_parse(hdr, sizeof(struct rtmsg), tb, __RTA_MAX - 1, NULL);
+	if (!tb[RTA_OIF])
+		return false;
+
+	return check_ifindex(clr, *(int *)RTA_DATA(tb[RTA_OIF]));
+}
+
+static bool check_rule(struct clear_data *clr, struct nlmsghdr *hdr)
+{
+	return true;
+}
+
+static int cb_clear_event(struct nl_msg *msg, void *arg)
+{
+	struct clear_data *clr = arg;
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct nl_msg *del;
+	bool (*cb)(struct clear_data *, struct nlmsghdr *);
+	int type;
+
+	switch(clr->type) {
+	case RTM_GETADDR:
+		type = RTM_DELADDR;
+		if (hdr->nlmsg_type != RTM_NEWADDR)
+			return NL_SKIP;
+
+		cb = check_ifaddr;
+		break;
+	case RTM_GETROUTE:
+		type = RTM_DELROUTE;
+		if (hdr->nlmsg_type != RTM_NEWROUTE)
+			return NL_SKIP;
+
+		cb = check_route;
+		break;
+	case RTM_GETRULE:
+		type = RTM_DELRULE;
+		if (hdr->nlmsg_type != RTM_NEWRULE)
+			return NL_SKIP;
+
+		cb = check_rule;
+		break;
+	default:
+		return NL_SKIP;
+	}
+
+	if (!cb(clr, hdr))
+		return NL_SKIP;
+
+	if (clr->ifindex) {
+		struct nl_msg **tmp;
+
+		if (!(clr->n_del % 64)) {
+			tmp = realloc(clr->del, (clr->n_del + 64) * sizeof(*clr->del));
+			if (!tmp)
+				return NL_SKIP;
+
+			clr->del = tmp;
+		}
+
+		del = nlmsg_convert(hdr);
+		if (!del)
+			return NL_SKIP;
+
+		hdr = nlmsg_hdr(del);
+		hdr->nlmsg_type = type;
+		hdr->nlmsg_flags = NLM_F_REQUEST;
+		hdr->nlmsg_seq = NL_AUTO_SEQ;
+		hdr->nlmsg_pid = NL_AUTO_PORT;
+		clr->del[clr->n_del++] = del;
+
+		return NL_SKIP;
+	}
+
+	if (type == RTM_DELRULE)
+		D(SYSTEM, "Remove a rule\n");
+	else
+		D(SYSTEM, "Remove %s from device %s\n",
+		  type == RTM_DELADDR ? "an address" : "a route",
+		  clr->dev->ifname);
+	del = nlmsg_convert(hdr);
+	if (!del)
+		return NL_SKIP;
+
+	hdr = nlmsg_hdr(del);
+	hdr->nlmsg_type = type;
+	hdr->nlmsg_flags = NLM_F_REQUEST;
+	system_rtnl_call_async(del, NULL, NULL, NULL);
+
+	return NL_SKIP;
+}
+
+static int
+cb_finish_event(struct nl_msg *msg, void *arg)
+{
+	int *pending = arg;
+	*pending = 0;
+	return NL_STOP;
+}
+
+static int
+error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+	int *pending = arg;
+	*pending = err->error;
+	return NL_STOP;
+}
+
+static void
+__system_if_clear_entries(struct clear_data *clr, struct device *dev, int type, int af)
+{
+	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+	struct rtmsg rtm = {
+		.rtm_family = af,
+		.rtm_flags = RTM_F_CLONED,
+	};
+	int flags = NLM_F_DUMP;
+	int pending = 1;
+
+	clr->af = af;
+	clr->dev = dev;
+	clr->type = type;
+	switch (type) {
+	case RTM_GETADDR:
+	case RTM_GETRULE:
+		clr->size = sizeof(struct rtgenmsg);
+		break;
+	case RTM_GETROUTE:
+		clr->size = sizeof(struct rtmsg);
+		break;
+	default:
+		goto out;
+	}
+
+	if (!cb)
+		return;
+
+	clr->msg = nlmsg_alloc_simple(type, flags);
+	if (!clr->msg)
+		goto out;
+
+	nlmsg_append(clr->msg, &rtm, clr->size, 0);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_clear_event, clr);
+	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_finish_event, &pending);
+	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &pending);
+
+	system_rtnl_batch_flush();
+	nl_send_auto_complete(sock_rtnl, clr->msg);
+	while (pending > 0)
+		nl_recvmsgs(sock_rtnl, cb);
+
+	nlmsg_free(clr->msg);
+out:
+	if (cb)
+		nl_cb_put(cb);
+}
+
+static void
+system_if_clear_entries(struct device *dev, int type, int af)
+{
+	struct clear_data clr = {};
+
+	__system_if_clear_entries(&clr, dev, type, af);
+}
+
+static void
+system_if_clear_bulk(void)
+{
+	static const struct {
+		int type;
+		int af;
+	} tables[] = {
+		{ RTM_GETROUTE, AF_INET },
+		{ RTM_GETADDR, AF_INET },
+		{ RTM_GETROUTE, AF_INET6 },
+		{ RTM_GETADDR, AF_INET6 },
+	};
+	struct clear_data clr = {};
+	uint64_t start = system_rtnl_time();
+	int i, j, n_del = 0;
+
+	if (!clear_bulk.n_ifindex)
+		return;
+
+	qsort(clear_bulk.ifindex, clear_bulk.n_ifindex,
+	      sizeof(*clear_bulk.ifindex), cmp_ifindex);
+
+	clr.ifindex = clear_bulk.ifindex;
+	clr.n_ifindex = clear_bulk.n_ifindex;
+
+	for (i = 0; i < ARRAY_SIZE(tables); i++) {
+		clr.n_del = 0;
+		__system_if_clear_entries(&clr, NULL, tables[i].type, tables[i].af);
+
+		system_batch_begin();
+		for (j = 0; j < clr.n_del; j++)
+			system_rtnl_batch_add(clr.del[j], NULL);
+		system_batch_commit();
+
+		n_del += clr.n_del;
+	}
+
+	D(SYSTEM, "Cleared %d entries from %d devices in %llu us\n", n_del,
+	  clear_bulk.n_ifindex, (unsigned long long) (system_rtnl_time() - start));
+
+	free(clr.del);
+	free(clear_bulk.ifindex);
+	clear_bulk.ifindex = NULL;
+	clear_bulk.n_ifindex = 0;
+}
+
+void system_if_clear_state_begin(void)
+{
+	clear_bulk.depth++;
+}
+
+void system_if_clear_state_commit(void)
+{
+	if (clear_bulk.depth > 0 && --clear_bulk.depth > 0)
+		return;
+
+	system_if_clear_bulk();
+}
+
+/*
+ * Clear bridge (membership) state and bring down device
+ */
+void system_if_clear_state(struct device *dev)
+{
+	static char buf[256];
+	char *bridge;
+
+	device_set_ifindex(dev, system_if_resolve(dev));
+	if (dev->external || !dev->ifindex)
+		return;
+
+	system_if_flags(dev->ifname, 0, IFF_UP);
+
+	if (system_is_bridge(dev->ifname, buf, sizeof(buf))) {
+		D(SYSTEM, "Delete existing bridge named '%s'\n", dev->ifname);
+		system_bridge_delbr(dev);
+		return;
+	}
+
+	bridge = system_get_bridge(dev->ifname, buf, sizeof(buf));
+	if (bridge) {
+		D(SYSTEM, "Remove device '%s' from bridge '%s'\n", dev->ifname, bridge);
+		system_bridge_if(bridge, dev, SIOCBRDELIF, NULL);
+	}
+
+	if (clear_bulk.depth) {
+		int *tmp;
+
+		tmp = realloc(clear_bulk.ifindex,
+			      (clear_bulk.n_ifindex + 1) * sizeof(*tmp));
+		if (tmp) {
+			clear_bulk.ifindex = tmp;
+			clear_bulk.ifindex[clear_bulk.n_ifindex++] = dev->ifindex;
+			goto out;
+		}
+	}
+
+	system_if_clear_entries(dev, RTM_GETROUTE, AF_INET);
+	system_if_clear_entries(dev, RTM_GETADDR, AF_INET);
+	system_if_clear_entries(dev, RTM_GETROUTE, AF_INET6);
+	system_if_clear_entries(dev, RTM_GETADDR, AF_INET6);
+out:
+	system_set_disable_ipv6(dev, "0");
+}
+
+static inline unsigned long
+sec_to_jiffies(int val)
+{
+	return (unsigned long) val * 100;
+}
+
+/*
+ * Bridges are created with a bare RTM_NEWLINK and configured afterwards, so
+ * that an option rejected by the kernel (e.g. an attribute unknown to an
+ * older kernel, or an out of range timer) cannot prevent the bridge from
+ * coming up. All options are first sent in one request; if that fails, they
+ * are retried one request per option so the valid ones still take effect.
+ */
+static const int bridge_attrs[] = {
+	IFLA_BR_STP_STATE,
+	IFLA_BR_FORWARD_DELAY,
+	IFLA_BR_PRIORITY,
+	IFLA_BR_AGEING_TIME,
+	IFLA_BR_HELLO_TIME,
+	IFLA_BR_MAX_AGE,
+	IFLA_BR_MCAST_SNOOPING,
+	IFLA_BR_MCAST_QUERIER,
+	IFLA_BR_MCAST_HASH_MAX,
+	IFLA_BR_MCAST_ROUTER,
+	IFLA_BR_MCAST_STARTUP_QUERY_CNT,
+	IFLA_BR_MCAST_LAST_MEMBER_CNT,
+	IFLA_BR_MCAST_QUERY_INTVL,
+	IFLA_BR_MCAST_QUERY_RESPONSE_INTVL,
+	IFLA_BR_MCAST_LAST_MEMBER_INTVL,
+	IFLA_BR_MCAST_MEMBERSHIP_INTVL,
+	IFLA_BR_MCAST_QUERIER_INTVL,
+	IFLA_BR_MCAST_STARTUP_QUERY_INTVL,
+};
+
+#define BRIDGE_ATTR_ALL		-1
+
+static bool system_bridge_put_attr(struct nl_msg *msg, struct device *bridge,
+				   struct bridge_config *cfg, int attr)
+{
+	switch (attr) {
+	case IFLA_BR_STP_STATE:
+		nla_put_u32(msg, attr, !!cfg->stp);
+		break;
+	case IFLA_BR_FORWARD_DELAY:
+		nla_put_u32(msg, attr, sec_to_jiffies(cfg->forward_delay));
+		break;
+	case IFLA_BR_PRIORITY:
+		nla_put_u16(msg, attr, cfg->priority);
+		break;
+
+	/* options that are not configured are reset to the kernel defaults */
+	case IFLA_BR_AGEING_TIME:
+		nla_put_u32(msg, attr, sec_to_jiffies(
+			    (cfg->flags & BRIDGE_OPT_AGEING_TIME) ? cfg->ageing_time : 300));
+		break;
+	case IFLA_BR_HELLO_TIME:
+		nla_put_u32(msg, attr, sec_to_jiffies(
+			    (cfg->flags & BRIDGE_OPT_HELLO_TIME) ? cfg->hello_time : 2));
+		break;
+	case IFLA_BR_MAX_AGE:
+		nla_put_u32(msg, attr, sec_to_jiffies(
+			    (cfg->flags & BRIDGE_OPT_MAX_AGE) ? cfg->max_age : 20));
+		break;
+
+	case IFLA_BR_MCAST_SNOOPING:
+		nla_put_u8(msg, attr, !!cfg->igmp_snoop);
+		break;
+	case IFLA_BR_MCAST_QUERIER:
+		nla_put_u8(msg, attr, !!cfg->multicast_querier);
+		break;
+	case IFLA_BR_MCAST_HASH_MAX:
+		nla_put_u32(msg, attr, cfg->hash_max);
+		break;
+	case IFLA_BR_MCAST_ROUTER:
+		if (!(bridge->settings.flags & DEV_OPT_MULTICAST_ROUTER))
+			return false;
+
+		nla_put_u8(msg, attr, bridge->settings.multicast_router);
+		break;
+	case IFLA_BR_MCAST_STARTUP_QUERY_CNT:
+	case IFLA_BR_MCAST_LAST_MEMBER_CNT:
+		nla_put_u32(msg, attr, cfg->robustness);
+		break;
+	case IFLA_BR_MCAST_QUERY_INTVL:
+		nla_put_u64(msg, attr, cfg->query_interval);
+		break;
+	case IFLA_BR_MCAST_QUERY_RESPONSE_INTVL:
+		nla_put_u64(msg, attr, cfg->query_response_interval);
+		break;
+	case IFLA_BR_MCAST_LAST_MEMBER_INTVL:
+		nla_put_u64(msg, attr, cfg->last_member_interval);
+		break;
+	case IFLA_BR_MCAST_MEMBERSHIP_INTVL:
+		nla_put_u64(msg, attr, cfg->robustness * cfg->query_interval +
+			    cfg->query_response_interval);
+		break;
+	case IFLA_BR_MCAST_QUERIER_INTVL:
+		nla_put_u64(msg, attr, cfg->robustness * cfg->query_interval +
+			    cfg->query_response_interval / 2);
+		break;
+	case IFLA_BR_MCAST_STARTUP_QUERY_INTVL:
+		nla_put_u64(msg, attr, cfg->query_interval / 4);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/* attr is a single IFLA_BR_* option, BRIDGE_ATTR_ALL or IFLA_BR_UNSPEC for none */
+static int system_bridge_msg(struct device *bridge, struct bridge_config *cfg,
+			     int flags, int attr)
+{
+	struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC, };
+	struct nlattr *linkinfo, *data;
+	struct nl_msg *msg;
+	bool empty = true;
+	int i;
+
+	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST | flags);
+	if (!msg)
+		return -1;
+
+	nlmsg_append(msg, &ifi, sizeof(ifi), 0);
+	nla_put_string(msg, IFLA_IFNAME, bridge->ifname);
+
+	if (!(linkinfo = nla_nest_start(msg, IFLA_LINKINFO)))
+		goto nla_put_failure;
+
+	nla_put_string(msg, IFLA_INFO_KIND, "bridge");
+
+	if (attr != IFLA_BR_UNSPEC) {
+		if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
+			goto nla_put_failure;
+
+		for (i = 0; i < ARRAY_SIZE(bridge_attrs); i++) {
+			if (attr != BRIDGE_ATTR_ALL && attr != bridge_attrs[i])
+				continue;
+
+			if (system_bridge_put_attr(msg, bridge, cfg, bridge_attrs[i]))
+				empty = false;
+		}
+
+		nla_nest_end(msg, data);
+
+		/* nothing to set for this option */
+		if (empty && attr != BRIDGE_ATTR_ALL) {
+			nlmsg_free(msg);
+			return 0;
+		}
+	}
+
+	nla_nest_end(msg, linkinfo);
+
+	return system_rtnl_call(msg);
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -ENOMEM;
+}
+
+/*
+ * All options are normally sent in a single request. Older kernels reject
+ * the whole request if they do not know one of them; only then are the
+ * options set one by one, so that the known ones still take effect.
+ */
+static int system_bridge_apply(struct device *bridge, struct bridge_config *cfg)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(bridge_attrs); i++) {
+		if (system_bridge_msg(bridge, cfg, 0, bridge_attrs[i]) < 0) {
+			D(SYSTEM, "Failed to set option %d on bridge '%s'\n",
+			  bridge_attrs[i], bridge->ifname);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int system_bridge_addbr(struct device *bridge, struct bridge_config *cfg)
+{
+	int flags = NLM_F_CREATE | NLM_F_EXCL;
+
+	if (!system_bridge_msg(bridge, cfg, flags, BRIDGE_ATTR_ALL))
+		return 0;
+
+	if (system_bridge_msg(bridge, cfg, flags, IFLA_BR_UNSPEC) < 0)
+		return -1;
+
+	system_bridge_apply(bridge, cfg);
+	return 0;
+}
+
+int system_bridge_reload(struct device *bridge, struct bridge_config *cfg)
+{
+	if (!system_bridge_msg(bridge, cfg, 0, BRIDGE_ATTR_ALL))
+		return 0;
+
+	return system_bridge_apply(bridge, cfg);
+}
+
+int system_macvlan_add(struct device *macvlan, struct device *dev, struct macvlan_config *cfg)
+{
+	struct nl_msg *msg;
+	struct nlattr *linkinfo, *data;
+	struct ifinfomsg iim = { .ifi_family = AF_UNSPEC, };
+	int i, rv;
+	static const struct {
+		const char *name;
+		enum macvlan_mode val;
+	} modes[] = {
+		{ "private", MACVLAN_MODE_PRIVATE },
+		{ "vepa", MACVLAN_MODE_VEPA },
+		{ "bridge", MACVLAN_MODE_BRIDGE },
+		{ "passthru", MACVLAN_MODE_PASSTHRU },
+	};
+
+	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL);
+
+	if (!msg)
+		return -1;
+
+	nlmsg_append(msg, &iim, sizeof(iim), 0);
+
+	if (cfg->flags & MACVLAN_OPT_MACADDR)
+		nla_put(msg, IFLA_ADDRESS, sizeof(cfg->macaddr), cfg->macaddr);
+	nla_put_string(msg, IFLA_IFNAME, macvlan->ifname);
+	nla_put_u32(msg, IFLA_LINK, dev->ifindex);
+
+	if (!(linkinfo = nla_nest_start(msg, IFLA_LINKINFO)))
+		goto nla_put_failure;
+
+	nla_put_string(msg, IFLA_INFO_KIND, "macvlan");
+
+	if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
+		goto nla_put_failure;
+
+	if (cfg->mode) {
+		for (i = 0; i < ARRAY_SIZE(modes); i++) {
+			if (strcmp(cfg->mode, modes[i].name) != 0)
+				continue;
+
+			nla_put_u32(msg, IFLA_MACVLAN_MODE, modes[i].val);
+			break;
+		}
+	}
+
+	nla_nest_end(msg, data);
+	nla_nest_end(msg, linkinfo);
+
+	rv = system_rtnl_call(msg);
+	if (rv)
+		D(SYSTEM, "Error adding macvlan '%s' over '%s': %d\n", macvlan->ifname, dev->ifname, rv);
+
+	return rv;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -ENOMEM;
+}
+
+static int system_link_del(const char *ifname)
+{
+	struct nl_msg *msg;
+	struct ifinfomsg iim = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = 0,
+	};
+
+	msg = nlmsg_alloc_simple(RTM_DELLINK, NLM_F_REQUEST);
+
+	if (!msg)
+		return -1;
+
+	nlmsg_append(msg, &iim, sizeof(iim), 0);
+	nla_put_string(msg, IFLA_IFNAME, ifname);
+	return system_rtnl_call(msg);
+}
+
+int system_macvlan_del(struct device *macvlan)
+{
+	return system_link_del(macvlan->ifname);
+}
+
+int system_veth_add(struct device *veth, struct veth_config *cfg)
+{
+	struct nl_msg *msg;
+	struct ifinfomsg empty_iim = {};
+	struct nlattr *linkinfo, *data, *veth_info;
+	int rv;
+
+	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL);
+
+	if (!msg)
+		return -1;
+
+	nlmsg_append(msg, &empty_iim, sizeof(empty_iim), 0);
+
+	if (cfg->flags & VETH_OPT_MACADDR)
+		nla_put(msg, IFLA_ADDRESS, sizeof(cfg->macaddr), cfg->macaddr);
+	nla_put_string(msg, IFLA_IFNAME, veth->ifname);
+
+	if (!(linkinfo = nla_nest_start(msg, IFLA_LINKINFO)))
+		goto nla_put_failure;
+
+	nla_put_string(msg, IFLA_INFO_KIND, "veth");
+
+	if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
+		goto nla_put_failure;
+
+	if (!(veth_info = nla_nest_start(msg, VETH_INFO_PEER)))
+		goto nla_put_failure;
+
+	nlmsg_append(msg, &empty_iim, sizeof(empty_iim), 0);
+
+	if (cfg->flags & VETH_OPT_PEER_NAME)
+		nla_put_string(msg, IFLA_IFNAME, cfg->peer_name);
+	if (cfg->flags & VETH_OPT_PEER_MACADDR)
+		nla_put(msg, IFLA_ADDRESS, sizeof(cfg->peer_macaddr), cfg->peer_macaddr);
+
+	nla_nest_end(msg, veth_info);
+	nla_nest_end(msg, data);
+	nla_nest_end(msg, linkinfo);
+
+	rv = system_rtnl_call(msg);
+	if (rv) {
+		if (cfg->flags & VETH_OPT_PEER_NAME)
+			D(SYSTEM, "Error adding veth '%s' with peer '%s': %d\n", veth->ifname, cfg->peer_name, rv);
+		else
+			D(SYSTEM, "Error adding veth '%s': %d\n", veth->ifname, rv);
+	}
+
+	return rv;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -ENOMEM;
+}
+
+int system_veth_del(struct device *veth)
+{
+	return system_link_del(veth->ifname);
+}
+
+static int system_vlan(struct device *dev, int id)
+{
+	struct vlan_ioctl_args ifr = {
+		.cmd = SET_VLAN_NAME_TYPE_CMD,
+		.u.name_type = VLAN_NAME_TYPE_RAW_PLUS_VID_NO_PAD,
+	};
+
+	ioctl(sock_ioctl, SIOCSIFVLAN, &ifr);
+
+	if (id < 0) {
+		ifr.cmd = DEL_VLAN_CMD;
+		ifr.u.VID = 0;
+	} else {
+		ifr.cmd = ADD_VLAN_CMD;
+		ifr.u.VID = id;
+	}
+	strncpy(ifr.device1, dev->ifname, sizeof(ifr.device1));
+	system_link_cache_dirty();
+	system_devconf_invalidate(dev->ifindex);
+	return ioctl(sock_ioctl, SIOCSIFVLAN, &ifr);
+}
+
+int system_vlan_add(struct device *dev, int id)
+{
+	return system_vlan(dev, id);
+}
+
+int system_vlan_del(struct device *dev)
+{
+	return system_vlan(dev, -1);
+}
+
+int system_vlandev_add(struct device *vlandev, struct device *dev, struct vlandev_config *cfg)
+{
+	struct nl_msg *msg;
+	struct nlattr *linkinfo, *data;
+	struct ifinfomsg iim = { .ifi_family = AF_UNSPEC };
+	int rv;
+
+	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL);
+
+	if (!msg)
+		return -1;
+
+	nlmsg_append(msg, &iim, sizeof(iim), 0);
+	nla_put_string(msg, IFLA_IFNAME, vlandev->ifname);
+	nla_put_u32(msg, IFLA_LINK, dev->ifindex);
+
+	if (!(linkinfo = nla_nest_start(msg, IFLA_LINKINFO)))
+		goto nla_put_failure;
+
+	nla_put_string(msg, IFLA_INFO_KIND, "vlan");
+
+	if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
+		goto nla_put_failure;
+
+	nla_put_u16(msg, IFLA_VLAN_ID, cfg->vid);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+	nla_put_u16(msg, IFLA_VLAN_PROTOCOL, htons(cfg->proto));
+#else
+	if(cfg->proto == VLAN_PROTO_8021AD)
+		netifd_log_message(L_WARNING, "%s Your kernel is older than linux 3.10.0, 802.1ad is not supported defaulting to 802.1q", vlandev->type->name);
+#endif
+
+	nla_nest_end(msg, data);
+	nla_nest_end(msg, linkinfo);
+
+	rv = system_rtnl_call(msg);
+	if (rv)
+		D(SYSTEM, "Error adding vlandev '%s' over '%s': %d\n", vlandev->ifname, dev->ifname, rv);
+
+	return rv;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -ENOMEM;
+}
+
+int system_vlandev_del(struct device *vlandev)
+{
+	return system_link_del(vlandev->ifname);
+}
+
+/*
+ * Offload features are addressed by index in the ETH_SS_FEATURES string set.
+ * The set is the same for every device, so it is resolved only once.
+ */
+static const char * const ethtool_feature_names[__DEV_FEATURE_MAX][4] = {
+	[DEV_FEATURE_GRO] = { "rx-gro" },
+	[DEV_FEATURE_GSO] = { "tx-generic-segmentation" },
+	[DEV_FEATURE_TSO] = { "tx-tcp-segmentation", "tx-tcp-ecn-segmentation",
+			      "tx-tcp-mangleid-segmentation", "tx-tcp6-segmentation" },
+	[DEV_FEATURE_LRO] = { "rx-lro" },
+	[DEV_FEATURE_RX_GRO_LIST] = { "rx-gro-list" },
+	[DEV_FEATURE_RX_UDP_GRO_FORWARDING] = { "rx-udp-gro-forwarding" },
+};
+
+static struct {
+	bool init;
+	int n_blocks;
+	int index[__DEV_FEATURE_MAX][4];
+} ethtool_features;
+
+static int system_ethtool(struct device *dev, void *data)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev->ifname, sizeof(ifr.ifr_name) - 1);
+	ifr.ifr_data = data;
+
+	return ioctl(sock_ioctl, SIOCETHTOOL, &ifr);
+}
+
+static bool system_ethtool_features_init(struct device *dev)
+{
+	struct {
+		struct ethtool_sset_info hdr;
+		__u32 count;
+	} sset;
+	struct ethtool_gstrings *strings;
+	const char *name;
+	int i, j, k, count;
+
+	if (ethtool_features.init)
+		return ethtool_features.n_blocks > 0;
+
+	memset(&sset, 0, sizeof(sset));
+	sset.hdr.cmd = ETHTOOL_GSSET_INFO;
+	sset.hdr.sset_mask = 1ULL << ETH_SS_FEATURES;
+	if (system_ethtool(dev, &sset) || !sset.hdr.sset_mask)
+		return false;
+
+	count = sset.count;
+	strings = calloc(1, sizeof(*strings) + count * ETH_GSTRING_LEN);
+	if (!strings)
+		return false;
+
+	strings->cmd = ETHTOOL_GSTRINGS;
+	strings->string_set = ETH_SS_FEATURES;
+	strings->len = count;
+	if (system_ethtool(dev, strings)) {
+		free(strings);
+		return false;
+	}
+
+	for (i = 0; i < __DEV_FEATURE_MAX; i++) {
+		for (j = 0; j < ARRAY_SIZE(ethtool_feature_names[i]); j++) {
+			ethtool_features.index[i][j] = -1;
+			name = ethtool_feature_names[i][j];
+			for (k = 0; name && k < count; k++) {
+				if (!strncmp((char *) strings->data + k * ETH_GSTRING_LEN,
+					     name, ETH_GSTRING_LEN)) {
+					ethtool_features.index[i][j] = k;
+					break;
+				}
+			}
+		}
+	}
+
+	free(strings);
+
+	ethtool_features.n_blocks = (count + 31) / 32;
+	ethtool_features.init = true;
+
+	return true;
+}
+
+static void
+system_if_get_features(struct device *dev, struct device_settings *s)
+{
+	struct ethtool_gfeatures *gf;
+	int i, idx, n_blocks;
+
+	/* s may hold the result of an earlier query */
+	s->features_mask = 0;
+	s->features = 0;
+	s->flags &= ~DEV_OPT_FEATURES;
+
+	/* the original state is only needed for features netifd changes */
+	if (!(dev->settings.flags & DEV_OPT_FEATURES))
+		return;
+
+	if (!system_ethtool_features_init(dev))
+		return;
+
+	n_blocks = ethtool_features.n_blocks;
+	gf = calloc(1, sizeof(*gf) + n_blocks * sizeof(gf->features[0]));
+	if (!gf)
+		return;
+
+	gf->cmd = ETHTOOL_GFEATURES;
+	gf->size = n_blocks;
+	if (system_ethtool(dev, gf))
+		goto out;
+
+	for (i = 0; i < __DEV_FEATURE_MAX; i++) {
+		idx = ethtool_features.index[i][0];
+		if (idx < 0)
+			continue;
+
+		s->features_mask |= (1 << i);
+		if (gf->features[idx / 32].active & (1U << (idx % 32)))
+			s->features |= (1 << i);
+	}
+
+	if (s->features_mask)
+		s->flags |= DEV_OPT_FEATURES;
+
+out:
+	free(gf);
+}
+
+static void
+system_if_apply_features(struct device *dev, struct device_settings *s)
+{
+	struct ethtool_sfeatures *sf;
+	int i, j, idx, n_blocks;
+
+	if (!system_ethtool_features_init(dev))
+		return;
+
+	n_blocks = ethtool_features.n_blocks;
+	sf = calloc(1, sizeof(*sf) + n_blocks * sizeof(sf->features[0]));
+	if (!sf)
+		return;
+
+	sf->cmd = ETHTOOL_SFEATURES;
+	sf->size = n_blocks;
+
+	for (i = 0; i < __DEV_FEATURE_MAX; i++) {
+		if (!(s->features_mask & (1 << i)))
+			continue;
+
+		for (j = 0; j < ARRAY_SIZE(ethtool_features.index[i]); j++) {
+			idx = ethtool_features.index[i][j];
+			if (idx < 0)
+				continue;
+
+			sf->features[idx / 32].valid |= 1U << (idx % 32);
+			if (s->features & (1 << i))
+				sf->features[idx / 32].requested |= 1U << (idx % 32);
+		}
+	}
+
+	/* a positive return only flags features the driver adjusted */
+	if (system_ethtool(dev, sf) < 0)
+		D(SYSTEM, "Failed to set offload features on %s\n", dev->ifname);
+
+	free(sf);
+}
+
+static void
+system_if_get_ethtool(struct device *dev, struct device_settings *s)
+{
+	struct ethtool_ringparam ring = { .cmd = ETHTOOL_GRINGPARAM };
+	struct ethtool_channels ch = { .cmd = ETHTOOL_GCHANNELS };
+	struct ethtool_coalesce co = { .cmd = ETHTOOL_GCOALESCE };
+	unsigned int flags = dev->settings.flags;
+
+	/* each query is a driver call, skip those netifd does not change */
+	if ((flags & DEV_OPT_RING) && !system_ethtool(dev, &ring)) {
+		s->ethtool[DEV_ETHTOOL_RXRING] = ring.rx_pending;
+		s->ethtool[DEV_ETHTOOL_TXRING] = ring.tx_pending;
+		s->ethtool_mask |= (1 << DEV_ETHTOOL_RXRING) | (1 << DEV_ETHTOOL_TXRING);
+		s->flags |= DEV_OPT_RING;
+	}
+
+	if ((flags & DEV_OPT_CHANNELS) && !system_ethtool(dev, &ch)) {
+		s->ethtool[DEV_ETHTOOL_COMBINED_CHANNELS] = ch.combined_count;
+		s->ethtool[DEV_ETHTOOL_RX_CHANNELS] = ch.rx_count;
+		s->ethtool[DEV_ETHTOOL_TX_CHANNELS] = ch.tx_count;
+		s->ethtool_mask |= (1 << DEV_ETHTOOL_COMBINED_CHANNELS) |
+			(1 << DEV_ETHTOOL_RX_CHANNELS) | (1 << DEV_ETHTOOL_TX_CHANNELS);
+		s->flags |= DEV_OPT_CHANNELS;
+	}
+
+	if ((flags & DEV_OPT_COALESCE) && !system_ethtool(dev, &co)) {
+		s->ethtool[DEV_ETHTOOL_RX_USECS] = co.rx_coalesce_usecs;
+		s->ethtool[DEV_ETHTOOL_TX_USECS] = co.tx_coalesce_usecs;
+		s->ethtool[DEV_ETHTOOL_RX_FRAMES] = co.rx_max_coalesced_frames;
+		s->ethtool[DEV_ETHTOOL_TX_FRAMES] = co.tx_max_coalesced_frames;
+		s->ethtool[DEV_ETHTOOL_ADAPTIVE_RX] = co.use_adaptive_rx_coalesce;
+		s->ethtool[DEV_ETHTOOL_ADAPTIVE_TX] = co.use_adaptive_tx_coalesce;
+		s->ethtool_mask |= (1 << DEV_ETHTOOL_RX_USECS) | (1 << DEV_ETHTOOL_TX_USECS) |
+			(1 << DEV_ETHTOOL_RX_FRAMES) | (1 << DEV_ETHTOOL_TX_FRAMES) |
+			(1 << DEV_ETHTOOL_ADAPTIVE_RX) | (1 << DEV_ETHTOOL_ADAPTIVE_TX);
+		s->flags |= DEV_OPT_COALESCE;
+	}
+}
+
+#define ETHTOOL_SET_PARAM(_s, _param, _field)			\
+	do {							\
+		if ((_s)->ethtool_mask & (1 << (_param)))	\
+			_field = (_s)->ethtool[_param];		\
+	} while (0)
+
+/*
+ * Ring sizes, channel counts and coalescing are changed with a read-modify-
+ * write of the driver's current parameters, so options that are not set keep
+ * their value. Channels are applied before RPS/XPS, which plans its masks for
+ * the resulting number of queues.
+ */
+static void
+system_if_apply_ethtool(struct device *dev, struct device_settings *s, unsigned int apply_mask)
+{
+	struct ethtool_ringparam ring = { .cmd = ETHTOOL_GRINGPARAM };
+	struct ethtool_channels ch = { .cmd = ETHTOOL_GCHANNELS };
+	struct ethtool_coalesce co = { .cmd = ETHTOOL_GCOALESCE };
+
+	if ((s->flags & DEV_OPT_RING & apply_mask) && !system_ethtool(dev, &ring)) {
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_RXRING, ring.rx_pending);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_TXRING, ring.tx_pending);
+		ring.cmd = ETHTOOL_SRINGPARAM;
+		if (system_ethtool(dev, &ring) < 0)
+			s->flags &= ~DEV_OPT_RING;
+	}
+
+	if ((s->flags & DEV_OPT_CHANNELS & apply_mask) && !system_ethtool(dev, &ch)) {
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_COMBINED_CHANNELS, ch.combined_count);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_RX_CHANNELS, ch.rx_count);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_TX_CHANNELS, ch.tx_count);
+		ch.cmd = ETHTOOL_SCHANNELS;
+		if (system_ethtool(dev, &ch) < 0)
+			s->flags &= ~DEV_OPT_CHANNELS;
+	}
+
+	if ((s->flags & DEV_OPT_COALESCE & apply_mask) && !system_ethtool(dev, &co)) {
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_RX_USECS, co.rx_coalesce_usecs);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_TX_USECS, co.tx_coalesce_usecs);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_RX_FRAMES, co.rx_max_coalesced_frames);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_TX_FRAMES, co.tx_max_coalesced_frames);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_ADAPTIVE_RX, co.use_adaptive_rx_coalesce);
+		ETHTOOL_SET_PARAM(s, DEV_ETHTOOL_ADAPTIVE_TX, co.use_adaptive_tx_coalesce);
+		co.cmd = ETHTOOL_SCOALESCE;
+		if (system_ethtool(dev, &co) < 0)
+			s->flags &= ~DEV_OPT_COALESCE;
+	}
+}
+
+/*
+ * Snapshot of the per-device settings of all links, taken with a single
+ * RTM_GETLINK dump. IFLA_AF_SPEC carries the IPv4 and IPv6 devconf arrays,
+ * which replaces a dozen procfs reads per device. Entries are consumed by
+ * system_if_get_settings() and dropped whenever the link changes, see
+ * system_devconf_invalidate(); each one expires after a short window.
+ * A missing or expired entry is fetched again with an RTM_GETLINK for that
+ * link only. The full dump is only repeated when many devices are set up
+ * at once, e.g. at boot.
+ */
+#define DEVCONF_SNAPSHOT_TIMEOUT	1000000
+#define DEVCONF_BULK_MISSES		8
+
+struct system_devconf {
+	struct avl_node node;
+	int ifindex;
+	uint64_t time;
+	unsigned int flags;
+	unsigned int mtu;
+	unsigned int txqueuelen;
+	uint8_t macaddr[6];
+	bool has_mtu, has_txqueuelen, has_macaddr;
+	unsigned int gso_mask;
+	uint32_t gso[__DEV_GSO_LIMIT_MAX];
+	int n_inet, n_inet6;
+	uint32_t inet[IPV4_DEVCONF_MAX];
+	int32_t inet6[DEVCONF_MAX];
+};
+
+static struct {
+	struct avl_tree tree;
+	uint64_t time; /* start of the current miss window */
+	int misses;
+	bool init;
+} devconf_snapshot;
+
+/* netlink attributes of the GSO/GRO limits, in enum device_gso_limit order */
+static const int gso_limit_attrs[__DEV_GSO_LIMIT_MAX] = {
+	[DEV_GSO_MAX_SIZE] = IFLA_GSO_MAX_SIZE,
+	[DEV_GRO_MAX_SIZE] = IFLA_GRO_MAX_SIZE,
+	[DEV_GSO_IPV4_MAX_SIZE] = IFLA_GSO_IPV4_MAX_SIZE,
+	[DEV_GRO_IPV4_MAX_SIZE] = IFLA_GRO_IPV4_MAX_SIZE,
+	[DEV_GSO_MAX_SEGS] = IFLA_GSO_MAX_SEGS,
+};
+
+/* the IPv4 limits may be newer than IFLA_MAX, so walk the attributes */
+static void system_devconf_parse_gso(struct system_devconf *dc, struct nlmsghdr *nh)
+{
+	struct nlattr *cur;
+	int i, rem;
+
+	nla_for_each_attr(cur, nlmsg_attrdata(nh, sizeof(struct ifinfomsg)),
+			  nlmsg_attrlen(nh, sizeof(struct ifinfomsg)), rem) {
+		for (i = 0; i < __DEV_GSO_LIMIT_MAX; i++) {
+			if (nla_type(cur) != gso_limit_attrs[i] ||
+			    nla_len(cur) < sizeof(uint32_t))
+				continue;
+
+			dc->gso[i] = nla_get_u32(cur);
+			dc->gso_mask |= (1 << i);
+		}
+	}
+}
+
+static void system_devconf_parse_af(struct system_devconf *dc, struct nlattr *spec)
+{
+	struct nlattr *af, *tb[IFLA_INET6_MAX + 1];
+	int rem, len;
+
+	nla_for_each_nested(af, spec, rem) {
+		switch (nla_type(af)) {
+		case AF_INET:
+			if (nla_parse_nested(tb, IFLA_INET_MAX, af, NULL) < 0 ||
+			    !tb[IFLA_INET_CONF])
+				break;
+
+			len = nla_len(tb[IFLA_INET_CONF]);
+			if (len > sizeof(dc->inet))
+				len = sizeof(dc->inet);
+			memcpy(dc->inet, nla_data(tb[IFLA_INET_CONF]), len);
+			dc->n_inet = len / sizeof(dc->inet[0]);
+			break;
+		case AF_INET6:
+			if (nla_parse_nested(tb, IFLA_INET6_MAX, af, NULL) < 0 ||
+			    !tb[IFLA_INET6_CONF])
+				break;
+
+			len = nla_len(tb[IFLA_INET6_CONF]);
+			if (len > sizeof(dc->inet6))
+				len = sizeof(dc->inet6);
+			memcpy(dc->inet6, nla_data(tb[IFLA_INET6_CONF]), len);
+			dc->n_inet6 = len / sizeof(dc->inet6[0]);
+			break;
+		}
+	}
+}
+
+static int cb_devconf_snapshot(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nh = nlmsg_hdr(msg);
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct nlattr *tb[IFLA_MAX + 1];
+	struct system_devconf *dc;
+
+	if (nh->nlmsg_type != RTM_NEWLINK || ifi->ifi_family == AF_BRIDGE)
+		return NL_SKIP;
+
+	if (nlmsg_parse(nh, sizeof(*ifi), tb, IFLA_MAX, NULL) < 0)
+		return NL_SKIP;
+
+	if (avl_find(&devconf_snapshot.tree, &ifi->ifi_index))
+		return NL_SKIP;
+
+	dc = calloc(1, sizeof(*dc));
+	if (!dc)
+		return NL_SKIP;
+
+	dc->ifindex = ifi->ifi_index;
+	dc->time = system_rtnl_time();
+	dc->flags = ifi->ifi_flags;
+
+	if (tb[IFLA_MTU]) {
+		dc->mtu = nla_get_u32(tb[IFLA_MTU]);
+		dc->has_mtu = true;
+	}
+
+	if (tb[IFLA_TXQLEN]) {
+		dc->txqueuelen = nla_get_u32(tb[IFLA_TXQLEN]);
+		dc->has_txqueuelen = true;
+	}
+
+	if (tb[IFLA_ADDRESS] && nla_len(tb[IFLA_ADDRESS]) >= sizeof(dc->macaddr)) {
+		memcpy(dc->macaddr, nla_data(tb[IFLA_ADDRESS]), sizeof(dc->macaddr));
+		dc->has_macaddr = true;
+	}
+
+	if (tb[IFLA_AF_SPEC])
+		system_devconf_parse_af(dc, tb[IFLA_AF_SPEC]);
+
+	system_devconf_parse_gso(dc, nh);
+
+	dc->node.key = &dc->ifindex;
+	avl_insert(&devconf_snapshot.tree, &dc->node);
+
+	return NL_OK;
+}
+
+static void system_devconf_flush(void)
+{
+	struct system_devconf *dc, *tmp;
+
+	avl_remove_all_elements(&devconf_snapshot.tree, dc, node, tmp)
+		free(dc);
+}
+
+/*
+ * Called for every change netifd makes to a link (rtnetlink, ioctl or sysctl)
+ * and for every RTM_NEWLINK/RTM_DELLINK event, so external changes are
+ * picked up as well.
+ */
+static void system_devconf_invalidate(int ifindex)
+{
+	struct system_devconf *dc;
+
+	if (!devconf_snapshot.init || !ifindex)
+		return;
+
+	dc = avl_find_element(&devconf_snapshot.tree, &ifindex, dc, node);
+	if (!dc)
+		return;
+
+	avl_delete(&devconf_snapshot.tree, &dc->node);
+	free(dc);
+}
+
+static bool system_devconf_fill(void)
+{
+	struct rtgenmsg msg = { .rtgen_family = AF_UNSPEC };
+	struct nl_cb *cb;
+	bool ret = false;
+
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cb)
+		return false;
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_devconf_snapshot, NULL);
+
+	system_rtnl_batch_flush();
+	if (nl_send_simple(sock_rtnl, RTM_GETLINK, NLM_F_DUMP, &msg, sizeof(msg)) >= 0)
+		ret = (nl_recvmsgs(sock_rtnl, cb) >= 0);
+
+	nl_cb_put(cb);
+
+	D(SYSTEM, "Device settings snapshot %s with %d links\n",
+	  ret ? "taken" : "incomplete", devconf_snapshot.tree.count);
+
+	return ret;
+}
+
+static void system_devconf_query(int ifindex)
+{
+	struct ifinfomsg ifi = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = ifindex,
+	};
+	struct nl_msg *msg;
+	struct nl_cb *cb;
+	int pending = 1;
+
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cb)
+		return;
+
+	msg = nlmsg_alloc_simple(RTM_GETLINK, 0);
+	if (!msg)
+		goto out;
+
+	if (nlmsg_append(msg, &ifi, sizeof(ifi), 0))
+		goto free;
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_devconf_snapshot, NULL);
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, cb_link_query_ack, &pending);
+	nl_cb_err(cb, NL_CB_CUSTOM, cb_link_query_error, &pending);
+
+	system_rtnl_batch_flush();
+	if (nl_send_auto_complete(sock_rtnl, msg) >= 0)
+		while (pending > 0 && nl_recvmsgs(sock_rtnl, cb) >= 0);
+
+free:
+	nlmsg_free(msg);
+out:
+	nl_cb_put(cb);
+}
+
+static struct system_devconf *system_devconf_get(struct device *dev)
+{
+	struct system_devconf *dc;
+	uint64_t now = system_rtnl_time();
+
+	if (!devconf_snapshot.init) {
+		avl_init(&devconf_snapshot.tree, avl_ifindex_cmp, false, NULL);
+		devconf_snapshot.init = true;
+	}
+
+	if (!dev->ifindex)
+		return NULL;
+
+	dc = avl_find_element(&devconf_snapshot.tree, &dev->ifindex, dc, node);
+	if (dc && now - dc->time < DEVCONF_SNAPSHOT_TIMEOUT)
+		return dc;
+
+	if (now - devconf_snapshot.time >= DEVCONF_SNAPSHOT_TIMEOUT) {
+		devconf_snapshot.time = now;
+		devconf_snapshot.misses = 0;
+	}
+
+	if (!devconf_snapshot.tree.count ||
+	    ++devconf_snapshot.misses > DEVCONF_BULK_MISSES) {
+		system_devconf_flush();
+		devconf_snapshot.time = now;
+		devconf_snapshot.misses = 0;
+		if (!system_devconf_fill())
+			system_devconf_flush();
+	} else {
+		system_devconf_invalidate(dev->ifindex);
+		system_devconf_query(dev->ifindex);
+	}
+
+	return avl_find_element(&devconf_snapshot.tree, &dev->ifindex, dc, node);
+}
+
+/* read an inet/inet6 devconf value, falling back to procfs if not in the snapshot */
+static bool
+system_if_get_devconf(struct device *dev, struct system_devconf *dc, int family, int id,
+		      int sysctl, unsigned int *val)
+{
+	char buf[12];
+
+	if (dc && family == AF_INET && id > 0 && id <= dc->n_inet) {
+		*val = dc->inet[id - 1];
+	} else if (dc && family == AF_INET6 && id < dc->n_inet6) {
+		*val = dc->inet6[id];
+	} else {
+		if (system_get_dev_sysctl(dev, sysctl, buf, sizeof(buf)))
+			return false;
+
+		*val = strtoul(buf, NULL, 0);
+		return true;
+	}
+
+	snprintf(buf, sizeof(buf), "%u", *val);
+	system_dev_sysctl_store(dev, sysctl, buf);
+	return true;
+}
+
+void
+system_if_get_settings(struct device *dev, struct device_settings *s)
+{
+	struct system_devconf *dc = system_devconf_get(dev);
+	struct ifreq ifr;
+	unsigned int val;
+	char path[64], buf[16];
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev->ifname, sizeof(ifr.ifr_name));
+
+	if (dc && dc->has_mtu) {
+		s->mtu = dc->mtu;
+		s->flags |= DEV_OPT_MTU;
+	} else if (ioctl(sock_ioctl, SIOCGIFMTU, &ifr) == 0) {
+		s->mtu = ifr.ifr_mtu;
+		s->flags |= DEV_OPT_MTU;
+	}
+
+	if (dc && DEVCONF_MTU6 < dc->n_inet6)
+		s->mtu6 = dc->inet6[DEVCONF_MTU6];
+	else
+		s->mtu6 = system_update_ipv6_mtu(dev, 0);
+	if (s->mtu6 > 0)
+		s->flags |= DEV_OPT_MTU6;
+
+	if (dc && dc->has_txqueuelen) {
+		s->txqueuelen = dc->txqueuelen;
+		s->flags |= DEV_OPT_TXQUEUELEN;
+	} else if (ioctl(sock_ioctl, SIOCGIFTXQLEN, &ifr) == 0) {
+		s->txqueuelen = ifr.ifr_qlen;
+		s->flags |= DEV_OPT_TXQUEUELEN;
+	}
+
+	if (dc && dc->gso_mask) {
+		memcpy(s->gso, dc->gso, sizeof(s->gso));
+		s->gso_mask = dc->gso_mask;
+		s->flags |= DEV_OPT_GSO_LIMITS;
+	}
+
+	if (dc && dc->has_macaddr) {
+		memcpy(s->macaddr, dc->macaddr, sizeof(s->macaddr));
+		s->flags |= DEV_OPT_MACADDR;
+	} else if (ioctl(sock_ioctl, SIOCGIFHWADDR, &ifr) == 0) {
+		memcpy(s->macaddr, &ifr.ifr_hwaddr.sa_data, sizeof(s->macaddr));
+		s->flags |= DEV_OPT_MACADDR;
+	}
+
+	if (system_if_get_devconf(dev, dc, AF_INET6, DEVCONF_DISABLE_IPV6,
+				  DEV_SYSCTL_DISABLE_IPV6, &val)) {
+		s->ipv6 = !val;
+		s->flags |= DEV_OPT_IPV6;
+	}
+
+	if (dc || ioctl(sock_ioctl, SIOCGIFFLAGS, &ifr) == 0) {
+		unsigned int flags = dc ? dc->flags : ifr.ifr_flags;
+
+		s->promisc = flags & IFF_PROMISC;
+		s->flags |= DEV_OPT_PROMISC;
+
+		s->multicast = flags & IFF_MULTICAST;
+		s->flags |= DEV_OPT_MULTICAST;
+	}
+
+	if (system_if_get_devconf(dev, dc, AF_INET, IPV4_DEVCONF_RP_FILTER,
+				  DEV_SYSCTL_RPFILTER, &val)) {
+		s->rpfilter = val;
+		s->flags |= DEV_OPT_RPFILTER;
+	}
+
+	if (system_if_get_devconf(dev, dc, AF_INET, IPV4_DEVCONF_ACCEPT_LOCAL,
+				  DEV_SYSCTL_ACCEPTLOCAL, &val)) {
+		s->acceptlocal = val;
+		s->flags |= DEV_OPT_ACCEPTLOCAL;
+	}
+
+	if (system_if_get_devconf(dev, dc, AF_INET, IPV4_DEVCONF_FORCE_IGMP_VERSION,
+				  DEV_SYSCTL_IGMPVERSION, &val)) {
+		s->igmpversion = val;
+		s->flags |= DEV_OPT_IGMPVERSION;
+	}
+
+	if (system_if_get_devconf(dev, dc, AF_INET6, DEVCONF_FORCE_MLD_VERSION,
+				  DEV_SYSCTL_MLDVERSION, &val)) {
+		s->mldversion = val;
+		s->flags |= DEV_OPT_MLDVERSION;
+	}
+
+	/* neighbour table parameters are not part of IFLA_AF_SPEC */
+	if (!system_get_neigh4reachabletime(dev, buf, sizeof(buf))) {
+		s->neigh4reachabletime = strtoul(buf, NULL, 0);
+		s->flags |= DEV_OPT_NEIGHREACHABLETIME;
+	}
+
+	if (!system_get_neigh6reachabletime(dev, buf, sizeof(buf))) {
+		s->neigh6reachabletime = strtoul(buf, NULL, 0);
+		s->flags |= DEV_OPT_NEIGHREACHABLETIME;
+	}
+
+	if (!system_get_neigh4locktime(dev, buf, sizeof(buf))) {
+		s->neigh4locktime = strtoul(buf, NULL, 0);
+		s->flags |= DEV_OPT_NEIGHLOCKTIME;
+	}
+
+	if (!system_get_neigh4gcstaletime(dev, buf, sizeof(buf))) {
+		s->neigh4gcstaletime = strtoul(buf, NULL, 0);
+		s->flags |= DEV_OPT_NEIGHGCSTALETIME;
+	}
+
+	if (!system_get_neigh6gcstaletime(dev, buf, sizeof(buf))) {
+		s->neigh6gcstaletime = strtoul(buf, NULL, 0);
+		s->flags |= DEV_OPT_NEIGHGCSTALETIME;
+	}
+
+	if (system_if_get_devconf(dev, dc, AF_INET6, DEVCONF_DAD_TRANSMITS,
+				  DEV_SYSCTL_DADTRANSMITS, &val)) {
+		s->dadtransmits = val;
+		s->flags |= DEV_OPT_DADTRANSMITS;
+	}
+
+	if (system_if_get_devconf(dev, dc, AF_INET, IPV4_DEVCONF_SEND_REDIRECTS,
+				  DEV_SYSCTL_SENDREDIRECTS, &val)) {
+		s->sendredirects = val;
+		s->flags |= DEV_OPT_SENDREDIRECTS;
+	}
+
+	system_if_get_features(dev, s);
+	system_if_get_ethtool(dev, s);
+
+	if (!(dev->settings.flags & DEV_OPT_RFS))
+		return;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/queues/rx-0/rps_flow_cnt", dev->ifname);
+	if (!system_get_sysctl("/proc/sys/net/core/rps_sock_flow_entries", buf, sizeof(buf))) {
+		s->rfs_entries = strtoul(buf, NULL, 0);
+		if (!system_get_sysctl(path, buf, sizeof(buf)))
+			s->rps_flow_cnt = strtoul(buf, NULL, 0);
+		s->flags |= DEV_OPT_RFS;
+	}
+}
+
+/*
+ * RPS/XPS planner. CPU masks are bitmaps of 32-bit words, matching the group
+ * size of the kernel's mask format, so the number of CPUs is not limited.
+ */
+#define CPUMASK_WORDS(n)	(((n) + 31) / 32)
+
+static int
+system_cpulist_parse(const char *list, uint32_t *mask, int n_cpus)
+{
+	unsigned long first, last;
+	const char *p = list;
+	char *end;
+	int max = -1;
+
+	while (*p && *p != '\n') {
+		first = last = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+		}
+
+		for (; mask && first <= last && first < n_cpus; first++)
+			mask[first / 32] |= 1U << (first % 32);
+
+		if ((int) last > max)
+			max = last;
+
+		p = end;
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return -1;
+	}
+
+	return max;
+}
+
+static void
+system_cpumask_format(char *buf, size_t len, const uint32_t *mask, int words)
+{
+	int i = words - 1;
+	size_t ofs;
+
+	while (i > 0 && !mask[i])
+		i--;
+
+	ofs = snprintf(buf, len, "%x", mask[i]);
+	while (--i >= 0 && ofs < len)
+		ofs += snprintf(buf + ofs, len - ofs, ",%08x", mask[i]);
+}
+
+static int system_cpu_width(void)
+{
+	char buf[256];
+	int max = -1;
+
+	if (!system_get_sysctl("/sys/devices/system/cpu/possible", buf, sizeof(buf)))
+		max = system_cpulist_parse(buf, NULL, 0);
+
+	if (max < 0)
+		max = sysconf(_SC_NPROCESSORS_CONF) - 1;
+
+	return max + 1;
+}
+
+static void
+system_cpumask_and(uint32_t *mask, const uint32_t *other, int words)
+{
+	bool empty = true;
+	int i;
+
+	for (i = 0; i < words; i++)
+		if (mask[i] & other[i])
+			empty = false;
+
+	/* never end up with no CPU at all */
+	if (empty)
+		return;
+
+	for (i = 0; i < words; i++)
+		mask[i] &= other[i];
+}
+
+/* collect the CPUs that the queues of a device may be steered to */
+static int
+system_ps_get_cpus(struct device *dev, struct device_settings *s, int *cpus, int width)
+{
+	int words = CPUMASK_WORDS(width);
+	uint32_t set[words], tmp[words];
+	char path[128], buf[1024];
+	int i, n, node;
+
+	memset(set, 0, sizeof(set));
+	if (system_get_sysctl("/sys/devices/system/cpu/online", buf, sizeof(buf)) ||
+	    system_cpulist_parse(buf, set, width) < 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		for (i = 0; i < n && i < width; i++)
+			set[i / 32] |= 1U << (i % 32);
+	}
+
+	memset(tmp, 0, sizeof(tmp));
+	if ((s->flags & DEV_OPT_PS_CPUS) &&
+	    system_cpulist_parse(s->ps_cpus, tmp, width) >= 0)
+		system_cpumask_and(set, tmp, words);
+
+	memset(tmp, 0, sizeof(tmp));
+	if ((s->flags & DEV_OPT_PS_EXCLUDE) &&
+	    system_cpulist_parse(s->ps_exclude, tmp, width) >= 0) {
+		for (i = 0; i < words; i++)
+			tmp[i] = ~tmp[i];
+		system_cpumask_and(set, tmp, words);
+	}
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", dev->ifname);
+	if ((s->flags & DEV_OPT_PS_POLICY) && s->ps_policy == DEV_PS_POLICY_NUMA &&
+	    !system_get_sysctl(path, buf, sizeof(buf)) &&
+	    (node = atoi(buf)) >= 0) {
+		memset(tmp, 0, sizeof(tmp));
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (!system_get_sysctl(path, buf, sizeof(buf)) &&
+		    system_cpulist_parse(buf, tmp, width) >= 0)
+			system_cpumask_and(set, tmp, words);
+	}
+
+	for (i = 0, n = 0; i < width; i++)
+		if (set[i / 32] & (1U << (i % 32)))
+			cpus[n++] = i;
+
+	return n;
+}
+
+/*
+ * Plan and apply the mask of every rx or tx queue. With the "all" policy each
+ * queue may use any of the CPUs, otherwise the CPUs are split into disjoint
+ * groups, one per queue, wrapping around if there are more queues than CPUs.
+ */
+static void
+system_if_plan_queues(struct device *dev, struct device_settings *s, bool rx,
+		      const int *cpus, int n_cpus, int width, struct blob_buf *b)
+{
+	int words = CPUMASK_WORDS(width);
+	const char *attr = rx ? "rps_cpus" : "xps_cpus";
+	bool enabled = rx ? s->rps : s->xps;
+	bool spread = (s->flags & DEV_OPT_PS_POLICY) && s->ps_policy != DEV_PS_POLICY_ALL;
+	char path[128], val[words * 9 + 1], *name;
+	uint32_t mask[words];
+	int i, j, queue, n_queues, flow_cnt = -1;
+	glob_t gl;
+	void *c;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/queues/%s-*",
+		 dev->ifname, rx ? "rx" : "tx");
+	if (glob(path, 0, NULL, &gl))
+		return;
+
+	/* RFS flow counts are split evenly between the rx queues */
+	n_queues = gl.gl_pathc;
+	if (rx && (s->flags & DEV_OPT_RFS))
+		flow_cnt = s->rps ? s->rfs_entries / n_queues : s->rps_flow_cnt;
+
+	c = blobmsg_open_table(b, rx ? "rps" : "xps");
+	for (i = 0; i < gl.gl_pathc; i++) {
+		name = strrchr(gl.gl_pathv[i], '/') + 1;
+		queue = atoi(name + 3) % n_queues;
+
+		memset(mask, 0, sizeof(mask));
+		for (j = 0; enabled && j < n_cpus; j++) {
+			if (spread && n_queues >= n_cpus && j != queue % n_cpus)
+				continue;
+
+			if (spread && n_queues < n_cpus && j * n_queues / n_cpus != queue)
+				continue;
+
+			mask[cpus[j] / 32] |= 1U << (cpus[j] % 32);
+		}
+
+		system_cpumask_format(val, sizeof(val), mask, words);
+		snprintf(path, sizeof(path), "%s/%s", gl.gl_pathv[i], attr);
+		system_set_sysctl(path, val);
+		blobmsg_add_string(b, name, val);
+
+		if (flow_cnt < 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/rps_flow_cnt", gl.gl_pathv[i]);
+		snprintf(val, sizeof(val), "%d", flow_cnt);
+		system_set_sysctl(path, val);
+	}
+	blobmsg_close_table(b, c);
+
+	if (flow_cnt >= 0)
+		blobmsg_add_u32(b, "rps_flow_cnt", flow_cnt);
+
+	globfree(&gl);
+}
+
+/*
+ * The RFS socket flow table is global, so it is sized for the largest request
+ * of all devices and only restored once the last device stops using RFS.
+ */
+static struct {
+	unsigned int users;
+	char orig[16];
+} rfs_table;
+
+static void
+system_rfs_set(struct system_dev_state *state, bool active, unsigned int rfs_entries)
+{
+	const char *path = "/proc/sys/net/core/rps_sock_flow_entries";
+	struct system_dev_state *cur;
+	unsigned int entries = 0;
+	char buf[16];
+
+	if (active == state->rfs_active &&
+	    (!active || rfs_entries == state->rfs_entries))
+		return;
+
+	if (active && !state->rfs_active && !rfs_table.users++ &&
+	    system_get_sysctl(path, rfs_table.orig, sizeof(rfs_table.orig)))
+		strcpy(rfs_table.orig, "0");
+
+	if (!active && state->rfs_active && !--rfs_table.users)
+		system_set_sysctl(path, rfs_table.orig);
+
+	state->rfs_active = active;
+	state->rfs_entries = active ? rfs_entries : 0;
+
+	if (!rfs_table.users)
+		return;
+
+	avl_for_each_element(&system_dev_tree, cur, node)
+		if (cur->rfs_active && cur->rfs_entries > entries)
+			entries = cur->rfs_entries;
+
+	snprintf(buf, sizeof(buf), "%u", entries);
+	system_set_sysctl(path, buf);
+}
+
+static void
+system_if_apply_rfs(struct system_dev_state *state, struct device_settings *s)
+{
+	bool active = (s->flags & DEV_OPT_RFS) && s->rps && s->rfs_entries;
+
+	system_rfs_set(state, active, s->rfs_entries);
+}
+
+/* drop the share of a device whose state goes away */
+static void system_rfs_release(struct system_dev_state *state)
+{
+	system_rfs_set(state, false, 0);
+}
+
+static void
+system_if_apply_rps_xps(struct device *dev, struct device_settings *s)
+{
+	struct system_dev_state *state;
+	static struct blob_buf b;
+	int width, n_cpus, *cpus;
+
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		return;
+
+	width = system_cpu_width();
+	cpus = calloc(width, sizeof(*cpus));
+	if (!cpus)
+		return;
+
+	n_cpus = system_ps_get_cpus(dev, s, cpus, width);
+
+	blob_buf_init(&b, 0);
+	system_if_plan_queues(dev, s, true, cpus, n_cpus, width, &b);
+	system_if_plan_queues(dev, s, false, cpus, n_cpus, width, &b);
+	free(cpus);
+
+	state = system_dev_state_get(dev);
+	if (!state)
+		return;
+
+	system_if_apply_rfs(state, s);
+
+	free(state->ps_layout);
+	state->ps_layout = blob_memdup(b.head);
+}
+
+static const char * const qdisc_kinds[] = {
+	[DEV_QDISC_FQ_CODEL] = "fq_codel",
+	[DEV_QDISC_CAKE] = "cake",
+	[DEV_QDISC_FQ] = "fq",
+	[DEV_QDISC_MQ] = "mq",
+};
+
+static struct nl_msg *
+system_qdisc_msg(struct device *dev, int cmd, int flags, uint32_t parent, uint32_t handle)
+{
+	struct tcmsg tcm = {
+		.tcm_family = AF_UNSPEC,
+		.tcm_ifindex = dev->ifindex,
+		.tcm_parent = parent,
+		.tcm_handle = handle,
+	};
+	struct nl_msg *msg;
+
+	msg = nlmsg_alloc_simple(cmd, NLM_F_REQUEST | flags);
+	if (!msg)
+		return NULL;
+
+	nlmsg_append(msg, &tcm, sizeof(tcm), 0);
+	return msg;
+}
+
+static int
+system_qdisc_put_kind(struct nl_msg *msg, struct device_settings *s, enum device_qdisc kind)
+{
+	struct nlattr *opts;
+
+	nla_put_string(msg, TCA_KIND, qdisc_kinds[kind]);
+
+	/* mq has no options, and an empty TCA_OPTIONS would make a replace fail */
+	if (kind == DEV_QDISC_MQ)
+		return 0;
+
+	if (!(opts = nla_nest_start(msg, TCA_OPTIONS)))
+		return -1;
+
+	switch (kind) {
+	case DEV_QDISC_FQ_CODEL:
+		if (s->qdisc_target)
+			nla_put_u32(msg, TCA_FQ_CODEL_TARGET, s->qdisc_target);
+		if (s->qdisc_limit)
+			nla_put_u32(msg, TCA_FQ_CODEL_LIMIT, s->qdisc_limit);
+		break;
+	case DEV_QDISC_CAKE:
+		/* bandwidth is configured in kbit/s, cake expects bytes/s */
+		if (s->qdisc_bandwidth)
+			nla_put_u64(msg, TCA_CAKE_BASE_RATE64, s->qdisc_bandwidth * 1000ULL / 8);
+		if (s->qdisc_overhead)
+			nla_put_u32(msg, TCA_CAKE_OVERHEAD, s->qdisc_overhead);
+		break;
+	case DEV_QDISC_FQ:
+		if (s->qdisc_limit)
+			nla_put_u32(msg, TCA_FQ_PLIMIT, s->qdisc_limit);
+		break;
+	default:
+		break;
+	}
+
+	nla_nest_end(msg, opts);
+	return 0;
+}
+
+/*
+ * Replace the root qdisc of the device. For mq, one child qdisc is attached
+ * to every tx queue; those requests are sent to the kernel as one batch.
+ */
+static void
+system_if_apply_qdisc(struct device *dev, struct device_settings *s)
+{
+	struct system_dev_state *state;
+	uint32_t handle = s->qdisc == DEV_QDISC_MQ ? TC_H_MAKE(1 << 16, 0) : 0;
+	struct nl_msg *msg;
+	char path[64];
+	glob_t gl;
+	int i, ret;
+
+	if (s->qdisc == DEV_QDISC_NONE)
+		return;
+
+	state = system_dev_state_get(dev);
+	if (!state)
+		return;
+
+	msg = system_qdisc_msg(dev, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE,
+			       TC_H_ROOT, handle);
+	if (!msg)
+		return;
+
+	if (system_qdisc_put_kind(msg, s, s->qdisc)) {
+		nlmsg_free(msg);
+		return;
+	}
+
+	ret = system_rtnl_call(msg);
+	if (ret) {
+		D(SYSTEM, "Failed to set %s qdisc on '%s': %d\n",
+		  qdisc_kinds[s->qdisc], dev->ifname, ret);
+		return;
+	}
+
+	state->qdisc = true;
+	if (s->qdisc != DEV_QDISC_MQ)
+		return;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/queues/tx-*", dev->ifname);
+	if (glob(path, GLOB_NOSORT, NULL, &gl))
+		return;
+
+	system_batch_begin();
+	for (i = 0; i < gl.gl_pathc; i++) {
+		msg = system_qdisc_msg(dev, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE,
+				       TC_H_MAKE(handle, i + 1), 0);
+		if (!msg)
+			break;
+
+		if (system_qdisc_put_kind(msg, s, s->qdisc_child)) {
+			nlmsg_free(msg);
+			break;
+		}
+
+		system_rtnl_batch_add(msg, NULL);
+	}
+	system_batch_commit();
+
+	globfree(&gl);
+}
+
+/* deleting the root qdisc makes the kernel fall back to its default */
+static void
+system_if_clear_qdisc(struct device *dev)
+{
+	struct system_dev_state *state;
+	struct nl_msg *msg;
+
+	state = system_dev_state_get(dev);
+	if (!state || !state->qdisc)
+		return;
+
+	state->qdisc = false;
+
+	msg = system_qdisc_msg(dev, RTM_DELQDISC, 0, TC_H_ROOT, 0);
+	if (msg)
+		system_rtnl_call_async(msg, NULL, NULL, NULL);
+}
+
+static int system_bpf(int cmd, union bpf_attr *attr)
+{
+#ifdef __NR_bpf
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static const uint32_t xdp_mode_flags[] = {
+	[DEV_XDP_MODE_AUTO] = 0,
+	[DEV_XDP_MODE_GENERIC] = XDP_FLAGS_SKB_MODE,
+	[DEV_XDP_MODE_NATIVE] = XDP_FLAGS_DRV_MODE,
+	[DEV_XDP_MODE_OFFLOAD] = XDP_FLAGS_HW_MODE,
+};
+
+/* attach the program referenced by fd, or detach with fd -1 */
+static int system_if_set_xdp(struct device *dev, int fd, uint32_t flags)
+{
+	struct ifinfomsg ifi = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = dev->ifindex,
+	};
+	struct nlattr *xdp;
+	struct nl_msg *msg;
+
+	msg = nlmsg_alloc_simple(RTM_SETLINK, NLM_F_REQUEST);
+	if (!msg)
+		return -1;
+
+	nlmsg_append(msg, &ifi, sizeof(ifi), 0);
+
+	if (!(xdp = nla_nest_start(msg, IFLA_XDP | NLA_F_NESTED)))
+		goto nla_put_failure;
+
+	nla_put_u32(msg, IFLA_XDP_FD, fd);
+	if (flags)
+		nla_put_u32(msg, IFLA_XDP_FLAGS, flags);
+	nla_nest_end(msg, xdp);
+
+	return system_rtnl_call(msg);
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -ENOMEM;
+}
 
-	if (!system_get_mldversion(dev, buf, sizeof(buf))) {
-		s->mldversion = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_MLDVERSION;
-	}
+/*
+ * Attach the pinned XDP program before the device is brought up, so that no
+ * traffic passes unfiltered. This runs on every setup, which also covers a
+ * device that was removed and created again.
+ */
+static void
+system_if_apply_xdp(struct device *dev, struct device_settings *s)
+{
+	struct system_dev_state *state;
+	struct bpf_prog_info info;
+	union bpf_attr attr;
+	uint32_t flags = xdp_mode_flags[s->xdp_mode];
+	int fd, ret;
 
-	if (!system_get_neigh4reachabletime(dev, buf, sizeof(buf))) {
-		s->neigh4reachabletime = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_NEIGHREACHABLETIME;
-	}
+	if (!s->xdp[0])
+		return;
 
-	if (!system_get_neigh6reachabletime(dev, buf, sizeof(buf))) {
-		s->neigh6reachabletime = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_NEIGHREACHABLETIME;
-	}
+	state = system_dev_state_get(dev);
+	if (!state)
+		return;
 
-	if (!system_get_neigh4locktime(dev, buf, sizeof(buf))) {
-		s->neigh4locktime = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_NEIGHLOCKTIME;
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (uintptr_t) s->xdp;
+	fd = system_bpf(BPF_OBJ_GET, &attr);
+	if (fd < 0) {
+		D(SYSTEM, "Failed to open XDP program '%s': %s\n", s->xdp, strerror(errno));
+		return;
 	}
 
-	if (!system_get_neigh4gcstaletime(dev, buf, sizeof(buf))) {
-		s->neigh4gcstaletime = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_NEIGHGCSTALETIME;
+	ret = system_if_set_xdp(dev, fd, flags);
+	if (ret) {
+		D(SYSTEM, "Failed to attach XDP program '%s' to '%s': %d\n",
+		  s->xdp, dev->ifname, ret);
+		close(fd);
+		return;
 	}
 
-	if (!system_get_neigh6gcstaletime(dev, buf, sizeof(buf))) {
-		s->neigh6gcstaletime = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_NEIGHGCSTALETIME;
-	}
+	state->xdp = true;
+	state->xdp_flags = flags;
+	state->xdp_prog_id = 0;
 
-	if (!system_get_dadtransmits(dev, buf, sizeof(buf))) {
-		s->dadtransmits = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_DADTRANSMITS;
-	}
+	memset(&info, 0, sizeof(info));
+	memset(&attr, 0, sizeof(attr));
+	attr.info.bpf_fd = fd;
+	attr.info.info_len = sizeof(info);
+	attr.info.info = (uintptr_t) &info;
+	if (!system_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr))
+		state->xdp_prog_id = info.id;
 
-	if (!system_get_sendredirects(dev, buf, sizeof(buf))) {
-		s->sendredirects = strtoul(buf, NULL, 0);
-		s->flags |= DEV_OPT_SENDREDIRECTS;
-	}
+	close(fd);
 }
 
 static void
-system_if_set_rps_xps_val(const char *path, int val)
+system_if_clear_xdp(struct device *dev)
 {
-	char val_buf[8];
-	glob_t gl;
-	int i;
+	struct system_dev_state *state;
 
-	if (glob(path, 0, NULL, &gl))
+	state = system_dev_state_get(dev);
+	if (!state || !state->xdp)
 		return;
 
-	snprintf(val_buf, sizeof(val_buf), "%x", val);
-	for (i = 0; i < gl.gl_pathc; i++)
-		system_set_sysctl(gl.gl_pathv[i], val_buf);
-
-	globfree(&gl);
+	state->xdp = false;
+	state->xdp_prog_id = 0;
+	system_if_set_xdp(dev, -1, state->xdp_flags);
 }
 
-static void
-system_if_apply_rps_xps(struct device *dev, struct device_settings *s)
+static int
+system_if_apply_gso_limits(struct device *dev, struct device_settings *s)
 {
-	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
-	int val;
+	struct ifinfomsg ifi = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = dev->ifindex,
+	};
+	struct nl_msg *msg;
+	int i;
 
-	if (n_cpus < 2)
-		return;
+	msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_REQUEST);
+	if (!msg)
+		return -1;
 
-	val = (1 << n_cpus) - 1;
-	snprintf(dev_buf, sizeof(dev_buf), "/sys/class/net/%s/queues/*/rps_cpus", dev->ifname);
-	system_if_set_rps_xps_val(dev_buf, s->rps ? val : 0);
+	nlmsg_append(msg, &ifi, sizeof(ifi), 0);
+	for (i = 0; i < __DEV_GSO_LIMIT_MAX; i++)
+		if (s->gso_mask & (1 << i))
+			nla_put_u32(msg, gso_limit_attrs[i], s->gso[i]);
 
-	snprintf(dev_buf, sizeof(dev_buf), "/sys/class/net/%s/queues/*/xps_cpus", dev->ifname);
-	system_if_set_rps_xps_val(dev_buf, s->xps ? val : 0);
+	return system_rtnl_call(msg);
 }
 
 void
@@ -1424,6 +4208,8 @@ system_if_apply_settings(struct device *dev, struct device_settings *s, unsigned
 	struct ifreq ifr;
 	char buf[12];
 
+	system_devconf_invalidate(dev->ifindex);
+
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, dev->ifname, sizeof(ifr.ifr_name));
 	if (s->flags & DEV_OPT_MTU & apply_mask) {
@@ -1439,6 +4225,11 @@ system_if_apply_settings(struct device *dev, struct device_settings *s, unsigned
 		if (ioctl(sock_ioctl, SIOCSIFTXQLEN, &ifr) < 0)
 			s->flags &= ~DEV_OPT_TXQUEUELEN;
 	}
+	system_if_apply_ethtool(dev, s, apply_mask);
+	if (s->flags & DEV_OPT_GSO_LIMITS & apply_mask) {
+		if (system_if_apply_gso_limits(dev, s))
+			s->flags &= ~DEV_OPT_GSO_LIMITS;
+	}
 	if ((s->flags & DEV_OPT_MACADDR & apply_mask) && !dev->external) {
 		ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
 		memcpy(&ifr.ifr_hwaddr.sa_data, s->macaddr, sizeof(s->macaddr));
@@ -1493,23 +4284,35 @@ system_if_apply_settings(struct device *dev, struct device_settings *s, unsigned
 	}
 	if (s->flags & DEV_OPT_SENDREDIRECTS & apply_mask)
 		system_set_sendredirects(dev, s->sendredirects ? "1" : "0");
+	if (s->flags & DEV_OPT_FEATURES & apply_mask)
+		system_if_apply_features(dev, s);
 
 	system_if_apply_rps_xps(dev, s);
 }
 
 int system_if_up(struct device *dev)
 {
+	/* pending clears must not remove what the kernel adds on up */
+	system_if_clear_bulk();
+
 	system_if_get_settings(dev, &dev->orig_settings);
 	/* Only keep orig settings based on what needs to be set */
 	dev->orig_settings.valid_flags = dev->orig_settings.flags;
 	dev->orig_settings.flags &= dev->settings.flags;
+	dev->orig_settings.features_mask &= dev->settings.features_mask;
+	dev->orig_settings.ethtool_mask &= dev->settings.ethtool_mask;
+	dev->orig_settings.gso_mask &= dev->settings.gso_mask;
 	system_if_apply_settings(dev, &dev->settings, dev->settings.flags);
+	system_if_apply_qdisc(dev, &dev->settings);
+	system_if_apply_xdp(dev, &dev->settings);
 	return system_if_flags(dev->ifname, IFF_UP, 0);
 }
 
 int system_if_down(struct device *dev)
 {
 	int ret = system_if_flags(dev->ifname, 0, IFF_UP);
+	system_if_clear_xdp(dev);
+	system_if_clear_qdisc(dev);
 	system_if_apply_settings(dev, &dev->orig_settings, dev->orig_settings.flags);
 	return ret;
 }
@@ -1559,7 +4362,7 @@ static int cb_if_check_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void
 
 int system_if_check(struct device *dev)
 {
-	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+	struct nl_cb *cb;
 	struct nl_msg *msg;
 	struct ifinfomsg ifi = {
 		.ifi_family = AF_UNSPEC,
@@ -1571,6 +4374,17 @@ int system_if_check(struct device *dev)
 	};
 	int ret = 1;
 
+	if (system_link_cache_ready()) {
+		struct system_link *link = system_link_find(dev->ifname);
+
+		device_set_present(dev, !!link);
+		device_set_link(dev, link && (link->flags & IFF_LOWER_UP));
+
+		return link ? 0 : -ENODEV;
+	}
+
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+
 	msg = nlmsg_alloc_simple(RTM_GETLINK, 0);
 	if (!msg)
 		goto out;
@@ -1583,6 +4397,7 @@ int system_if_check(struct device *dev)
 	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, cb_if_check_ack, &chk);
 	nl_cb_err(cb, NL_CB_CUSTOM, cb_if_check_error, &chk);
 
+	system_rtnl_batch_flush();
 	nl_send_auto_complete(sock_rtnl, msg);
 	while (chk.pending > 0)
 		nl_recvmsgs(sock_rtnl, cb);
@@ -1603,6 +4418,19 @@ system_if_get_parent(struct device *dev)
 	int ifindex, iflink, len;
 	FILE *f;
 
+	if (system_link_cache_ready()) {
+		struct system_link *link = system_link_find(dev->ifname);
+
+		if (!link || !link->link || link->link == link->ifindex)
+			return NULL;
+
+		link = system_link_find_index(link->link);
+		if (!link)
+			return NULL;
+
+		return device_get(link->ifname, true);
+	}
+
 	snprintf(buf, sizeof(buf), "/sys/class/net/%s/iflink", dev->ifname);
 	f = fopen(buf, "r");
 	if (!f)
@@ -1671,25 +4499,71 @@ read_uint64_file(int dir_fd, const char *file, uint64_t *val)
 	return ret;
 }
 
-/* Assume advertised flags == supported flags */
+/* modes of the same speed and duplex are reported once */
 static const struct {
-	uint32_t mask;
+	unsigned int bit;
 	const char *name;
 } ethtool_link_modes[] = {
-	{ ADVERTISED_10baseT_Half, "10H" },
-	{ ADVERTISED_10baseT_Full, "10F" },
-	{ ADVERTISED_100baseT_Half, "100H" },
-	{ ADVERTISED_100baseT_Full, "100F" },
-	{ ADVERTISED_1000baseT_Half, "1000H" },
-	{ ADVERTISED_1000baseT_Full, "1000F" },
+	{ ETHTOOL_LINK_MODE_10baseT_Half_BIT, "10H" },
+	{ ETHTOOL_LINK_MODE_10baseT_Full_BIT, "10F" },
+	{ ETHTOOL_LINK_MODE_100baseT_Half_BIT, "100H" },
+	{ ETHTOOL_LINK_MODE_100baseT_Full_BIT, "100F" },
+	{ ETHTOOL_LINK_MODE_1000baseT_Half_BIT, "1000H" },
+	{ ETHTOOL_LINK_MODE_1000baseT_Full_BIT, "1000F" },
+	{ ETHTOOL_LINK_MODE_1000baseKX_Full_BIT, "1000F" },
+	{ ETHTOOL_LINK_MODE_1000baseX_Full_BIT, "1000F" },
+	{ ETHTOOL_LINK_MODE_2500baseX_Full_BIT, "2500F" },
+	{ ETHTOOL_LINK_MODE_2500baseT_Full_BIT, "2500F" },
+	{ ETHTOOL_LINK_MODE_5000baseT_Full_BIT, "5000F" },
+	{ ETHTOOL_LINK_MODE_10000baseT_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_10000baseKX4_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_10000baseKR_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_10000baseCR_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_10000baseSR_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_10000baseLR_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_10000baseLRM_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_10000baseER_Full_BIT, "10000F" },
+	{ ETHTOOL_LINK_MODE_20000baseMLD2_Full_BIT, "20000F" },
+	{ ETHTOOL_LINK_MODE_20000baseKR2_Full_BIT, "20000F" },
+	{ ETHTOOL_LINK_MODE_25000baseCR_Full_BIT, "25000F" },
+	{ ETHTOOL_LINK_MODE_25000baseKR_Full_BIT, "25000F" },
+	{ ETHTOOL_LINK_MODE_25000baseSR_Full_BIT, "25000F" },
+	{ ETHTOOL_LINK_MODE_40000baseKR4_Full_BIT, "40000F" },
+	{ ETHTOOL_LINK_MODE_40000baseCR4_Full_BIT, "40000F" },
+	{ ETHTOOL_LINK_MODE_40000baseSR4_Full_BIT, "40000F" },
+	{ ETHTOOL_LINK_MODE_40000baseLR4_Full_BIT, "40000F" },
+	{ ETHTOOL_LINK_MODE_50000baseCR2_Full_BIT, "50000F" },
+	{ ETHTOOL_LINK_MODE_50000baseKR2_Full_BIT, "50000F" },
+	{ ETHTOOL_LINK_MODE_50000baseSR2_Full_BIT, "50000F" },
+	{ ETHTOOL_LINK_MODE_56000baseKR4_Full_BIT, "56000F" },
+	{ ETHTOOL_LINK_MODE_56000baseCR4_Full_BIT, "56000F" },
+	{ ETHTOOL_LINK_MODE_56000baseSR4_Full_BIT, "56000F" },
+	{ ETHTOOL_LINK_MODE_56000baseLR4_Full_BIT, "56000F" },
+	{ ETHTOOL_LINK_MODE_100000baseKR4_Full_BIT, "100000F" },
+	{ ETHTOOL_LINK_MODE_100000baseSR4_Full_BIT, "100000F" },
+	{ ETHTOOL_LINK_MODE_100000baseCR4_Full_BIT, "100000F" },
+	{ ETHTOOL_LINK_MODE_100000baseLR4_ER4_Full_BIT, "100000F" },
+	{ ETHTOOL_LINK_MODE_FEC_NONE_BIT, "FEC-none" },
+	{ ETHTOOL_LINK_MODE_FEC_RS_BIT, "FEC-RS" },
+	{ ETHTOOL_LINK_MODE_FEC_BASER_BIT, "FEC-BaseR" },
 };
 
-static void system_add_link_modes(struct blob_buf *b, __u32 mask)
+static void system_add_link_modes(struct blob_buf *b, const __u32 *mask, int nwords)
 {
+	const char *prev = NULL;
+	unsigned int bit;
 	int i;
+
 	for (i = 0; i < ARRAY_SIZE(ethtool_link_modes); i++) {
-		if (mask & ethtool_link_modes[i].mask)
-			blobmsg_add_string(b, NULL, ethtool_link_modes[i].name);
+		bit = ethtool_link_modes[i].bit;
+		if (bit / 32 >= nwords || !(mask[bit / 32] & (1U << (bit % 32))))
+			continue;
+
+		if (prev && !strcmp(prev, ethtool_link_modes[i].name))
+			continue;
+
+		prev = ethtool_link_modes[i].name;
+		blobmsg_add_string(b, NULL, prev);
 	}
 }
 
@@ -1703,56 +4577,372 @@ system_if_force_external(const char *ifname)
 	return stat(buf, &s) == 0;
 }
 
-int
-system_if_dump_info(struct device *dev, struct blob_buf *b)
+static void
+system_if_add_link_info(struct blob_buf *b, __u32 speed, __u8 duplex, __u8 autoneg,
+			const __u32 *masks, int nwords)
 {
-	struct ethtool_cmd ecmd;
-	struct ifreq ifr;
-	char buf[64], *s;
+	char *s;
 	void *c;
-	int dir_fd;
 
-	snprintf(buf, sizeof(buf), "/sys/class/net/%s", dev->ifname);
-	dir_fd = open(buf, O_DIRECTORY);
+	c = blobmsg_open_array(b, "link-advertising");
+	system_add_link_modes(b, masks + nwords, nwords);
+	blobmsg_close_array(b, c);
+
+	c = blobmsg_open_array(b, "link-supported");
+	system_add_link_modes(b, masks, nwords);
+	blobmsg_close_array(b, c);
+
+	c = blobmsg_open_array(b, "link-partner");
+	system_add_link_modes(b, masks + 2 * nwords, nwords);
+	blobmsg_close_array(b, c);
+
+	blobmsg_add_u8(b, "autoneg", autoneg == AUTONEG_ENABLE);
+
+	s = blobmsg_alloc_string_buffer(b, "speed", 8);
+	snprintf(s, 8, "%d%c", speed, duplex == DUPLEX_HALF ? 'H' : 'F');
+	blobmsg_add_string_buffer(b);
+}
+
+/*
+ * Query the link settings with ETHTOOL_GLINKSETTINGS, which first reports the
+ * size of the link mode bitmaps and then fills them. Drivers that only
+ * implement the legacy interface are handled through ETHTOOL_GSET.
+ */
+static void
+system_if_get_link_info(struct device *dev, struct blob_buf *b)
+{
+	struct {
+		struct ethtool_link_settings req;
+		__u32 masks[3 * 127];
+	} ecmd;
+	struct ethtool_cmd legacy;
+	struct ifreq ifr;
+	__u32 masks[3];
+	int nwords;
 
 	memset(&ecmd, 0, sizeof(ecmd));
 	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, dev->ifname);
+	strncpy(ifr.ifr_name, dev->ifname, sizeof(ifr.ifr_name) - 1);
 	ifr.ifr_data = (caddr_t) &ecmd;
-	ecmd.cmd = ETHTOOL_GSET;
+	ecmd.req.cmd = ETHTOOL_GLINKSETTINGS;
+
+	if (ioctl(sock_ioctl, SIOCETHTOOL, &ifr) == 0 &&
+	    ecmd.req.link_mode_masks_nwords < 0) {
+		nwords = -ecmd.req.link_mode_masks_nwords;
+		ecmd.req.cmd = ETHTOOL_GLINKSETTINGS;
+		ecmd.req.link_mode_masks_nwords = nwords;
+
+		if (ioctl(sock_ioctl, SIOCETHTOOL, &ifr) == 0 &&
+		    ecmd.req.link_mode_masks_nwords == nwords) {
+			system_if_add_link_info(b, ecmd.req.speed, ecmd.req.duplex,
+						ecmd.req.autoneg, ecmd.masks, nwords);
+			return;
+		}
+	}
+
+	memset(&legacy, 0, sizeof(legacy));
+	ifr.ifr_data = (caddr_t) &legacy;
+	legacy.cmd = ETHTOOL_GSET;
+
+	if (ioctl(sock_ioctl, SIOCETHTOOL, &ifr) != 0)
+		return;
+
+	masks[0] = legacy.supported;
+	masks[1] = legacy.advertising;
+	masks[2] = legacy.lp_advertising;
+	system_if_add_link_info(b, ethtool_cmd_speed(&legacy), legacy.duplex,
+				legacy.autoneg, masks, 1);
+}
+
+static void system_if_link_info_invalidate(const char *ifname)
+{
+	struct system_dev_state *state;
+
+	state = avl_find_element(&system_dev_tree, ifname, state, node);
+	if (!state)
+		return;
+
+	free(state->link_info);
+	state->link_info = NULL;
+}
+
+int
+system_if_dump_info(struct device *dev, struct blob_buf *b)
+{
+	struct system_dev_state *state = system_dev_state_get(dev);
+	static struct blob_buf lb;
+	struct blob_attr *cur;
+	void *c;
+	int rem;
+
+	/* link info only changes with the link state, see cb_rtnl_event() */
+	if (state && !state->link_info) {
+		blob_buf_init(&lb, 0);
+		system_if_get_link_info(dev, &lb);
+		state->link_info = blob_memdup(lb.head);
+	}
 
-	if (ioctl(sock_ioctl, SIOCETHTOOL, &ifr) == 0) {
-		c = blobmsg_open_array(b, "link-advertising");
-		system_add_link_modes(b, ecmd.advertising);
-		blobmsg_close_array(b, c);
+	if (state && state->link_info) {
+		blob_for_each_attr(cur, state->link_info, rem)
+			blobmsg_add_blob(b, cur);
+	} else if (!state) {
+		system_if_get_link_info(dev, b);
+	}
 
-		c = blobmsg_open_array(b, "link-supported");
-		system_add_link_modes(b, ecmd.supported);
-		blobmsg_close_array(b, c);
+	if (state) {
+		c = blobmsg_open_table(b, "sysctl");
+		blobmsg_add_u32(b, "issued", state->issued);
+		blobmsg_add_u32(b, "suppressed", state->suppressed);
+		blobmsg_close_table(b, c);
+	}
 
-		s = blobmsg_alloc_string_buffer(b, "speed", 8);
-		snprintf(s, 8, "%d%c", ethtool_cmd_speed(&ecmd),
-			ecmd.duplex == DUPLEX_HALF ? 'H' : 'F');
-		blobmsg_add_string_buffer(b);
+	if (state && state->ps_layout) {
+		blob_for_each_attr(cur, state->ps_layout, rem)
+			blobmsg_add_blob(b, cur);
 	}
 
-	close(dir_fd);
+	if (state && state->xdp)
+		blobmsg_add_u32(b, "xdp_prog_id", state->xdp_prog_id);
+
 	return 0;
 }
 
-int
-system_if_dump_stats(struct device *dev, struct blob_buf *b)
+/*
+ * Interface statistics for all devices, fetched with a single RTM_GETSTATS
+ * dump (or an RTM_GETLINK dump on kernels without it) and reused for a short
+ * window, so that a status request for every device costs one round trip.
+ */
+struct system_stats {
+	struct avl_node node;
+	int ifindex;
+	struct rtnl_link_stats64 stats;
+	struct rtnl_link_stats64 cpu_hit;
+	bool has_cpu_hit;
+};
+
+static struct {
+	struct avl_tree tree;
+	uint64_t time;
+	unsigned int window;
+	bool init;
+	bool no_getstats;
+} stats_cache = {
+	.window = 500,
+};
+
+#define STATS64_FIELD(_name) { #_name, offsetof(struct rtnl_link_stats64, _name) }
+
+static const struct {
+	const char *name;
+	size_t offset;
+} stats64_fields[] = {
+	STATS64_FIELD(collisions),     STATS64_FIELD(rx_frame_errors),   STATS64_FIELD(tx_compressed),
+	STATS64_FIELD(multicast),      STATS64_FIELD(rx_length_errors),  STATS64_FIELD(tx_dropped),
+	STATS64_FIELD(rx_bytes),       STATS64_FIELD(rx_missed_errors),  STATS64_FIELD(tx_errors),
+	STATS64_FIELD(rx_compressed),  STATS64_FIELD(rx_over_errors),    STATS64_FIELD(tx_fifo_errors),
+	STATS64_FIELD(rx_crc_errors),  STATS64_FIELD(rx_packets),        STATS64_FIELD(tx_heartbeat_errors),
+	STATS64_FIELD(rx_dropped),     STATS64_FIELD(tx_aborted_errors), STATS64_FIELD(tx_packets),
+	STATS64_FIELD(rx_errors),      STATS64_FIELD(tx_bytes),          STATS64_FIELD(tx_window_errors),
+	STATS64_FIELD(rx_fifo_errors), STATS64_FIELD(tx_carrier_errors),
+};
+
+void system_set_stats_cache(unsigned int msec)
+{
+	stats_cache.window = msec;
+}
+
+static void system_stats_copy(struct rtnl_link_stats64 *dest, struct nlattr *attr)
+{
+	int len = nla_len(attr);
+
+	if (len > sizeof(*dest))
+		len = sizeof(*dest);
+
+	memcpy(dest, nla_data(attr), len);
+}
+
+static struct system_stats *system_stats_add(int ifindex)
+{
+	struct system_stats *st;
+
+	st = avl_find_element(&stats_cache.tree, &ifindex, st, node);
+	if (st)
+		return st;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+
+	st->ifindex = ifindex;
+	st->node.key = &st->ifindex;
+	avl_insert(&stats_cache.tree, &st->node);
+
+	return st;
+}
+
+static int cb_stats_getstats(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nh = nlmsg_hdr(msg);
+	struct if_stats_msg *ifsm = NLMSG_DATA(nh);
+	struct nlattr *tb[IFLA_STATS_MAX + 1];
+	struct nlattr *tb_off[IFLA_OFFLOAD_XSTATS_MAX + 1];
+	struct system_stats *st;
+
+	if (nh->nlmsg_type != RTM_NEWSTATS)
+		return NL_SKIP;
+
+	if (nlmsg_parse(nh, sizeof(*ifsm), tb, IFLA_STATS_MAX, NULL) < 0 ||
+	    !tb[IFLA_STATS_LINK_64])
+		return NL_SKIP;
+
+	st = system_stats_add(ifsm->ifindex);
+	if (!st)
+		return NL_SKIP;
+
+	system_stats_copy(&st->stats, tb[IFLA_STATS_LINK_64]);
+
+	if (tb[IFLA_STATS_LINK_OFFLOAD_XSTATS] &&
+	    nla_parse_nested(tb_off, IFLA_OFFLOAD_XSTATS_MAX,
+			     tb[IFLA_STATS_LINK_OFFLOAD_XSTATS], NULL) >= 0 &&
+	    tb_off[IFLA_OFFLOAD_XSTATS_CPU_HIT]) {
+		system_stats_copy(&st->cpu_hit, tb_off[IFLA_OFFLOAD_XSTATS_CPU_HIT]);
+		st->has_cpu_hit = true;
+	}
+
+	return NL_OK;
+}
+
+static int cb_stats_getlink(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nh = nlmsg_hdr(msg);
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct nlattr *tb[IFLA_MAX + 1];
+	struct system_stats *st;
+
+	if (nh->nlmsg_type != RTM_NEWLINK || ifi->ifi_family == AF_BRIDGE)
+		return NL_SKIP;
+
+	if (nlmsg_parse(nh, sizeof(*ifi), tb, IFLA_MAX, NULL) < 0 ||
+	    !tb[IFLA_STATS64])
+		return NL_SKIP;
+
+	st = system_stats_add(ifi->ifi_index);
+	if (!st)
+		return NL_SKIP;
+
+	system_stats_copy(&st->stats, tb[IFLA_STATS64]);
+
+	return NL_OK;
+}
+
+static int system_stats_dump(int type, void *req, size_t len,
+			     int (*cb_valid)(struct nl_msg *, void *))
+{
+	struct nl_cb *cb;
+	int ret;
+
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cb)
+		return -NLE_NOMEM;
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_valid, NULL);
+
+	system_rtnl_batch_flush();
+	ret = nl_send_simple(sock_rtnl, type, NLM_F_DUMP, req, len);
+	if (ret >= 0)
+		ret = nl_recvmsgs(sock_rtnl, cb);
+
+	nl_cb_put(cb);
+
+	return ret;
+}
+
+static void system_stats_flush(void)
+{
+	struct system_stats *st, *tmp;
+
+	avl_remove_all_elements(&stats_cache.tree, st, node, tmp)
+		free(st);
+}
+
+static void system_stats_fill(void)
 {
-	const char *const counters[] = {
-		"collisions",     "rx_frame_errors",   "tx_compressed",
-		"multicast",      "rx_length_errors",  "tx_dropped",
-		"rx_bytes",       "rx_missed_errors",  "tx_errors",
-		"rx_compressed",  "rx_over_errors",    "tx_fifo_errors",
-		"rx_crc_errors",  "rx_packets",        "tx_heartbeat_errors",
-		"rx_dropped",     "tx_aborted_errors", "tx_packets",
-		"rx_errors",      "tx_bytes",          "tx_window_errors",
-		"rx_fifo_errors", "tx_carrier_errors",
+	struct if_stats_msg ifsm = {
+		.family = AF_UNSPEC,
+		.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64) |
+			       IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_OFFLOAD_XSTATS),
 	};
+	struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+	int ret;
+
+	system_stats_flush();
+
+	if (!stats_cache.no_getstats) {
+		ret = system_stats_dump(RTM_GETSTATS, &ifsm, sizeof(ifsm), cb_stats_getstats);
+		if (ret >= 0)
+			return;
+
+		/* kernels before 4.7 only provide IFLA_STATS64 in link dumps */
+		if (ret == -NLE_OPNOTSUPP) {
+			D(SYSTEM, "RTM_GETSTATS not supported, using RTM_GETLINK\n");
+			stats_cache.no_getstats = true;
+		}
+
+		system_stats_flush();
+	}
+
+	if (system_stats_dump(RTM_GETLINK, &ifi, sizeof(ifi), cb_stats_getlink) < 0)
+		system_stats_flush();
+}
+
+static struct system_stats *system_stats_get(struct device *dev)
+{
+	struct system_stats *st;
+	uint64_t now = system_rtnl_time();
+
+	if (!stats_cache.init) {
+		avl_init(&stats_cache.tree, avl_ifindex_cmp, false, NULL);
+		stats_cache.init = true;
+	}
+
+	if (!dev->ifindex)
+		return NULL;
+
+	if (!stats_cache.time || now - stats_cache.time >= stats_cache.window * 1000ULL) {
+		system_stats_fill();
+		stats_cache.time = now;
+	}
+
+	return avl_find_element(&stats_cache.tree, &dev->ifindex, st, node);
+}
+
+void system_stats_invalidate(void)
+{
+	stats_cache.time = 0;
+}
+
+int system_if_get_stats(struct device *dev, struct device_counters *c)
+{
+	struct system_stats *st = system_stats_get(dev);
+
+	if (!st)
+		return -1;
+
+	c->rx_bytes = st->stats.rx_bytes;
+	c->tx_bytes = st->stats.tx_bytes;
+	c->rx_packets = st->stats.rx_packets;
+	c->tx_packets = st->stats.tx_packets;
+	c->rx_dropped = st->stats.rx_dropped;
+	c->tx_dropped = st->stats.tx_dropped;
+	c->rx_errors = st->stats.rx_errors;
+	c->tx_errors = st->stats.tx_errors;
+
+	return 0;
+}
+
+static int
+system_if_dump_stats_sysfs(struct device *dev, struct blob_buf *b)
+{
 	char buf[64];
 	int stats_dir;
 	int i;
@@ -1763,15 +4953,42 @@ system_if_dump_stats(struct device *dev, struct blob_buf *b)
 	if (stats_dir < 0)
 		return -1;
 
-	for (i = 0; i < ARRAY_SIZE(counters); i++)
-		if (read_uint64_file(stats_dir, counters[i], &val))
-			blobmsg_add_u64(b, counters[i], val);
+	for (i = 0; i < ARRAY_SIZE(stats64_fields); i++)
+		if (read_uint64_file(stats_dir, stats64_fields[i].name, &val))
+			blobmsg_add_u64(b, stats64_fields[i].name, val);
 
 	close(stats_dir);
 	return 0;
 }
 
-static int system_addr(struct device *dev, struct device_addr *addr, int cmd)
+int
+system_if_dump_stats(struct device *dev, struct blob_buf *b)
+{
+	struct system_stats *st = system_stats_get(dev);
+	void *c;
+	int i;
+
+	if (!st)
+		return system_if_dump_stats_sysfs(dev, b);
+
+	for (i = 0; i < ARRAY_SIZE(stats64_fields); i++)
+		blobmsg_add_u64(b, stats64_fields[i].name,
+				*(uint64_t *) ((char *) &st->stats + stats64_fields[i].offset));
+
+	if (st->has_cpu_hit) {
+		c = blobmsg_open_table(b, "cpu_hit");
+		blobmsg_add_u64(b, "rx_packets", st->cpu_hit.rx_packets);
+		blobmsg_add_u64(b, "tx_packets", st->cpu_hit.tx_packets);
+		blobmsg_add_u64(b, "rx_bytes", st->cpu_hit.rx_bytes);
+		blobmsg_add_u64(b, "tx_bytes", st->cpu_hit.tx_bytes);
+		blobmsg_close_table(b, c);
+	}
+
+	return 0;
+}
+
+static int system_addr(struct device *dev, struct device_addr *addr, int cmd,
+		       struct system_request **req, system_request_cb cb)
 {
 	bool v4 = ((addr->flags & DEVADDR_FAMILY) == DEVADDR_INET4);
 	int alen = v4 ? 4 : 16;
@@ -1783,6 +5000,9 @@ static int system_addr(struct device *dev, struct device_addr *addr, int cmd)
 	};
 
 	struct nl_msg *msg;
+
+	system_if_clear_bulk();
+
 	if (cmd == RTM_NEWADDR)
 		flags |= NLM_F_CREATE | NLM_F_REPLACE;
 
@@ -1798,6 +5018,15 @@ static int system_addr(struct device *dev, struct device_addr *addr, int cmd)
 		if (addr->point_to_point)
 			nla_put_u32(msg, IFA_ADDRESS, addr->point_to_point);
 	} else {
+		if (cmd == RTM_NEWADDR && (addr->flags & DEVADDR_OFFLINK))
+			nla_put_u32(msg, IFA_FLAGS, IFA_F_NOPREFIXROUTE);
+	}
+
+	/*
+	 * the kernel removes the address once its lifetime is over; an expired
+	 * address is not added again, but can always be deleted
+	 */
+	if (cmd == RTM_NEWADDR && (!v4 || addr->valid_until)) {
 		time_t now = system_get_rtime();
 		struct ifa_cacheinfo cinfo = {0xffffffffU, 0xffffffffU, 0, 0};
 
@@ -1824,25 +5053,35 @@ static int system_addr(struct device *dev, struct device_addr *addr, int cmd)
 		}
 
 		nla_put(msg, IFA_CACHEINFO, sizeof(cinfo), &cinfo);
-
-		if (cmd == RTM_NEWADDR && (addr->flags & DEVADDR_OFFLINK))
-			nla_put_u32(msg, IFA_FLAGS, IFA_F_NOPREFIXROUTE);
 	}
 
+	if (cmd == RTM_DELADDR || req)
+		return system_rtnl_call_async(msg, cb, addr, req);
+
+	if (rtnl_batch.depth)
+		return system_rtnl_batch_add(msg, &addr->failed);
+
 	return system_rtnl_call(msg);
 }
 
 int system_add_address(struct device *dev, struct device_addr *addr)
 {
-	return system_addr(dev, addr, RTM_NEWADDR);
+	return system_addr(dev, addr, RTM_NEWADDR, NULL, NULL);
+}
+
+int system_add_address_async(struct device *dev, struct device_addr *addr,
+			     struct system_request **req, system_request_cb cb)
+{
+	return system_addr(dev, addr, RTM_NEWADDR, req, cb);
 }
 
 int system_del_address(struct device *dev, struct device_addr *addr)
 {
-	return system_addr(dev, addr, RTM_DELADDR);
+	return system_addr(dev, addr, RTM_DELADDR, NULL, NULL);
 }
 
-static int system_rt(struct device *dev, struct device_route *route, int cmd)
+static int system_rt(struct device *dev, struct device_route *route, int cmd,
+		     struct system_request **req, system_request_cb cb)
 {
 	int alen = ((route->flags & DEVADDR_FAMILY) == DEVADDR_INET4) ? 4 : 16;
 	bool have_gw;
@@ -1871,6 +5110,8 @@ static int system_rt(struct device *dev, struct device_route *route, int cmd)
 	};
 	struct nl_msg *msg;
 
+	system_if_clear_bulk();
+
 	if (cmd == RTM_NEWROUTE) {
 		flags |= NLM_F_CREATE | NLM_F_REPLACE;
 
@@ -1930,6 +5171,20 @@ static int system_rt(struct device *dev, struct device_route *route, int cmd)
 	if (table >= 256)
 		nla_put_u32(msg, RTA_TABLE, table);
 
+	/* only IPv6 routes can expire in the kernel */
+	if (cmd == RTM_NEWROUTE && alen == 16 && route->valid_until) {
+		int64_t valid = route->valid_until - system_get_rtime();
+
+		if (valid <= 0) {
+			nlmsg_free(msg);
+			return -1;
+		} else if (valid > UINT32_MAX) {
+			valid = UINT32_MAX;
+		}
+
+		nla_put_u32(msg, RTA_EXPIRES, valid);
+	}
+
 	if (route->flags & DEVROUTE_MTU) {
 		struct nlattr *metrics;
 
@@ -1941,6 +5196,12 @@ static int system_rt(struct device *dev, struct device_route *route, int cmd)
 		nla_nest_end(msg, metrics);
 	}
 
+	if (cmd == RTM_DELROUTE || req)
+		return system_rtnl_call_async(msg, cb, route, req);
+
+	if (rtnl_batch.depth)
+		return system_rtnl_batch_add(msg, &route->failed);
+
 	return system_rtnl_call(msg);
 
 nla_put_failure:
@@ -1950,12 +5211,18 @@ nla_put_failure:
 
 int system_add_route(struct device *dev, struct device_route *route)
 {
-	return system_rt(dev, route, RTM_NEWROUTE);
+	return system_rt(dev, route, RTM_NEWROUTE, NULL, NULL);
+}
+
+int system_add_route_async(struct device *dev, struct device_route *route,
+			   struct system_request **req, system_request_cb cb)
+{
+	return system_rt(dev, route, RTM_NEWROUTE, req, cb);
 }
 
 int system_del_route(struct device *dev, struct device_route *route)
 {
-	return system_rt(dev, route, RTM_DELROUTE);
+	return system_rt(dev, route, RTM_DELROUTE, NULL, NULL);
 }
 
 int system_flush_routes(void)
@@ -2252,6 +5519,8 @@ static int tunnel_ioctl(const char *name, int cmd, void *p)
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
 	ifr.ifr_ifru.ifru_data = p;
+	system_link_cache_dirty();
+	system_devconf_invalidate(if_nametoindex(name));
 	return ioctl(sock_ioctl, cmd, &ifr);
 }
 
@@ -151,10 +151,16 @@ static inline int system_get_addr_len(unsigned int flags)
 }
 
 int system_init(void);
+void system_dump_status(struct blob_buf *b);
 
 int system_bridge_addbr(struct device *bridge, struct bridge_config *cfg);
 int system_bridge_delbr(struct device *bridge);
-int system_bridge_addif(struct device *bridge, struct device *dev);
+int system_bridge_reload(struct device *bridge, struct bridge_config *cfg);
+/*
+ * While a batch is open, the port is enslaved on commit, and *failed is set
+ * if the kernel rejects it.
+ */
+int system_bridge_addif(struct device *bridge, struct device *dev, bool *failed);
 int system_bridge_delif(struct device *bridge, struct device *dev);
 
 int system_macvlan_add(struct device *macvlan, struct device *dev, struct macvlan_config *cfg);
@@ -171,6 +177,9 @@ int system_vlandev_del(struct device *vlandev);
 
 void system_if_get_settings(struct device *dev, struct device_settings *s);
 void system_if_clear_state(struct device *dev);
+void system_if_clear_state_begin(void);
+void system_if_clear_state_commit(void);
+void system_if_free_state(struct device *dev);
 int system_if_up(struct device *dev);
 int system_if_down(struct device *dev);
 int system_if_check(struct device *dev);
@@ -178,15 +187,44 @@ int system_if_resolve(struct device *dev);
 
 int system_if_dump_info(struct device *dev, struct blob_buf *b);
 int system_if_dump_stats(struct device *dev, struct blob_buf *b);
+void system_set_stats_cache(unsigned int msec);
+void system_stats_invalidate(void);
+int system_if_get_stats(struct device *dev, struct device_counters *c);
+void system_set_event_filter(const int *ifindex, int n);
 struct device *system_if_get_parent(struct device *dev);
 bool system_if_force_external(const char *ifname);
 void system_if_apply_settings(struct device *dev, struct device_settings *s,
 			      unsigned int apply_mask);
 
+/*
+ * Between system_batch_begin() and system_batch_commit(), address and route
+ * requests are queued and sent to the kernel in bulk. Queued additions
+ * return 0; if the kernel rejects one, the 'failed' flag of the passed
+ * address/route is set on commit, so it must remain allocated until then.
+ */
+void system_batch_begin(void);
+int system_batch_commit(void);
+
+/*
+ * Asynchronous requests are sent from the event loop (or on batch commit)
+ * and complete by calling cb with the address/route and the kernel's error
+ * code; *req points to the pending request until then. Deletions are always
+ * sent this way, without a callback. Call system_request_cancel() before
+ * freeing an address/route with a pending request.
+ */
+struct system_request;
+typedef void (*system_request_cb)(void *priv, int error);
+
+void system_request_cancel(struct system_request **req);
+
 int system_add_address(struct device *dev, struct device_addr *addr);
+int system_add_address_async(struct device *dev, struct device_addr *addr,
+			     struct system_request **req, system_request_cb cb);
 int system_del_address(struct device *dev, struct device_addr *addr);
 
 int system_add_route(struct device *dev, struct device_route *route);
+int system_add_route_async(struct device *dev, struct device_route *route,
+			   struct system_request **req, system_request_cb cb);
 int system_del_route(struct device *dev, struct device_route *route);
 int system_flush_routes(void);
 
@@ -109,6 +109,17 @@ netifd_get_proto_handlers(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+static int
+netifd_handle_system_status(struct ubus_context *ctx, struct ubus_object *obj,
+			    struct ubus_request_data *req, const char *method,
+			    struct blob_attr *msg)
+{
+	blob_buf_init(&b, 0);
+	system_dump_status(&b);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
 
 enum {
 	DI_NAME,
@@ -172,6 +183,7 @@ static struct ubus_method main_object_methods[] = {
 	UBUS_METHOD("add_host_route", netifd_add_host_route, route_policy),
 	{ .name = "get_proto_handlers", .handler = netifd_get_proto_handlers },
 	UBUS_METHOD("add_dynamic", netifd_add_dynamic, dynamic_policy),
+	{ .name = "system_status", .handler = netifd_handle_system_status },
 };
 
 static struct ubus_object_type main_object_type =
@@ -216,6 +228,32 @@ netifd_dev_status(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+static int
+netifd_dev_rates(struct ubus_context *ctx, struct ubus_object *obj,
+		 struct ubus_request_data *req, const char *method,
+		 struct blob_attr *msg)
+{
+	struct device *dev = NULL;
+	struct blob_attr *tb[__DEV_MAX];
+
+	blobmsg_parse(dev_policy, __DEV_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (tb[DEV_NAME]) {
+		dev = device_find(blobmsg_data(tb[DEV_NAME]));
+		if (!dev)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+
+		if (!dev->stats)
+			return UBUS_STATUS_NOT_FOUND;
+	}
+
+	blob_buf_init(&b, 0);
+	device_dump_rates(&b, dev);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
 enum {
 	ALIAS_ATTR_ALIAS,
 	ALIAS_ATTR_DEV,
@@ -303,6 +341,7 @@ netifd_handle_set_state(struct ubus_context *ctx, struct ubus_object *obj,
 
 static struct ubus_method dev_object_methods[] = {
 	UBUS_METHOD("status", netifd_dev_status, dev_policy),
+	UBUS_METHOD("rates", netifd_dev_rates, dev_policy),
 	UBUS_METHOD("set_alias", netifd_handle_alias, alias_attrs),
 	UBUS_METHOD("set_state", netifd_handle_set_state, dev_state_policy),
 };
@@ -574,46 +613,42 @@ interface_ip_dump_prefix_assignment_list(struct interface *iface)
 	const int buflen = INET6_ADDRSTRLEN;
 	time_t now = system_get_rtime();
 
-	struct device_prefix *prefix;
-	list_for_each_entry(prefix, &prefixes, head) {
-		struct device_prefix_assignment *assign;
-		list_for_each_entry(assign, &prefix->assignments, head) {
-			if (strcmp(assign->name, iface->name))
-				continue;
+	struct device_prefix_assignment *assign;
+	list_for_each_entry(assign, &iface->assignments, iface_head) {
+		struct device_prefix *prefix = assign->prefix;
 
-			struct in6_addr addr = prefix->addr;
-			addr.s6_addr32[1] |= htonl(assign->assigned);
+		struct in6_addr addr = prefix->addr;
+		addr.s6_addr32[1] |= htonl(assign->assigned);
 
-			a = blobmsg_open_table(&b, NULL);
-
-			buf = blobmsg_alloc_string_buffer(&b, "address", buflen);
-			inet_ntop(AF_INET6, &addr, buf, buflen);
-			blobmsg_add_string_buffer(&b);
+		a = blobmsg_open_table(&b, NULL);
 
-			blobmsg_add_u32(&b, "mask", assign->length);
+		buf = blobmsg_alloc_string_buffer(&b, "address", buflen);
+		inet_ntop(AF_INET6, &addr, buf, buflen);
+		blobmsg_add_string_buffer(&b);
 
-			if (prefix->preferred_until) {
-				int preferred = prefix->preferred_until - now;
-				if (preferred < 0)
-					preferred = 0;
-				blobmsg_add_u32(&b, "preferred", preferred);
-			}
+		blobmsg_add_u32(&b, "mask", assign->length);
 
-			if (prefix->valid_until)
-				blobmsg_add_u32(&b, "valid", prefix->valid_until - now);
+		if (prefix->preferred_until) {
+			int preferred = prefix->preferred_until - now;
+			if (preferred < 0)
+				preferred = 0;
+			blobmsg_add_u32(&b, "preferred", preferred);
+		}
 
-			void *c = blobmsg_open_table(&b, "local-address");
-			if (assign->enabled) {
-				buf = blobmsg_alloc_string_buffer(&b, "address", buflen);
-				inet_ntop(AF_INET6, &assign->addr, buf, buflen);
-				blobmsg_add_string_buffer(&b);
+		if (prefix->valid_until)
+			blobmsg_add_u32(&b, "valid", prefix->valid_until - now);
 
-				blobmsg_add_u32(&b, "mask", assign->length < 64 ? 64 : assign->length);
-			}
-			blobmsg_close_table(&b, c);
+		void *c = blobmsg_open_table(&b, "local-address");
+		if (assign->enabled) {
+			buf = blobmsg_alloc_string_buffer(&b, "address", buflen);
+			inet_ntop(AF_INET6, &assign->addr, buf, buflen);
+			blobmsg_add_string_buffer(&b);
 
-			blobmsg_close_table(&b, a);
+			blobmsg_add_u32(&b, "mask", assign->length < 64 ? 64 : assign->length);
 		}
+		blobmsg_close_table(&b, c);
+
+		blobmsg_close_table(&b, a);
 	}
 }
 
@@ -87,6 +87,10 @@ vlandev_set_up(struct vlandev_device *mvdev)
 	if (ret < 0)
 		return ret;
 
+	/* applied with the other settings once the device is up */
+	if (device_reset_gso_limits(&mvdev->dev))
+		device_inherit_gso_limits(&mvdev->dev, mvdev->parent.dev);
+
 	ret = system_vlandev_add(&mvdev->dev, mvdev->parent.dev, &mvdev->config);
 	if (ret < 0)
 		goto release;